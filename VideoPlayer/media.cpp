@@ -1,4 +1,22 @@
 #include "media.h"
+#include "../external/stb_image.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MEDIA_HAVE_SSE2
+#endif
+
+//SSE4.1 and AVX2 kernels are compiled per function and chosen at runtime, the rest of the file keeps the baseline instruction set.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define MEDIA_HAVE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MEDIA_TARGET(features)
+#else
+#define MEDIA_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
 
 
 //Return 0 if successful, return -1 if failure.
@@ -18,6 +36,15 @@ int malloc_media_container(MediaContainer* media, int mode) {
 	media->codec_description.video_codec_context = NULL;
 	media->codec_description.audio_codec_context = NULL;
 
+	media->m_demux_eof = false;
+	media->m_decode_quality = MEDIA_DECODE_QUALITY_FULL;
+
+	media->keyframe_index.keyframes.clear();
+	media->keyframe_index.end_pts = 0;
+	media->keyframe_index.built = false;
+
+	media_encoder_options_init(&media->codec_description.m_encoder_options, MEDIA_ENCODER_PROFILE_DEFAULT);
+
 	media->type = static_cast<media_type>(mode);
 
 	return 0;
@@ -30,55 +57,126 @@ void free_media_container(MediaContainer* media) {
 	avformat_close_input(&media->format_context);
 }
 
+//Input half of open_media, errors are handed back instead of submitted so it is safe to run on worker threads.
+static int media_open_input(MediaContainer* media, const char* filename, std::string& error, int& level) {
+	media->format_context = avformat_alloc_context();
+	if (!media->format_context) {
+		error = "Media format could not be allocated on memory!";
+		level = MEDIA_ERROR_CRITICAL;
+		return -1;
+	}
+
+	if (avformat_open_input(&media->format_context, filename, NULL, NULL) != 0) {
+		error = "File could not be opened";
+		level = MEDIA_ERROR_CRITICAL;
+		return -1;
+	}
+
+	if (avformat_find_stream_info(media->format_context, NULL) < 0) {
+		error = "Could not find stream information in container!";
+		level = MEDIA_ERROR_WARNING;
+		return -1;
+	}
+	return 0;
+}
+
+//Output half of open_media, same contract as media_open_input.
+static int media_open_output(MediaContainer* media, const char* filename, std::string& error, int& level) {
+	//Here different file types will be analyzed and different file types will write different headers.
+	if (avformat_alloc_output_context2(&media->format_context, NULL, NULL, filename) < 0 || !media->format_context) {
+		error = "Output format failed to be allocated! : ";
+		level = MEDIA_ERROR_CRITICAL;
+		return -1;
+	}
+
+	if (media->format_context->oformat->flags & AVFMT_NOFILE) {
+		error = "Output file could not be opened due to format flags null!";
+		level = MEDIA_ERROR_CRITICAL;
+		return -1;
+	}
+
+	if (avio_open(&media->format_context->pb, filename, AVIO_FLAG_WRITE) < 0) {
+		error = "File could not be opened";
+		level = MEDIA_ERROR_CRITICAL;
+		return -1;
+	}
+	//Header contains num of stream information, which haven't been added yet! So I must first copy streams and then write header.
+	return 0;
+}
+
+//open_media for worker threads, a failure is handed back as text and never ends the process.
+static int media_open_quiet(MediaContainer* media, const char* filename, std::string& error) {
+	int level = MEDIA_ERROR_WARNING;
+	int result = media->type == MEDIA_FILE_INPUT ? media_open_input(media, filename, error, level) : media_open_output(media, filename, error, level);
+	if (result < 0) {
+		error += std::string(" (") + filename + ")";
+	}
+	return result;
+}
+
 int open_media(MediaContainer* media, const char* filename) {
+	std::string error;
+	int level = MEDIA_ERROR_WARNING;
 	if (media->type == MEDIA_FILE_INPUT) {
-		media->format_context = avformat_alloc_context();
-		if (!media->format_context) {
-			media_error_submit("Media format could not be allocated on memory!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		if (media_open_input(media, filename, error, level) < 0) {
+			media_error_submit(error, __FILE__, level, __LINE__, __FUNCTION__);
 			return -1;
 		}
-
-		if (avformat_open_input(&media->format_context, filename, NULL, NULL) == 0) {
-			std::cout << "Opening File: " << filename << ", File Format: " << media->format_context->iformat->long_name << std::endl;
-		}
-		else {
-			media_error_submit("File could not be opened", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		std::cout << "Opening File: " << filename << ", File Format: " << media->format_context->iformat->long_name << std::endl;
+		return 0;
+	}
+	else {
+		if (media_open_output(media, filename, error, level) < 0) {
+			media_error_submit(error, __FILE__, level, __LINE__, __FUNCTION__);
 			return -1;
 		}
+		return 0;
+	}
+}
 
-		if (avformat_find_stream_info(media->format_context, NULL) < 0) {
-			media_error_submit("Could not find stream information in container!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
-			return -1;
-		}
-		else {
-			return 0;
-		}
+//Only formats without an index at the end can be cut at a packet boundary and appended to, MP4 needs its moov from the trailer.
+static bool media_output_resumable(MediaContainer* media) {
+	return media->format_context && strcmp(media->format_context->oformat->name, "mpegts") == 0;
+}
+
+int open_media_resume(MediaContainer* media, const char* filename, const MediaTranscodeCheckpoint* checkpoint) {
+	if (media->type != MEDIA_FILE_OUTPUT) {
+		media_error_submit("Only output files can be resumed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
 	}
-	else {
-		//Here different file types will be analyzed and different file types will write different headers.
-		int resp;
-		resp = avformat_alloc_output_context2(&media->format_context, NULL, NULL, filename);
-		if (!resp) {
-			if (!(media->format_context->oformat->flags & AVFMT_NOFILE)) {
-				resp = avio_open(&media->format_context->pb, filename, AVIO_FLAG_WRITE);
-				if (resp < 0) {
-					media_error_submit("File could not be opened", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
-					return -1;
-				}
-			}
-			else {
-				media_error_submit("Output file could not be opened due to format flags null!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
-				return -1;
-			}
-			//Header contains num of stream information, which haven't been added yet! So I must first copy streams and then write header.
-			return 0; 
-		}
-		else { 
-			media_error_submit("Output format failed to be allocated! : ", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
-			return - 1; 
-		}
+
+	if (avformat_alloc_output_context2(&media->format_context, NULL, NULL, filename) < 0 || !media->format_context) {
+		media_error_submit("Output format failed to be allocated! : ", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	if (!media_output_resumable(media)) {
+		media_error_submit("Output format cannot be resumed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	//Anything past the checkpoint was written after the last consistent point, cut it off before appending.
+#ifdef WINDOWS_SYSTEM
+	HANDLE file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER offset;
+	offset.QuadPart = checkpoint->output_offset;
+	bool truncated = file != INVALID_HANDLE_VALUE && SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+#else
+	bool truncated = truncate(filename, checkpoint->output_offset) == 0;
+#endif
+	if (!truncated) {
+		media_error_submit("Output could not be cut back to the checkpoint!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
 	}
 
+	//Read and write keeps the file instead of truncating it to zero.
+	if (avio_open(&media->format_context->pb, filename, AVIO_FLAG_READ_WRITE) < 0 || avio_seek(media->format_context->pb, checkpoint->output_offset, SEEK_SET) < 0) {
+		media_error_submit("File could not be opened", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
 }
 
 int open_media_write_header(MediaContainer* media) {
@@ -108,6 +206,24 @@ int open_media_write_packet(MediaContainer* media, MediaPacket* packet) {
 	return 0;
 }
 
+int open_media_write_packets(MediaContainer* media, std::vector<MediaPacket>& packets) {
+	bool failure = false;
+	for (MediaPacket& packet : packets) {
+		if (open_media_write_packet(media, &packet) < 0) {
+			failure = true;
+		}
+		free_media_packet(&packet);
+	}
+	packets.clear();
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
+
 int open_media_write_trailer(MediaContainer* media) {
 	if (media->type != MEDIA_FILE_OUTPUT) {
 		media_error_submit("Cannot write to an input file!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
@@ -125,6 +241,15 @@ int open_media_write_trailer(MediaContainer* media) {
 void reset_input_container_state(MediaContainer* media) {
 	av_seek_frame(media->format_context, media->m_video_stream_index, 0, AVSEEK_FLAG_ANY);
 	av_seek_frame(media->format_context, media->m_audio_stream_index, 0, AVSEEK_FLAG_ANY);
+
+	//Decoders may have been drained at EOF, they refuse new packets until flushed.
+	if (media->codec_description.video_codec_context) {
+		avcodec_flush_buffers(media->codec_description.video_codec_context);
+	}
+	if (media->codec_description.audio_codec_context) {
+		avcodec_flush_buffers(media->codec_description.audio_codec_context);
+	}
+	media->m_demux_eof = false;
 }
 
 static void populate_internal_structures(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, int fps, int audio_sample_rate) {
@@ -215,7 +340,115 @@ int populate_codecs_source(MediaContainer* media) {
 
 	AVRational guess_fps = av_guess_frame_rate(media->format_context, media->format_context->streams[media->m_video_stream_index], NULL);
 	populate_internal_structures(media, media->format_context->video_codec_id, media->format_context->audio_codec_id, media->format_context->streams[media->m_video_stream_index]->codec->width, media->format_context->streams[media->m_video_stream_index]->codec->height, media->format_context->streams[media->m_video_stream_index]->codec->pix_fmt, media->format_context->streams[media->m_video_stream_index]->codec->bit_rate, media->format_context->streams[media->m_video_stream_index]->codec->rc_buffer_size, media->format_context->streams[media->m_video_stream_index]->codec->rc_max_rate, media->format_context->streams[media->m_video_stream_index]->codec->rc_min_rate, guess_fps.num, media->format_context->streams[media->m_audio_stream_index]->codecpar->sample_rate);
+	return 0;
+}
+
+int media_select_audio_stream(MediaContainer* media, int nth) {
+	if (media->type != MEDIA_FILE_INPUT) {
+		media_error_submit("Audio stream selection needs an input!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	int index = -1;
+	for (int i = 0, count = 0; i < static_cast<int>(media->format_context->nb_streams); i++) {
+		if (media->format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && count++ == nth) {
+			index = i;
+			break;
+		}
+	}
+	if (index < 0) {
+		media_error_submit("File has no audio stream with that number!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	AVCodecParameters* cparam = media->format_context->streams[index]->codecpar;
+	AVCodec* codec = avcodec_find_decoder(cparam->codec_id);
+	AVCodecContext* ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+	if (!ctx || avcodec_parameters_to_context(ctx, cparam) < 0 || avcodec_open2(ctx, codec, NULL) < 0) {
+		avcodec_free_context(&ctx);
+		media_error_submit("Audio decoder for the stream could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
 
+	avcodec_free_context(&media->codec_description.audio_codec_context);
+	media->codec_description.audio_codec_context = ctx;
+	media->codec_description.audio_codec = codec;
+	media->codec_description.audio_cparam = cparam;
+	media->codec_description.m_audio_sample_rate = cparam->sample_rate;
+	media->m_audio_stream_index = index;
+	return 0;
+}
+
+int media_set_decode_quality(MediaContainer* media, media_decode_quality quality) {
+	AVCodecContext* ctx = media->codec_description.video_codec_context;
+	AVCodec* codec = media->codec_description.video_codec;
+	if (media->type != MEDIA_FILE_INPUT || !ctx) {
+		media_error_submit("Decode quality needs an input with an open video decoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	AVDiscard skip_loop_filter = AVDISCARD_DEFAULT;
+	AVDiscard skip_idct = AVDISCARD_DEFAULT;
+	AVDiscard skip_frame = AVDISCARD_DEFAULT;
+	int lowres = 0;
+	bool fast = false;
+
+	switch (quality) {
+	case MEDIA_DECODE_QUALITY_FAST:
+		skip_loop_filter = AVDISCARD_NONREF;
+		fast = true;
+		break;
+	case MEDIA_DECODE_QUALITY_PREVIEW:
+		skip_loop_filter = AVDISCARD_ALL;
+		skip_idct = AVDISCARD_NONREF;
+		skip_frame = AVDISCARD_NONREF;
+		lowres = 1;
+		fast = true;
+		break;
+	case MEDIA_DECODE_QUALITY_KEYFRAMES:
+		skip_loop_filter = AVDISCARD_ALL;
+		skip_idct = AVDISCARD_NONKEY;
+		skip_frame = AVDISCARD_NONKEY;
+		lowres = 2;
+		fast = true;
+		break;
+	default:
+		break;
+	}
+	lowres = FFMIN(lowres, codec->max_lowres);
+
+	//lowres is only read when the decoder opens, the rest can change between packets.
+	if (lowres != ctx->lowres) {
+		AVCodecContext* reopened = avcodec_alloc_context3(codec);
+		if (!reopened || avcodec_parameters_to_context(reopened, media->codec_description.video_cparam) < 0) {
+			avcodec_free_context(&reopened);
+			return -1;
+		}
+		reopened->lowres = lowres;
+		reopened->thread_count = ctx->thread_count;
+		reopened->thread_type = ctx->thread_type;
+		if (avcodec_open2(reopened, codec, NULL) < 0) {
+			media_error_submit("Couldn't reopen video decoder at the new resolution!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			avcodec_free_context(&reopened);
+			return -1;
+		}
+		avcodec_free_context(&media->codec_description.video_codec_context);
+		media->codec_description.video_codec_context = reopened;
+		ctx = reopened;
+	}
+
+	ctx->skip_loop_filter = skip_loop_filter;
+	ctx->skip_idct = skip_idct;
+	ctx->skip_frame = skip_frame;
+	if (fast) {
+		ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
+	else {
+		ctx->flags2 &= ~AV_CODEC_FLAG2_FAST;
+	}
+
+	media->m_decode_quality = quality;
+	return 0;
 }
 
 int populate_codecs_copy(MediaContainer* media_from, MediaContainer* media_to) { 
@@ -391,6 +624,184 @@ As I can close the format etc and that should close all the other resources it a
 
 int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, float timebase_den,
 						int audio_sample_rate) {
+	return populate_codecs_user(media, vcodecid, acodecid, width, height, pix_format, bitrate, rc_buffer_size, rcmaxrate, rcminrate, timebase_den, audio_sample_rate, NULL);
+}
+
+void media_encoder_options_init(MediaEncoderOptions* options, media_encoder_profile profile) {
+	options->profile = profile;
+	options->preset = "";
+	options->tune = "";
+	options->crf = -1;
+	options->gop_size = -1;
+	options->max_b_frames = -1;
+	options->lookahead = -1;
+	options->threads = 0;
+	options->thread_type = 0;
+	options->intra_refresh = false;
+	options->time_base = av_make_q(0, 1);
+
+	options->audio_bitrate = -1;
+	options->audio_channels = -1;
+	options->audio_threads = 0;
+
+	switch (profile) {
+	case MEDIA_ENCODER_PROFILE_THROUGHPUT: {
+		options->preset = "veryfast";
+		options->thread_type = FF_THREAD_FRAME;
+		break;
+	}
+	case MEDIA_ENCODER_PROFILE_ARCHIVE: {
+		options->preset = "slow";
+		options->crf = 20;
+		options->thread_type = FF_THREAD_FRAME;
+		break;
+	}
+	case MEDIA_ENCODER_PROFILE_REALTIME: {
+		//Frame threads add a frame of delay per thread, slices keep latency at one frame.
+		options->preset = "veryfast";
+		options->tune = "zerolatency";
+		options->max_b_frames = 0;
+		options->lookahead = 0;
+		options->intra_refresh = true;
+		options->thread_type = FF_THREAD_SLICE;
+		break;
+	}
+	default: {
+		break;
+	}
+	}
+}
+
+static void media_encoder_options_apply_video(AVCodecContext* ctx, const MediaEncoderOptions* options, AVDictionary** dict) {
+	if (options->gop_size >= 0) {
+		ctx->gop_size = options->gop_size;
+	}
+	if (options->max_b_frames >= 0) {
+		ctx->max_b_frames = options->max_b_frames;
+	}
+	//0 keeps whatever the codec context had, so the default profile opens encoders exactly like passing no options.
+	if (options->threads > 0) {
+		ctx->thread_count = options->threads;
+	}
+	if (options->thread_type != 0) {
+		ctx->thread_type = options->thread_type;
+	}
+
+	switch (ctx->codec_id) {
+	case AV_CODEC_ID_H264: {
+		if (!options->preset.empty()) av_dict_set(dict, "preset", options->preset.c_str(), 0);
+		if (!options->tune.empty()) av_dict_set(dict, "tune", options->tune.c_str(), 0);
+		if (options->crf >= 0) av_dict_set_int(dict, "crf", options->crf, 0);
+		if (options->lookahead >= 0) av_dict_set_int(dict, "rc-lookahead", options->lookahead, 0);
+		if (options->intra_refresh) av_dict_set_int(dict, "intra-refresh", 1, 0);
+		break;
+	}
+	case AV_CODEC_ID_HEVC: {
+		//libx265 only exposes preset, tune and crf directly, everything else goes through x265-params.
+		if (!options->preset.empty()) av_dict_set(dict, "preset", options->preset.c_str(), 0);
+		if (!options->tune.empty()) av_dict_set(dict, "tune", options->tune.c_str(), 0);
+		if (options->crf >= 0) av_dict_set_int(dict, "crf", options->crf, 0);
+
+		std::string params;
+		if (options->lookahead >= 0) params += "rc-lookahead=" + std::to_string(options->lookahead) + ":";
+		if (options->max_b_frames >= 0) params += "bframes=" + std::to_string(options->max_b_frames) + ":";
+		if (options->intra_refresh) params += "intra-refresh=1:";
+		if (!params.empty()) {
+			params.pop_back();
+			av_dict_set(dict, "x265-params", params.c_str(), 0);
+		}
+		break;
+	}
+	case AV_CODEC_ID_VP8:
+	case AV_CODEC_ID_VP9: {
+		//libvpx has no preset names, map them onto deadline and cpu-used.
+		if (options->tune == "zerolatency") {
+			av_dict_set(dict, "deadline", "realtime", 0);
+			av_dict_set_int(dict, "lag-in-frames", 0, 0);
+		}
+		else if (!options->preset.empty()) {
+			bool slow = options->preset == "slow" || options->preset == "slower" || options->preset == "veryslow";
+			av_dict_set(dict, "deadline", "good", 0);
+			av_dict_set_int(dict, "cpu-used", slow ? 1 : 4, 0);
+		}
+		if (options->crf >= 0) av_dict_set_int(dict, "crf", options->crf, 0);
+		if (options->lookahead >= 0 && options->tune != "zerolatency") av_dict_set_int(dict, "lag-in-frames", options->lookahead, 0);
+		if (ctx->codec_id == AV_CODEC_ID_VP9 && options->thread_type != 0) av_dict_set_int(dict, "row-mt", 1, 0);
+		break;
+	}
+	default: {
+		break;
+	}
+	}
+}
+
+static void media_encoder_options_apply_audio(AVCodecContext* ctx, const MediaEncoderOptions* options) {
+	if (options->audio_bitrate > 0) {
+		ctx->bit_rate = options->audio_bitrate;
+	}
+	if (options->audio_threads > 0) {
+		ctx->thread_count = options->audio_threads;
+	}
+}
+
+//Anything left in the dictionary after avcodec_open2 was not understood by the encoder.
+static void media_encoder_options_report_unused(AVDictionary* dict) {
+	AVDictionaryEntry* entry = NULL;
+	while ((entry = av_dict_get(dict, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+		std::string message = std::string("Encoder ignored option ") + entry->key + "=" + entry->value;
+		media_error_submit(message, __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+	}
+}
+
+static std::string media_encoder_private_option(AVCodecContext* ctx, const char* name) {
+	uint8_t* value = NULL;
+	if (!ctx->priv_data || av_opt_get(ctx->priv_data, name, 0, &value) < 0 || !value) {
+		return "";
+	}
+	std::string result = reinterpret_cast<char*>(value);
+	av_free(value);
+	return result;
+}
+
+std::string media_encoder_options_to_string(MediaContainer* media) {
+	const char* profile_names[] = { "default", "throughput", "archive", "realtime" };
+	const MediaEncoderOptions& options = media->codec_description.m_encoder_options;
+	std::string result = std::string("profile: ") + profile_names[options.profile];
+
+	AVCodecContext* video = media->codec_description.video_codec_context;
+	if (video) {
+		result += ", video: " + std::string(video->codec ? video->codec->name : "none");
+		result += " preset=" + media_encoder_private_option(video, "preset");
+		result += " tune=" + media_encoder_private_option(video, "tune");
+		result += " crf=" + media_encoder_private_option(video, "crf");
+		result += " gop=" + std::to_string(video->gop_size);
+		result += " bframes=" + std::to_string(video->max_b_frames);
+		result += " bitrate=" + std::to_string(video->bit_rate);
+		result += " threads=" + std::to_string(video->thread_count);
+		result += std::string(" thread_type=") + (video->active_thread_type == FF_THREAD_SLICE ? "slice" : video->active_thread_type == FF_THREAD_FRAME ? "frame" : "none");
+	}
+
+	AVCodecContext* audio = media->codec_description.audio_codec_context;
+	if (audio) {
+		result += ", audio: " + std::string(audio->codec ? audio->codec->name : "none");
+		result += " bitrate=" + std::to_string(audio->bit_rate);
+		result += " channels=" + std::to_string(audio->channels);
+		result += " sample_rate=" + std::to_string(audio->sample_rate);
+	}
+
+	return result;
+}
+
+int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, float timebase_den,
+						int audio_sample_rate, const MediaEncoderOptions* options) {
+	MediaEncoderOptions encoder_options;
+	if (options) {
+		encoder_options = *options;
+	}
+	else {
+		media_encoder_options_init(&encoder_options, MEDIA_ENCODER_PROFILE_DEFAULT);
+	}
+
 	//Create video stream in container, and create a new encoder with given id, then copy codec params to the stream.
 	AVCodec* video_codec = avcodec_find_encoder(static_cast<AVCodecID>(vcodecid));
 	if (!video_codec) {
@@ -414,13 +825,19 @@ int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int
 	video_codec_ctx->rc_max_rate = rcmaxrate;
 	video_codec_ctx->rc_min_rate = rcminrate;
 
-	video_codec_ctx->time_base = (av_make_q(1, timebase_den));
+	video_codec_ctx->time_base = encoder_options.time_base.num > 0 ? encoder_options.time_base : av_make_q(1, timebase_den);
 	video_stream->time_base = video_codec_ctx->time_base;
 
-	if (avcodec_open2(video_codec_ctx, video_codec, NULL) < 0) {
+	AVDictionary* video_options = NULL;
+	media_encoder_options_apply_video(video_codec_ctx, &encoder_options, &video_options);
+
+	if (avcodec_open2(video_codec_ctx, video_codec, &video_options) < 0) {
 		media_error_submit("Codec could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		av_dict_free(&video_options);
 		return -1;
 	}
+	media_encoder_options_report_unused(video_options);
+	av_dict_free(&video_options);
 
 	//Attach codec to stream.
 	avcodec_parameters_from_context(video_stream->codecpar, video_codec_ctx);
@@ -440,7 +857,7 @@ int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int
 
 	AVStream* audio_stream = avformat_new_stream(media->format_context, NULL);
 
-	int OUTPUT_CHANNELS = 2;
+	int OUTPUT_CHANNELS = encoder_options.audio_channels > 0 ? encoder_options.audio_channels : 2;
 	int OUTPUT_BIT_RATE = 196000;
 	audio_codec_ctx->channels = OUTPUT_CHANNELS;
 	audio_codec_ctx->channel_layout = av_get_default_channel_layout(OUTPUT_CHANNELS);
@@ -452,6 +869,8 @@ int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int
 	audio_codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 	audio_stream->time_base = audio_codec_ctx->time_base;
 
+	media_encoder_options_apply_audio(audio_codec_ctx, &encoder_options);
+
 	if (avcodec_open2(audio_codec_ctx, audio_codec, NULL) < 0) {
 		media_error_submit("Codec could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
 		return -1;
@@ -495,6 +914,7 @@ int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int
 
 	media->codec_description.video_codec_context = video_codec_ctx;
 	media->codec_description.audio_codec_context = audio_codec_ctx;
+	media->codec_description.m_encoder_options = encoder_options;
 
 
 	AVRational timebase = av_make_q(1, timebase_den);
@@ -597,136 +1017,448 @@ int remux_media_data(MediaContainer* media_from, MediaContainer* media_to) {
 	}
 }
 
-int malloc_media_frame(MediaFrame* frame) {
-	frame->video_frame = av_frame_alloc();
-	frame->audio_frame = av_frame_alloc();
+void malloc_media_timeline(MediaTimeline* timeline) {
+	timeline->clips.clear();
+	timeline->packets_copied = 0;
+	timeline->frames_encoded = 0;
+	timeline->use_proxies = false;
+}
 
-	frame->t_current_packet = av_packet_alloc();
-	if (!frame->video_frame || !frame->t_current_packet || !frame->audio_frame) {
-		media_error_submit("Frame Could not be allocated!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
-		return -1;
-	}
-	return 0;
+void free_media_timeline(MediaTimeline* timeline) {
+	//Sources belong to the caller.
+	timeline->clips.clear();
 }
 
-int malloc_media_packet(MediaPacket* packet) {
-	packet->packet = av_packet_alloc();
-	if (!packet) {
-		media_error_submit("Packet Could not be allocated!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+int media_timeline_add_clip(MediaTimeline* timeline, MediaContainer* source, double in, double out) {
+	if (!source || source->type != MEDIA_FILE_INPUT || !source->codec_description.video_codec_context || out <= in) {
+		media_error_submit("Timeline clip needs an opened source and a non empty range!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
 		return -1;
 	}
-
-	return 0;
+	timeline->clips.push_back({ source, in, out, NULL });
+	return static_cast<int>(timeline->clips.size()) - 1;
 }
 
-void free_media_frame(MediaFrame* frame) {
-	//av_packet_free(&frame->t_current_packet);
-	av_frame_free(&frame->video_frame);
-	av_frame_free(&frame->audio_frame);
+int media_timeline_attach_proxy(MediaTimeline* timeline, MediaContainer* source, MediaContainer* proxy) {
+	int attached = 0;
+	for (MediaTimelineClip& clip : timeline->clips) {
+		if (clip.source == source) {
+			clip.proxy = proxy;
+			attached++;
+		}
+	}
+	return attached;
 }
 
-void free_media_packet(MediaPacket* packet) {
-	av_packet_free(&packet->packet);
+MediaContainer* media_timeline_clip_media(MediaTimeline* timeline, const MediaTimelineClip& clip) {
+	return timeline->use_proxies && clip.proxy ? clip.proxy : clip.source;
 }
 
-static int decode_video_packet(MediaCodecDescriptor& codec, MediaFrame* frame)
-{
-	int send_resp = -1;
-	int response = -1;
-	send_resp = avcodec_send_packet(codec.video_codec_context, frame->t_current_packet);
-	if (send_resp == 0)
-	{
-		response = avcodec_receive_frame(codec.video_codec_context, frame->video_frame);
-		return response;
+int media_timeline_preview(MediaTimeline* timeline, MediaFrameCache* cache, double position, MediaFrame* frame) {
+	double clip_start = 0;
+	for (const MediaTimelineClip& clip : timeline->clips) {
+		double duration = clip.out - clip.in;
+		if (position < clip_start + duration) {
+			//Proxies share the source timestamps, so the same source time addresses either container.
+			MediaContainer* media = media_timeline_clip_media(timeline, clip);
+			AVRational time_base = media->format_context->streams[media->m_video_stream_index]->time_base;
+			double seconds = clip.in + FFMAX(position - clip_start, 0.0);
+			return media_frame_cache_get(cache, media, av_rescale_q(static_cast<int64_t>(seconds * AV_TIME_BASE), AV_TIME_BASE_Q, time_base), frame);
+		}
+		clip_start += duration;
 	}
 
-	return send_resp;
+	media_error_submit("Preview position is past the end of the timeline!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+	return -1;
 }
 
-static int decode_audio_packet(MediaCodecDescriptor& codec, MediaFrame* frame)
-{
-	int response = -1;
-	int send_resp = -1;
-	send_resp = avcodec_send_packet(codec.audio_codec_context, frame->t_current_packet);
-	if (send_resp == 0)
-	{
-		response = avcodec_receive_frame(codec.audio_codec_context, frame->audio_frame);
-		return response;
+//Encoder configured from a source so its output can sit next to packets copied from that source. No B frames, so dts equals pts and
+//the joints with copied packets stay monotonic. Used for timeline cut points and mismatched concat inputs.
+static AVCodecContext* media_open_matching_video_encoder(MediaContainer* source) {
+	AVCodecParameters* par = source->codec_description.video_cparam;
+	AVCodec* codec = avcodec_find_encoder(par->codec_id);
+	if (!codec) {
+		media_error_submit("No encoder for source codec, matching stream cannot be encoded!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return NULL;
 	}
 
-	return send_resp;
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	if (!ctx) {
+		return NULL;
+	}
+	ctx->width = par->width;
+	ctx->height = par->height;
+	ctx->pix_fmt = static_cast<AVPixelFormat>(source->codec_description.m_pix_fmt);
+	ctx->sample_aspect_ratio = par->sample_aspect_ratio;
+	ctx->color_range = par->color_range;
+	ctx->color_primaries = par->color_primaries;
+	ctx->color_trc = par->color_trc;
+	ctx->colorspace = par->color_space;
+	ctx->profile = par->profile;
+	ctx->level = par->level;
+	ctx->time_base = source->format_context->streams[source->m_video_stream_index]->time_base;
+
+	ctx->bit_rate = source->codec_description.m_bitrate > 0 ? source->codec_description.m_bitrate : par->bit_rate;
+	ctx->rc_max_rate = source->codec_description.m_rcmaxrate;
+	ctx->rc_buffer_size = source->codec_description.m_rc_buffer_size;
+	ctx->max_b_frames = 0;
+
+	if (avcodec_open2(ctx, codec, NULL) < 0) {
+		media_error_submit("Matching video encoder could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		avcodec_free_context(&ctx);
+		return NULL;
+	}
+	return ctx;
 }
 
-/*
-I think the part when you "get to correct timestamp to discard prior frames up to desired seconds" is incorrect.
-As I understand it, we can't just ignore the packed: av_packet_unref(pPacket);.
-We have to decode all the packets up to the correct frame (decode and then ignore),
-because after each key frame, there is a "frame dependency chain" up to the next key frames
-(there are P-frames and B-frames...).
+static AVCodecContext* media_open_matching_audio_encoder(MediaContainer* source) {
+	AVCodecParameters* par = source->codec_description.audio_cparam;
+	AVCodec* codec = avcodec_find_encoder(par->codec_id);
+	if (!codec) {
+		media_error_submit("No encoder for source codec, matching stream cannot be encoded!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return NULL;
+	}
 
-okay so its simple just decoe every packet, DONT SKIP ANY PACKET DECODE, and simply use frame number to get the right
-frame data at the right time!
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	if (!ctx) {
+		return NULL;
+	}
+	ctx->sample_rate = par->sample_rate;
+	ctx->channels = par->channels;
+	ctx->channel_layout = par->channel_layout ? par->channel_layout : av_get_default_channel_layout(par->channels);
+	ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : static_cast<AVSampleFormat>(par->format);
+	for (int i = 0; codec->sample_fmts && codec->sample_fmts[i] != AV_SAMPLE_FMT_NONE; i++) {
+		if (codec->sample_fmts[i] == par->format) {
+			ctx->sample_fmt = codec->sample_fmts[i];
+		}
+	}
+	ctx->bit_rate = par->bit_rate > 0 ? par->bit_rate : 128000;
+	ctx->profile = par->profile;
+	ctx->time_base = av_make_q(1, par->sample_rate);
+	ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+	if (avcodec_open2(ctx, codec, NULL) < 0) {
+		media_error_submit("Matching audio encoder could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		avcodec_free_context(&ctx);
+		return NULL;
+	}
+	return ctx;
+}
 
+//Encoders without global headers emit Annex B start codes, MP4 style outputs (avcC / hvcC extradata) expect 4 byte length prefixes.
+static void media_annexb_to_length_prefixed(AVPacket* packet) {
+	uint8_t* data = packet->data;
+	int size = packet->size;
+	if (size < 4 || !(data[0] == 0 && data[1] == 0 && (data[2] == 1 || (data[2] == 0 && data[3] == 1)))) {
+		return;
+	}
 
-So essentially I was getting th issue why? because my packets werent getting decoded sequentially,
-the audio pacets in the middle were proving to be a problem as they broke contiuinty and thus B Frames and P frames were
-messed up. Now seperating both streams makes things easier
+	std::vector<uint8_t> converted;
+	converted.reserve(size + 64);
+	int i = 0;
+	while (i < size) {
+		//Skip the start code, then find the next one to know where this NAL ends.
+		while (i < size && data[i] == 0) i++;
+		if (i >= size || data[i] != 1) break;
+		i++;
+		int nal_start = i;
+		int nal_end = size;
+		for (int j = i; j + 2 < size; j++) {
+			if (data[j] == 0 && data[j + 1] == 0 && (data[j + 2] == 1 || (j + 3 < size && data[j + 2] == 0 && data[j + 3] == 1))) {
+				nal_end = j;
+				break;
+			}
+		}
+		uint32_t nal_size = nal_end - nal_start;
+		converted.push_back(nal_size >> 24);
+		converted.push_back((nal_size >> 16) & 0xFF);
+		converted.push_back((nal_size >> 8) & 0xFF);
+		converted.push_back(nal_size & 0xFF);
+		converted.insert(converted.end(), data + nal_start, data + nal_end);
+		i = nal_end;
+	}
 
-Very inefficinet as im essentially doing two while loops, make another funtion that takes in a function ptr which will give it
-instructions on how to deal with caputred frame (so only while loop)
-*/
+	AVPacket replaced;
+	av_init_packet(&replaced);
+	if (av_new_packet(&replaced, converted.size()) < 0) {
+		return;
+	}
+	memcpy(replaced.data, converted.data(), converted.size());
+	av_packet_copy_props(&replaced, packet);
+	av_packet_unref(packet);
+	av_packet_move_ref(packet, &replaced);
+}
 
-int decode_next_frame_video(MediaContainer* media, MediaFrame* frame) {
-	bool video_frame_recorded = false;
+//Parameter sets of a stream in the framing its packets use. avcC / hvcC extradata is unpacked into length prefixed NALs with the
+//stream's own length size, Annex B extradata already is what goes in front of a packet.
+static void media_parameter_sets(AVCodecParameters* par, std::vector<uint8_t>& sets) {
+	sets.clear();
+	const uint8_t* data = par->extradata;
+	int size = par->extradata_size;
+	if (size < 4) {
+		return;
+	}
+	if (data[0] == 0 && data[1] == 0 && (data[2] == 1 || (data[2] == 0 && data[3] == 1))) {
+		sets.assign(data, data + size);
+		return;
+	}
+	if (data[0] != 1) {
+		return;
+	}
 
-	bool failure = false;
+	int length_size = 0;
+	int pos = 0;
+	auto copy_nal = [&]() {
+		if (pos + 2 > size) {
+			return false;
+		}
+		int nal_size = (data[pos] << 8) | data[pos + 1];
+		pos += 2;
+		if (pos + nal_size > size) {
+			return false;
+		}
+		for (int b = length_size - 1; b >= 0; b--) {
+			sets.push_back((nal_size >> (8 * b)) & 0xFF);
+		}
+		sets.insert(sets.end(), data + pos, data + pos + nal_size);
+		pos += nal_size;
+		return true;
+	};
+
+	if (par->codec_id == AV_CODEC_ID_H264 && size >= 7) {
+		length_size = (data[4] & 3) + 1;
+		pos = 5;
+		//SPS count, then the PPS count follows the last SPS.
+		for (int pass = 0; pass < 2 && pos < size; pass++) {
+			int count = pass == 0 ? (data[pos] & 0x1F) : data[pos];
+			pos++;
+			for (int i = 0; i < count; i++) {
+				if (!copy_nal()) {
+					sets.clear();
+					return;
+				}
+			}
+		}
+	}
+	else if (par->codec_id == AV_CODEC_ID_HEVC && size >= 23) {
+		length_size = (data[21] & 3) + 1;
+		int arrays = data[22];
+		pos = 23;
+		for (int a = 0; a < arrays; a++) {
+			if (pos + 3 > size) {
+				sets.clear();
+				return;
+			}
+			int count = (data[pos + 1] << 8) | data[pos + 2];
+			pos += 3;
+			for (int i = 0; i < count; i++) {
+				if (!copy_nal()) {
+					sets.clear();
+					return;
+				}
+			}
+		}
+	}
+}
 
-	//Read Frame gives -ve if eof or error, splits stream into packets only.
-	while (!video_frame_recorded && !failure) {
+//A re-encoded section carries its encoder's SPS/PPS in band under the same ids as the source's. Copied GOPs after it would be decoded
+//with those, so the source's own sets are repeated in front of the first copied keyframe.
+static void media_prepend_parameter_sets(AVPacket* packet, const std::vector<uint8_t>& sets) {
+	if (sets.empty()) {
+		return;
+	}
+	AVPacket replaced;
+	av_init_packet(&replaced);
+	if (av_new_packet(&replaced, static_cast<int>(sets.size()) + packet->size) < 0) {
+		return;
+	}
+	memcpy(replaced.data, sets.data(), sets.size());
+	memcpy(replaced.data + sets.size(), packet->data, packet->size);
+	av_packet_copy_props(&replaced, packet);
+	av_packet_unref(packet);
+	av_packet_move_ref(packet, &replaced);
+}
 
-		if (av_read_frame(media->format_context, frame->t_current_packet) >= 0) {
+//Moves a source packet onto the output timeline. Copied B frame GOPs and re-encoded cuts disagree on dts by the reorder delay, the
+//clamp keeps dts strictly increasing per stream so the muxer accepts the joint.
+static int media_write_rebased_packet(MediaContainer* output, AVPacket* packet, AVRational in_tb, int out_index, int64_t shift_us, int64_t* last_dts) {
+	AVRational out_tb = output->format_context->streams[out_index]->time_base;
+	int64_t shift = av_rescale_q(shift_us, AV_TIME_BASE_Q, in_tb);
+	if (packet->pts != AV_NOPTS_VALUE) packet->pts += shift;
+	if (packet->dts != AV_NOPTS_VALUE) packet->dts += shift;
 
-			if (video_frame_recorded == false && frame->t_current_packet->stream_index == media->m_video_stream_index) {
-				int r = decode_video_packet(media->codec_description, frame);
-				switch (r) {
-				case 0: {
-					video_frame_recorded = true;
-					//std::cout << "video frame recorded" << std::endl;
-					break;
+	av_packet_rescale_ts(packet, in_tb, out_tb);
+	packet->stream_index = out_index;
+	packet->pos = -1;
+
+	if (packet->dts == AV_NOPTS_VALUE) {
+		packet->dts = packet->pts;
+	}
+	if (*last_dts != AV_NOPTS_VALUE && packet->dts <= *last_dts) {
+		packet->dts = *last_dts + 1;
+	}
+	if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts) {
+		packet->pts = packet->dts;
+	}
+	*last_dts = packet->dts;
+
+	MediaPacket pack;
+	pack.packet = packet;
+	return open_media_write_packet(output, &pack);
+}
+
+/*
+Renders one piece of a clip, [start, end) in AV_TIME_BASE units of the source. Copy segments always start on a keyframe, packets are
+passed through until the keyframe that begins the next piece. Re-encoded segments decode from the keyframe before start and only encode
+the frames inside the window. Audio packets inside the window are copied in both cases.
+*/
+static int media_timeline_render_segment(MediaTimeline* timeline, MediaTimelineClip& clip, MediaContainer* output, int64_t start, int64_t end, bool reencode,
+	int64_t shift_us, int64_t* last_dts) {
+	MediaContainer* source = clip.source;
+	int video_in = source->m_video_stream_index;
+	int audio_in = output->m_audio_stream_index >= 0 ? source->m_audio_stream_index : -1;
+	AVRational video_tb = source->format_context->streams[video_in]->time_base;
+	AVCodecContext* decoder = source->codec_description.video_codec_context;
+
+	int key = FFMAX(media_keyframe_at_or_before(source, av_rescale_q(start, AV_TIME_BASE_Q, video_tb)), 0);
+	if (av_seek_frame(source->format_context, video_in, source->keyframe_index.keyframes[key].timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+		media_error_submit("Seek to cut point failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	AVCodecContext* encoder = NULL;
+	if (reencode) {
+		avcodec_flush_buffers(decoder);
+		encoder = media_open_matching_video_encoder(source);
+		if (!encoder) {
+			return -1;
+		}
+	}
+	AVCodecParameters* out_par = output->format_context->streams[output->m_video_stream_index]->codecpar;
+	bool length_prefixed = out_par->extradata_size > 0 && out_par->extradata[0] == 1 && (out_par->codec_id == AV_CODEC_ID_H264 || out_par->codec_id == AV_CODEC_ID_HEVC);
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	AVPacket* encoded = av_packet_alloc();
+	AVFrame* decoded = av_frame_alloc();
+
+	bool failure = false;
+	bool video_done = false;
+	bool audio_done = audio_in < 0;
+	bool demux_eof = false;
+	bool seen_keyframe = false;
+	bool sets_sent = reencode;
+	std::vector<uint8_t> parameter_sets;
+	if (!reencode) {
+		media_parameter_sets(source->format_context->streams[video_in]->codecpar, parameter_sets);
+	}
+
+	//Pulls everything the decoder has ready and encodes what falls inside the window.
+	auto drain_decoder = [&]() {
+		while (!video_done && avcodec_receive_frame(decoder, decoded) == 0) {
+			int64_t pts = decoded->best_effort_timestamp != AV_NOPTS_VALUE ? decoded->best_effort_timestamp : decoded->pts;
+			int64_t time = av_rescale_q(pts, video_tb, AV_TIME_BASE_Q);
+			if (time >= end) {
+				video_done = true;
+			}
+			else if (time >= start) {
+				decoded->pts = pts;
+				decoded->pict_type = AV_PICTURE_TYPE_NONE;
+				if (avcodec_send_frame(encoder, decoded) < 0) {
+					failure = true;
 				}
-				case AVERROR(EAGAIN): {
-					//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
-					break;
+				timeline->frames_encoded++;
+			}
+			av_frame_unref(decoded);
+
+			while (avcodec_receive_packet(encoder, encoded) == 0) {
+				if (length_prefixed) {
+					media_annexb_to_length_prefixed(encoded);
 				}
-				case AVERROR(EINVAL): {
-					//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
-					break;
+				if (media_write_rebased_packet(output, encoded, video_tb, output->m_video_stream_index, shift_us, &last_dts[0]) < 0) {
+					failure = true;
 				}
-				case AVERROR_EOF: {
-					//std::cout << "AVERROR_EOF on decode! (End of File reached, terminating)" << std::endl;
-					break;
+				av_packet_unref(encoded);
+			}
+		}
+	};
+
+	while (!failure && !(video_done && audio_done)) {
+		if (av_read_frame(source->format_context, &packet) < 0) {
+			demux_eof = true;
+			break;
+		}
+
+		AVRational in_tb = source->format_context->streams[packet.stream_index]->time_base;
+		int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+		int64_t time = pts != AV_NOPTS_VALUE ? av_rescale_q(pts, in_tb, AV_TIME_BASE_Q) : start;
+
+		if (packet.stream_index == audio_in && !audio_done) {
+			if (time >= end) {
+				audio_done = true;
+			}
+			else if (time >= start) {
+				if (media_write_rebased_packet(output, &packet, in_tb, output->m_audio_stream_index, shift_us, &last_dts[1]) < 0) {
+					failure = true;
 				}
-				case AVERROR(ENOMEM): {
-					//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
-					break;
+			}
+		}
+		else if (packet.stream_index == video_in && !video_done) {
+			if (reencode) {
+				if (avcodec_send_packet(decoder, &packet) < 0) {
+					media_error_submit("Cut point packet could not be decoded!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
 				}
-				default: {
-					failure = true;
-					break;
+				drain_decoder();
+			}
+			else {
+				bool is_key = (packet.flags & AV_PKT_FLAG_KEY) != 0;
+				if (seen_keyframe && is_key && time >= end) {
+					//Next piece begins here.
+					video_done = true;
 				}
-
+				else {
+					seen_keyframe = seen_keyframe || is_key;
+					//Leading pictures of an open GOP point back into the previous GOP, they cannot be copied on their own.
+					if (seen_keyframe && time >= start && time < end) {
+						if (!sets_sent && is_key) {
+							media_prepend_parameter_sets(&packet, parameter_sets);
+							sets_sent = true;
+						}
+						if (media_write_rebased_packet(output, &packet, in_tb, output->m_video_stream_index, shift_us, &last_dts[0]) < 0) {
+							failure = true;
+						}
+						timeline->packets_copied++;
+					}
 				}
 			}
-			av_packet_unref(frame->t_current_packet);
 		}
-		else {
-			failure = true;
+		av_packet_unref(&packet);
+	}
+
+	if (reencode) {
+		if (demux_eof && !video_done) {
+			avcodec_send_packet(decoder, NULL);
+			drain_decoder();
+		}
+		//The decoder might have been drained, it has to accept packets again for the next cut.
+		avcodec_flush_buffers(decoder);
+
+		avcodec_send_frame(encoder, NULL);
+		while (avcodec_receive_packet(encoder, encoded) == 0) {
+			if (length_prefixed) {
+				media_annexb_to_length_prefixed(encoded);
+			}
+			if (media_write_rebased_packet(output, encoded, video_tb, output->m_video_stream_index, shift_us, &last_dts[0]) < 0) {
+				failure = true;
+			}
+			av_packet_unref(encoded);
 		}
+		avcodec_free_context(&encoder);
 	}
 
+	av_packet_free(&encoded);
+	av_frame_free(&decoded);
+
 	if (!failure) {
-		frame->frame_pts = frame->video_frame->pts;
-		retrieve_pts_seconds(media, frame);
 		return 0;
 	}
 	else {
@@ -734,58 +1466,77 @@ int decode_next_frame_video(MediaContainer* media, MediaFrame* frame) {
 	}
 }
 
-int decode_next_frame_audio(MediaContainer* media, MediaFrame* frame) {
-	bool audio_frame_recorded = false;
+int media_timeline_render(MediaTimeline* timeline, MediaContainer* output) {
+	if (timeline->clips.empty() || output->m_video_stream_index < 0) {
+		media_error_submit("Nothing to render!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
 
+	AVCodecParameters* out_par = output->format_context->streams[output->m_video_stream_index]->codecpar;
 	bool failure = false;
+	int64_t output_time = 0; //AV_TIME_BASE units, where the next clip starts.
+	int64_t last_dts[2] = { AV_NOPTS_VALUE, AV_NOPTS_VALUE };
+
+	for (MediaTimelineClip& clip : timeline->clips) {
+		MediaContainer* source = clip.source;
+		AVCodecParameters* par = source->codec_description.video_cparam;
+		if (par->codec_id != out_par->codec_id || par->width != out_par->width || par->height != out_par->height) {
+			media_error_submit("Timeline clip does not match the output stream, it cannot be stream copied!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			failure = true;
+			break;
+		}
+		if (media_build_keyframe_index(source) < 0) {
+			failure = true;
+			break;
+		}
 
-	//Read Frame gives -ve if eof or error, splits stream into packets only.
-	while (!audio_frame_recorded && !failure) {
-
-		if (av_read_frame(media->format_context, frame->t_current_packet) >= 0) {
-
-			if (audio_frame_recorded == false && frame->t_current_packet->stream_index == media->m_audio_stream_index) {
-				int r = decode_audio_packet(media->codec_description, frame);
-				switch (r) {
-				case 0: {
-					audio_frame_recorded = true;
-					//std::cout << "audio frame recorded" << std::endl;
-					break;
-				}
-				case AVERROR(EAGAIN): {
-					//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
-					break;
-				}
-				case AVERROR(EINVAL): {
-					//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
-					break;
-				}
-				case AVERROR_EOF: {
-					//std::cout << "AVERROR_EOF on decode! (End of File reached, terminating)" << std::endl;
-					break;
-				}
-				case AVERROR(ENOMEM): {
-					//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
-					break;
-				}
-				default: {
-					failure = true;
-					break;
-				}
+		AVRational video_tb = source->format_context->streams[source->m_video_stream_index]->time_base;
+		const std::vector<MediaKeyframe>& keyframes = source->keyframe_index.keyframes;
+		int64_t in = static_cast<int64_t>(clip.in * AV_TIME_BASE);
+		int64_t out = static_cast<int64_t>(clip.out * AV_TIME_BASE);
+		int64_t shift = output_time - in;
 
-				}
+		//First keyframe at or after the in point, and the last one before the out point, bound the copyable GOPs.
+		int head = media_keyframe_at_or_before(source, av_rescale_q(in, AV_TIME_BASE_Q, video_tb));
+		if (head < 0 || av_rescale_q(keyframes[head].pts, video_tb, AV_TIME_BASE_Q) < in) {
+			head++;
+		}
+		int tail = media_keyframe_at_or_before(source, av_rescale_q(out, AV_TIME_BASE_Q, video_tb));
+
+		if (head >= keyframes.size() || tail <= head) {
+			//No complete GOP inside the clip, if the clip starts on a keyframe the head is still copyable.
+			int64_t head_time = head < keyframes.size() ? av_rescale_q(keyframes[head].pts, video_tb, AV_TIME_BASE_Q) : out;
+			head_time = FFMIN(head_time, out);
+			if (in < head_time) {
+				failure = media_timeline_render_segment(timeline, clip, output, in, head_time, true, shift, last_dts) < 0;
+			}
+			if (!failure && head_time < out) {
+				failure = media_timeline_render_segment(timeline, clip, output, head_time, out, true, shift, last_dts) < 0;
 			}
-
-			av_packet_unref(frame->t_current_packet);
 		}
 		else {
-			failure = true;
+			int64_t head_time = av_rescale_q(keyframes[head].pts, video_tb, AV_TIME_BASE_Q);
+			int64_t tail_time = av_rescale_q(keyframes[tail].pts, video_tb, AV_TIME_BASE_Q);
+
+			if (in < head_time) {
+				failure = media_timeline_render_segment(timeline, clip, output, in, head_time, true, shift, last_dts) < 0;
+			}
+			if (!failure) {
+				failure = media_timeline_render_segment(timeline, clip, output, head_time, tail_time, false, shift, last_dts) < 0;
+			}
+			if (!failure && tail_time < out) {
+				failure = media_timeline_render_segment(timeline, clip, output, tail_time, out, true, shift, last_dts) < 0;
+			}
 		}
+
+		if (failure) {
+			break;
+		}
+		output_time += out - in;
+		reset_input_container_state(source);
 	}
 
 	if (!failure) {
-		frame->frame_pts = frame->video_frame->pts;
-		retrieve_pts_seconds(media, frame);
 		return 0;
 	}
 	else {
@@ -793,325 +1544,700 @@ int decode_next_frame_audio(MediaContainer* media, MediaFrame* frame) {
 	}
 }
 
-int encode_next_frame_video(MediaContainer* media, MediaFrame* frame, MediaPacket* packet, MediaRational time_from, MediaRational time_to) {
-	//Resize frame to output container specifications
+int open_media_parallel(const std::vector<std::string>& filenames, std::vector<MediaContainer*>& containers) {
+	containers.assign(filenames.size(), NULL);
+	std::vector<int> results(filenames.size(), 0);
+	std::vector<std::string> errors(filenames.size());
+	std::vector<std::thread> workers;
+
+	//Probing is mostly waiting on the disk, one thread per file hides the latency.
+	for (int i = 0; i < filenames.size(); i++) {
+		containers[i] = new MediaContainer;
+		workers.push_back(std::thread([&, i]() {
+			malloc_media_container(containers[i], MEDIA_FILE_INPUT);
+			int level = MEDIA_ERROR_WARNING;
+			results[i] = media_open_input(containers[i], filenames[i].c_str(), errors[i], level);
+			if (results[i] == 0) {
+				results[i] = populate_codecs_source(containers[i]);
+			}
+		}));
+	}
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
 
-	//SwsContext* swsContext = sws_getContext(
-	//	frame->video_frame->width, frame->video_frame->height, static_cast<AVPixelFormat>(frame->video_frame->format),
-	//	media->m_width, media->m_height, AV_PIX_FMT_YUV420P, // Specify the desired output dimensions and format
-	//	SWS_BILINEAR, nullptr, nullptr, nullptr);
+	//Critical errors would end the process from inside a worker, every failure is reported here and left to the caller.
+	bool failure = false;
+	for (int i = 0; i < filenames.size(); i++) {
+		if (results[i] < 0) {
+			if (!errors[i].empty()) {
+				media_error_submit(errors[i] + " (" + filenames[i] + ")", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			}
+			failure = true;
+		}
+	}
+	return failure ? -1 : 0;
+}
 
-	//// Allocate memory for the resized frame
-	//AVFrame* resizedFrame = av_frame_alloc();
-	//resizedFrame->width = media->m_width;
-	//resizedFrame->height = media->m_height;
-	//resizedFrame->format = AV_PIX_FMT_YUV420P;
-	//av_frame_get_buffer(resizedFrame, 0);
-	//
-	//// Perform the resizing
-	//sws_scale(swsContext,
-	//	frame->video_frame->data, frame->video_frame->linesize,
-	//	0, frame->video_frame->height,
-	//	resizedFrame->data, resizedFrame->linesize);
+void free_media_containers(std::vector<MediaContainer*>& containers) {
+	for (MediaContainer* media : containers) {
+		if (media) {
+			free_media_container(media);
+			delete media;
+		}
+	}
+	containers.clear();
+}
 
-	//// Clean up the scaling context
-	//sws_freeContext(swsContext);
+//Packets can only share one output stream when the stream headers agree, different SPS/PPS or AudioSpecificConfig means re-encoding.
+bool media_streams_compatible(MediaContainer* a, MediaContainer* b) {
+	AVCodecParameters* va = a->codec_description.video_cparam;
+	AVCodecParameters* vb = b->codec_description.video_cparam;
+	if (!va || !vb || va->codec_id != vb->codec_id || va->width != vb->width || va->height != vb->height || va->format != vb->format || va->profile != vb->profile) {
+		return false;
+	}
+	if (va->extradata_size != vb->extradata_size || (va->extradata_size > 0 && memcmp(va->extradata, vb->extradata, va->extradata_size) != 0)) {
+		return false;
+	}
 
-	////Swap frames
-	//resizedFrame->pts = frame->video_frame->pts;
-	//frame->video_frame = (resizedFrame);
+	AVCodecParameters* aa = a->m_audio_stream_index >= 0 ? a->codec_description.audio_cparam : NULL;
+	AVCodecParameters* ab = b->m_audio_stream_index >= 0 ? b->codec_description.audio_cparam : NULL;
+	if (!aa || !ab) {
+		return aa == ab;
+	}
+	if (aa->codec_id != ab->codec_id || aa->sample_rate != ab->sample_rate || aa->channels != ab->channels || aa->format != ab->format) {
+		return false;
+	}
+	if (aa->extradata_size != ab->extradata_size || (aa->extradata_size > 0 && memcmp(aa->extradata, ab->extradata, aa->extradata_size) != 0)) {
+		return false;
+	}
+	return true;
+}
 
-	bool video_frame_encoded = false;
+static int media_concat_copy(MediaContainer* input, MediaContainer* media_to, int64_t shift_us, int64_t* last_dts, int64_t* end_us, bool resend_parameter_sets) {
+	AVPacket packet;
+	av_init_packet(&packet);
 	bool failure = false;
-	AVPacket* output_current_packet = av_packet_alloc();
-	int response = avcodec_send_frame(media->codec_description.video_codec_context, frame->video_frame);
-	if (response >= 0) {
-		response = avcodec_receive_packet(media->codec_description.video_codec_context, output_current_packet);
-		switch (response) {
-		case 0: {
-			video_frame_encoded = true;
-			break;
-		}
-		case AVERROR(EAGAIN): {
-			//More frames needed.
-			video_frame_encoded = true;
-			failure = true;
-			break;
-		}
-		case AVERROR(EOF): {
-			failure = true;
-			break;
+	std::vector<uint8_t> parameter_sets;
+	if (resend_parameter_sets) {
+		media_parameter_sets(input->format_context->streams[input->m_video_stream_index]->codecpar, parameter_sets);
+	}
+
+	while (!failure && av_read_frame(input->format_context, &packet) >= 0) {
+		int out_index = -1;
+		int dts_slot = 0;
+		if (packet.stream_index == input->m_video_stream_index) {
+			out_index = media_to->m_video_stream_index;
 		}
-		default: {
-			failure = true;
-			break;
+		else if (packet.stream_index == input->m_audio_stream_index && media_to->m_audio_stream_index >= 0) {
+			out_index = media_to->m_audio_stream_index;
+			dts_slot = 1;
 		}
 
+		if (out_index >= 0) {
+			AVRational in_tb = input->format_context->streams[packet.stream_index]->time_base;
+			int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+			if (pts != AV_NOPTS_VALUE) {
+				*end_us = FFMAX(*end_us, av_rescale_q(pts + packet.duration, in_tb, AV_TIME_BASE_Q) + shift_us);
+			}
+			if (dts_slot == 0 && !parameter_sets.empty() && (packet.flags & AV_PKT_FLAG_KEY)) {
+				media_prepend_parameter_sets(&packet, parameter_sets);
+				parameter_sets.clear();
+			}
+			if (media_write_rebased_packet(media_to, &packet, in_tb, out_index, shift_us, &last_dts[dts_slot]) < 0) {
+				failure = true;
+			}
 		}
+		av_packet_unref(&packet);
+	}
+
+	if (!failure) {
+		return 0;
 	}
 	else {
 		return -1;
 	}
+}
 
-	if (failure == true && video_frame_encoded == true) {
-		return 1;
+static int media_concat_write_encoded(MediaContainer* media_to, AVCodecContext* encoder, int out_index, int64_t shift_us, int64_t* last_dts, int64_t* end_us, bool length_prefixed) {
+	AVPacket* packet = av_packet_alloc();
+	bool failure = false;
+	while (avcodec_receive_packet(encoder, packet) == 0) {
+		if (length_prefixed) {
+			media_annexb_to_length_prefixed(packet);
+		}
+		*end_us = FFMAX(*end_us, av_rescale_q(packet->pts + packet->duration, encoder->time_base, AV_TIME_BASE_Q) + shift_us);
+		if (media_write_rebased_packet(media_to, packet, encoder->time_base, out_index, shift_us, last_dts) < 0) {
+			failure = true;
+		}
+		av_packet_unref(packet);
 	}
-	
-	if (failure == true) {
+	av_packet_free(&packet);
+	return failure ? -1 : 0;
+}
+
+//Input does not match the output streams, decode it and encode to the reference parameters so it can still join the same streams.
+static int media_concat_reencode(MediaContainer* reference, MediaContainer* input, MediaContainer* media_to, int64_t shift_us, int64_t* last_dts, int64_t* end_us) {
+	AVCodecContext* video_encoder = media_open_matching_video_encoder(reference);
+	if (!video_encoder) {
 		return -1;
 	}
-
-	if (failure == false) {
-		packet->packet = output_current_packet;
-		output_current_packet->stream_index = media->m_video_stream_index;
-
-		av_packet_rescale_ts(packet->packet, time_from, time_to);
-		//std::cout << "video" << packet->packet->pts << std::endl;
-		return 0;
+	bool has_audio = media_to->m_audio_stream_index >= 0 && input->m_audio_stream_index >= 0;
+	AVCodecContext* audio_encoder = has_audio ? media_open_matching_audio_encoder(reference) : NULL;
+	has_audio = audio_encoder != NULL;
+
+	MediaAudioConverter converter;
+	if (has_audio && malloc_media_audio_converter(&converter, audio_encoder) < 0) {
+		avcodec_free_context(&video_encoder);
+		avcodec_free_context(&audio_encoder);
+		return -1;
 	}
 
-}
+	AVCodecParameters* out_par = media_to->format_context->streams[media_to->m_video_stream_index]->codecpar;
+	bool length_prefixed = out_par->extradata_size > 0 && out_par->extradata[0] == 1 && (out_par->codec_id == AV_CODEC_ID_H264 || out_par->codec_id == AV_CODEC_ID_HEVC);
+	AVRational video_in = input->format_context->streams[input->m_video_stream_index]->time_base;
+	AVRational audio_in = has_audio ? input->format_context->streams[input->m_audio_stream_index]->time_base : av_make_q(0, 1);
 
-int encode_next_frame_audio(MediaContainer* media, MediaFrame* frame, MediaPacket* packet, MediaRational time_from, MediaRational time_to) {
-	bool audio_frame_recorded = false;
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+	AVFrame* scaled = av_frame_alloc();
+	AVFrame* audio_out = av_frame_alloc();
+	SwsContext* scale_context = NULL;
 	bool failure = false;
-	AVPacket* output_current_packet = av_packet_alloc();
-	int response = avcodec_send_frame(media->codec_description.audio_codec_context, frame->audio_frame);
-	if (response >= 0) {
-		response = avcodec_receive_packet(media->codec_description.audio_codec_context, output_current_packet);
-		switch (response) {
-		case 0: {
-			audio_frame_recorded = true;
-			break;
+	AVMediaType type;
+
+	while (!failure && decode_next_frame_any(input, &frame, &type) == 0) {
+		if (type == AVMEDIA_TYPE_VIDEO) {
+			AVFrame* source = frame.video_frame;
+			AVFrame* target = source;
+			if (source->width != video_encoder->width || source->height != video_encoder->height || source->format != video_encoder->pix_fmt) {
+				scale_context = sws_getCachedContext(scale_context, source->width, source->height, static_cast<AVPixelFormat>(source->format),
+					video_encoder->width, video_encoder->height, video_encoder->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+				if (!scaled->buf[0]) {
+					scaled->width = video_encoder->width;
+					scaled->height = video_encoder->height;
+					scaled->format = video_encoder->pix_fmt;
+					av_frame_get_buffer(scaled, 32);
+				}
+				if (!scale_context || av_frame_make_writable(scaled) < 0) {
+					failure = true;
+					break;
+				}
+				sws_scale(scale_context, source->data, source->linesize, 0, source->height, scaled->data, scaled->linesize);
+				target = scaled;
+			}
+			int64_t pts = source->best_effort_timestamp != AV_NOPTS_VALUE ? source->best_effort_timestamp : source->pts;
+			target->pts = av_rescale_q(pts, video_in, video_encoder->time_base);
+			target->pict_type = AV_PICTURE_TYPE_NONE;
+
+			if (avcodec_send_frame(video_encoder, target) < 0 ||
+				media_concat_write_encoded(media_to, video_encoder, media_to->m_video_stream_index, shift_us, &last_dts[0], end_us, length_prefixed) < 0) {
+				failure = true;
+			}
 		}
-		case AVERROR(EAGAIN): {
-			//More frames needed.
-			audio_frame_recorded = true;
-			failure = true;
-			break;
+		else if (type == AVMEDIA_TYPE_AUDIO && has_audio) {
+			if (media_audio_converter_submit(&converter, frame.audio_frame, audio_in) < 0) {
+				failure = true;
+			}
+			while (!failure && media_audio_converter_receive(&converter, audio_out, false) == 0) {
+				if (avcodec_send_frame(audio_encoder, audio_out) < 0 ||
+					media_concat_write_encoded(media_to, audio_encoder, media_to->m_audio_stream_index, shift_us, &last_dts[1], end_us, false) < 0) {
+					failure = true;
+				}
+			}
 		}
-		case AVERROR(EOF): {
+	}
+
+	//The tail is drained even after a failure so the encoders hold nothing back, but any error in it still fails the input.
+	if (avcodec_send_frame(video_encoder, NULL) < 0 ||
+		media_concat_write_encoded(media_to, video_encoder, media_to->m_video_stream_index, shift_us, &last_dts[0], end_us, length_prefixed) < 0) {
+		failure = true;
+	}
+	if (has_audio) {
+		if (media_audio_converter_submit(&converter, NULL, audio_in) < 0) {
 			failure = true;
-			break;
 		}
-		default: {
+		while (media_audio_converter_receive(&converter, audio_out, true) == 0) {
+			if (avcodec_send_frame(audio_encoder, audio_out) < 0 ||
+				media_concat_write_encoded(media_to, audio_encoder, media_to->m_audio_stream_index, shift_us, &last_dts[1], end_us, false) < 0) {
+				failure = true;
+			}
+		}
+		if (avcodec_send_frame(audio_encoder, NULL) < 0 ||
+			media_concat_write_encoded(media_to, audio_encoder, media_to->m_audio_stream_index, shift_us, &last_dts[1], end_us, false) < 0) {
 			failure = true;
-			break;
 		}
+		free_media_audio_converter(&converter);
+	}
 
-		}
+	sws_freeContext(scale_context);
+	av_frame_free(&scaled);
+	av_frame_free(&audio_out);
+	free_media_frame(&frame);
+	avcodec_free_context(&video_encoder);
+	avcodec_free_context(&audio_encoder);
+
+	if (!failure) {
+		return 0;
 	}
 	else {
 		return -1;
 	}
+}
 
-	if (failure == true && audio_frame_recorded == true) {
-		return 1;
+/*
+Joins inputs one after another into the output streams. Inputs matching the first one are stream copied, their timestamps shifted so
+each file starts where the previous one ended. Only mismatched inputs are decoded and encoded with the first input's parameters.
+*/
+int concat_media_data(std::vector<MediaContainer*>& inputs, MediaContainer* media_to) {
+	if (inputs.empty() || media_to->m_video_stream_index < 0) {
+		media_error_submit("Nothing to concatenate!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
 	}
 
-	if (failure == true) {
-		return -1;
+	MediaContainer* reference = inputs[0];
+	int64_t output_time = 0; //AV_TIME_BASE units.
+	int64_t last_dts[2] = { AV_NOPTS_VALUE, AV_NOPTS_VALUE };
+	bool failure = false;
+	bool reencoded = false; //The output currently carries a re-encoder's in band parameter sets.
+
+	for (MediaContainer* input : inputs) {
+		int64_t start = input->format_context->start_time != AV_NOPTS_VALUE ? input->format_context->start_time : 0;
+		int64_t shift = output_time - start;
+		int64_t end = output_time;
+
+		if (input == reference || media_streams_compatible(reference, input)) {
+			failure = media_concat_copy(input, media_to, shift, last_dts, &end, reencoded) < 0;
+			reencoded = false;
+		}
+		else {
+			media_error_submit("Concat input does not match, re-encoding it!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			failure = media_concat_reencode(reference, input, media_to, shift, last_dts, &end) < 0;
+			reencoded = true;
+		}
+
+		if (failure) {
+			break;
+		}
+		output_time = end;
 	}
 
-	if (failure == false) {
-		packet->packet = output_current_packet;
-		output_current_packet->stream_index = media->m_audio_stream_index;
-		av_packet_rescale_ts(packet->packet, time_from, time_to);
+	if (!failure) {
 		return 0;
 	}
+	else {
+		return -1;
+	}
+}
 
+//Existing directories are fine, only the last path component is created.
+static void media_make_directory(const char* directory) {
+#ifdef WINDOWS_SYSTEM
+	CreateDirectoryA(directory, NULL);
+#else
+	mkdir(directory, 0755);
+#endif
 }
 
+static uint64_t media_hash_bytes(uint64_t hash, const void* data, size_t size) {
+	//FNV-1a, stable across runs and platforms which std::hash does not promise.
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
 
+static std::string media_render_cache_path(MediaRenderCache* cache, const std::string& key) {
+	return cache->directory + "/" + key + ".mkv";
+}
 
-void retrieve_pts_seconds(MediaContainer* media, MediaFrame* frame) {
-	frame->frame_pts_seconds = frame->frame_pts * (double)media->time_base.num / (double)media->time_base.den;
+static void media_render_cache_save_index(MediaRenderCache* cache) {
+	std::string path = cache->directory + "/index";
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f) {
+		media_error_submit("Render cache index could not be written!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return;
+	}
+	for (MediaRenderCacheEntry& entry : cache->entries) {
+		fprintf(f, "%s %lld\n", entry.key.c_str(), static_cast<long long>(entry.size));
+	}
+	fclose(f);
 }
 
+int malloc_media_render_cache(MediaRenderCache* cache, const char* directory, int64_t budget) {
+	cache->directory = directory;
+	cache->budget = budget;
+	cache->used = 0;
+	cache->entries.clear();
+	cache->hits = 0;
+	cache->misses = 0;
 
-void media_stream_submit_packet(MediaStreamContainer* media, const std::vector<uint8_t>& packet) {
-	media->rtp_packet_stack_buffer.push_back(packet);
-}
+	media_make_directory(directory);
 
-static int media_stream_request_packet(MediaStreamContainer* media, std::vector<uint8_t>& packet) {
-	if (media->rtp_packet_stack_buffer.empty()) {
-		return -1;
+	std::string path = cache->directory + "/index";
+	FILE* f = fopen(path.c_str(), "r");
+	if (!f) {
+		return 0;
 	}
-	packet = media->rtp_packet_stack_buffer.front();
-	media->rtp_packet_stack_buffer.pop_front();
 
-	/*
-	for (std::vector<uint8_t> i : media->packet_stack_buffer) {
-		std::cout <<"PACKET DATA: " << uint8_vector_to_hex_string(i) << std::endl;
+	char key[64];
+	long long size;
+	while (fscanf(f, "%63s %lld", key, &size) == 2) {
+		//Fragments deleted behind the cache's back are simply forgotten.
+		FILE* fragment = fopen(media_render_cache_path(cache, key).c_str(), "rb");
+		if (!fragment) {
+			continue;
+		}
+		fclose(fragment);
+		cache->entries.push_back({ key, size });
+		cache->used += size;
 	}
-	*/
-
+	fclose(f);
 	return 0;
 }
 
-static void media_stream_convert_av(AVPacket* av_packet, std::vector<uint8_t>& packet) {
-	av_packet->data = packet.data();
-	av_packet->size = sizeof(uint8_t) * packet.size();
+void free_media_render_cache(MediaRenderCache* cache) {
+	media_render_cache_save_index(cache);
+	cache->entries.clear();
+	cache->used = 0;
 }
 
-int malloc_media_stream_container(MediaStreamContainer* media, int width, int height) {
-	media->stream_width = width;
-	media->stream_height = height;
+static void media_render_cache_evict(MediaRenderCache* cache) {
+	while (cache->used > cache->budget && cache->entries.size() > 1) {
+		MediaRenderCacheEntry& victim = cache->entries.back();
+		remove(media_render_cache_path(cache, victim.key).c_str());
+		cache->used -= victim.size;
+		cache->entries.pop_back();
+	}
+}
 
-	media->codec_description.video_codec = avcodec_find_decoder(MEDIA_STREAM_VIDEO_CODEC);
-	media->codec_description.audio_codec = avcodec_find_decoder(MEDIA_STREAM_AUDIO_CODEC);
-	media->codec_description.video_codec_context = avcodec_alloc_context3(media->codec_description.video_codec);
+//Everything that changes the rendered packets goes into the key: which source, which range, the stream parameters it is rendered to, and
+//the rate control and encoder options the cut points are encoded with.
+static std::string media_render_cache_key(MediaTimelineClip& clip, MediaContainer* output) {
+	AVFormatContext* fc = clip.source->format_context;
+	std::string description = "fragment-v2|";
+	description += fc->url ? fc->url : "";
+	description += "|" + std::to_string(fc->pb ? avio_size(fc->pb) : 0) + "|" + std::to_string(fc->duration);
+
+	char range[64];
+	snprintf(range, sizeof(range), "|%.6f|%.6f", clip.in, clip.out);
+	description += range;
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = media_hash_bytes(hash, description.data(), description.size());
+	for (int i = 0; i < output->format_context->nb_streams; i++) {
+		AVCodecParameters* par = output->format_context->streams[i]->codecpar;
+		int64_t fields[] = { par->codec_type, par->codec_id, par->format, par->width, par->height, par->profile, par->sample_rate, par->channels, par->bit_rate };
+		hash = media_hash_bytes(hash, fields, sizeof(fields));
+		if (par->extradata_size > 0) {
+			hash = media_hash_bytes(hash, par->extradata, par->extradata_size);
+		}
+	}
 
-	media->codec_description.video_codec_context->pix_fmt = AV_PIX_FMT_ARGB;
-	media->codec_description.video_codec_context->height = media->stream_height;
-	media->codec_description.video_codec_context->width = media->stream_width;
+	//Cut point rate control comes from the source. The output's encoder options are keyed too, so changing a preset or CRF never
+	//reuses fragments rendered with the old settings.
+	const MediaCodecDescriptor& source_codec = clip.source->codec_description;
+	const MediaEncoderOptions& options = output->codec_description.m_encoder_options;
+	int64_t rate[] = { source_codec.m_bitrate, source_codec.m_rcmaxrate, source_codec.m_rc_buffer_size };
+	hash = media_hash_bytes(hash, rate, sizeof(rate));
+	int settings[] = { options.profile, options.crf, options.gop_size, options.max_b_frames, options.lookahead, options.threads, options.thread_type,
+		options.intra_refresh, options.time_base.num, options.time_base.den, options.audio_bitrate, options.audio_channels, options.audio_threads };
+	hash = media_hash_bytes(hash, settings, sizeof(settings));
+	std::string names = options.preset + "|" + options.tune;
+	hash = media_hash_bytes(hash, names.data(), names.size());
+
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+	return key;
+}
 
-	//Temporary flags, could be removed after testing, not sure if these reduce artifacting during slow interent or not.
-	media->codec_description.video_codec_context->workaround_bugs = AV_EF_EXPLODE | AV_EF_AGGRESSIVE;
-	if (avcodec_open2(media->codec_description.video_codec_context, media->codec_description.video_codec, NULL) < 0)
-	{
-		media_error_submit("Media Stream Error: Video codec context could not be created!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+//Renders one clip into its own file. Written under a temporary name first so a crash never leaves a truncated fragment behind.
+static int media_render_cache_fill(MediaTimeline* timeline, MediaTimelineClip& clip, MediaRenderCache* cache, const std::string& key, int64_t* size) {
+	std::string path = media_render_cache_path(cache, key);
+	std::string temp = cache->directory + "/" + key + ".part.mkv";
+
+	MediaContainer fragment;
+	malloc_media_container(&fragment, MEDIA_FILE_OUTPUT);
+	if (open_media(&fragment, temp.c_str()) < 0) {
 		return -1;
 	}
-
-	media->codec_description.audio_codec_context = avcodec_alloc_context3(media->codec_description.audio_codec);
-
-	if (avcodec_open2(media->codec_description.audio_codec_context, media->codec_description.audio_codec, NULL) < 0)
-	{
-		media_error_submit("Media Stream Error: Audio codec context could not be created!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+	populate_codecs_copy(clip.source, &fragment);
+	open_media_write_header(&fragment);
+
+	MediaTimeline single;
+	malloc_media_timeline(&single);
+	single.clips.push_back(clip);
+	int r = media_timeline_render(&single, &fragment);
+	timeline->packets_copied += single.packets_copied;
+	timeline->frames_encoded += single.frames_encoded;
+
+	open_media_write_trailer(&fragment);
+	*size = avio_size(fragment.format_context->pb);
+	free_media_timeline(&single);
+	free_media_container(&fragment);
+
+	remove(path.c_str());
+	if (r < 0 || rename(temp.c_str(), path.c_str()) != 0) {
+		remove(temp.c_str());
 		return -1;
 	}
-
 	return 0;
 }
 
-void free_media_stream_container(MediaStreamContainer* media) {
-	avcodec_close(media->codec_description.video_codec_context);
-	avcodec_close(media->codec_description.audio_codec_context);
-}
+/*
+Every clip goes through a fragment. Clips whose key is already in the cache are copied straight from their fragment, the rest are
+rendered into a new fragment first, with the same cut point logic as media_timeline_render, and then copied.
+*/
+int media_timeline_render_cached(MediaTimeline* timeline, MediaContainer* output, MediaRenderCache* cache) {
+	if (timeline->clips.empty() || output->m_video_stream_index < 0) {
+		media_error_submit("Nothing to render!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
 
-int decode_next_frame_video(MediaStreamContainer* media, MediaFrame* frame) {
 	bool failure = false;
-	std::vector<uint8_t> packet_unint;
-	AVPacket packet_av;
-	av_init_packet(&packet_av);
-
-	//Unlike video files, every frame packet built and put in queue (should) and must be a complete frame.
-	//No need for while to get more packets from queue
+	int64_t output_time = 0; //AV_TIME_BASE units.
+	int64_t last_dts[2] = { AV_NOPTS_VALUE, AV_NOPTS_VALUE };
 
-	if (media_stream_request_packet(media, packet_unint) >= 0) {
-		if (packet_unint.size() == 0) {
-			//Drop empty packet, or we can get an EOF decoder error.
-			av_packet_unref(&packet_av);
-			failure = true;
-		}
-		media_stream_convert_av(&packet_av, packet_unint);
-		frame->t_current_packet = &packet_av;
-		int r = decode_video_packet(media->codec_description, frame);
+	for (MediaTimelineClip& clip : timeline->clips) {
+		std::string key = media_render_cache_key(clip, output);
+		auto it = std::find_if(cache->entries.begin(), cache->entries.end(), [&](const MediaRenderCacheEntry& e) { return e.key == key; });
 
-		switch (r) {
-		case 0: {
-			//Success!
-			break;
-		}
-		case AVERROR(EAGAIN): {
-			//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
-			break;
-		}
-		case AVERROR(EINVAL): {
-			//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
-			break;
-		}
-		case AVERROR_EOF: {
-			//std::cout << "AVERROR_EOF on decode!" << std::endl;
-			avcodec_flush_buffers(media->codec_description.video_codec_context);
-			break;
+		if (it != cache->entries.end()) {
+			cache->hits++;
+			cache->entries.splice(cache->entries.begin(), cache->entries, it);
 		}
-		case AVERROR(ENOMEM): {
-			//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
-			break;
+		else {
+			cache->misses++;
+			int64_t size = 0;
+			if (media_render_cache_fill(timeline, clip, cache, key, &size) < 0) {
+				failure = true;
+				break;
+			}
+			cache->entries.push_front({ key, size });
+			cache->used += size;
 		}
-		default: {
+
+		MediaContainer fragment;
+		malloc_media_container(&fragment, MEDIA_FILE_INPUT);
+		if (open_media(&fragment, media_render_cache_path(cache, key).c_str()) < 0) {
 			failure = true;
 			break;
 		}
-
+		//Packets are only copied, no decoders needed. The previous fragment may end in re-encoded frames, so the sets are repeated.
+		fragment.m_video_stream_index = av_find_best_stream(fragment.format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		fragment.m_audio_stream_index = FFMAX(av_find_best_stream(fragment.format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0), -1);
+
+		int64_t start = fragment.format_context->start_time != AV_NOPTS_VALUE ? fragment.format_context->start_time : 0;
+		int64_t end = output_time;
+		failure = fragment.m_video_stream_index < 0 || media_concat_copy(&fragment, output, output_time - start, last_dts, &end, true) < 0;
+		free_media_container(&fragment);
+		if (failure) {
+			break;
 		}
+		output_time = end;
 
-		av_packet_unref(&packet_av);
-	}
-	else {
-		failure = true;
+		//Only evict once the fragment has been copied, it may be the oldest one.
+		media_render_cache_evict(cache);
 	}
 
+	media_render_cache_save_index(cache);
+
 	if (!failure) {
 		return 0;
 	}
 	else {
 		return -1;
 	}
-	/*
-	* ERROR REFERENCE:
-	* concealing errors / no frame - Packet loss, incorrect packet ordering. Poor connection.
-	* cannot find ref at POC - H265 specific, packet loss, incorrect ordering. Poor connection.
-	* stream stops / EOF - null packet input into deocoder, it assumes eof and cleans up, remedy? av_codec_flush_decoder when EOF encountered.
-	* no frame - incomplete packet submitted, associated with poor connection, can also happen if data handling produces random data.
-	*/
 }
 
-int decode_next_frame_audio(MediaStreamContainer* media, MediaFrame* frame) {
+void media_transcode_options_init(MediaTranscodeOptions* options) {
+	options->interleave_window = 32;
+	options->checkpoint_journal = NULL;
+	options->checkpoint_interval = 30.0;
+	options->resume = NULL;
+	options->progress = NULL;
+	options->progress_user = NULL;
+	options->video_filter = NULL;
+	options->filter_threads = 0;
+}
 
-	bool failure = false;
-	std::vector<uint8_t> packet_unint;
-	AVPacket packet_av;
-	av_init_packet(&packet_av);
+int media_checkpoint_read(const char* journal, MediaTranscodeCheckpoint* checkpoint) {
+	FILE* f = fopen(journal, "r");
+	if (!f) {
+		return -1;
+	}
 
-	//Unlike video files, every frame packet built and put in queue (should) and must be a complete frame.
-	//No need for while to get more packets from queue
+	char key[64];
+	long long value;
+	int fields = 0;
+	while (fscanf(f, "%63s %lld", key, &value) == 2) {
+		std::string name = key;
+		fields++;
+		if (name == "input_pts") checkpoint->input_pts = value;
+		else if (name == "output_offset") checkpoint->output_offset = value;
+		else if (name == "video_last_dts") checkpoint->video_last_dts = value;
+		else if (name == "audio_end_pts") checkpoint->audio_end_pts = value;
+		else if (name == "video_codec_id") checkpoint->video_codec_id = static_cast<int>(value);
+		else if (name == "audio_codec_id") checkpoint->audio_codec_id = static_cast<int>(value);
+		else if (name == "width") checkpoint->width = static_cast<int>(value);
+		else if (name == "height") checkpoint->height = static_cast<int>(value);
+		else if (name == "pix_fmt") checkpoint->pix_fmt = static_cast<int>(value);
+		else if (name == "bit_rate") checkpoint->bit_rate = value;
+		else if (name == "sample_rate") checkpoint->sample_rate = static_cast<int>(value);
+		else if (name == "channels") checkpoint->channels = static_cast<int>(value);
+		else fields--;
+	}
+	fclose(f);
 
-	if (media_stream_request_packet(media, packet_unint) >= 0) {
-		if (packet_unint.size() == 0) {
-			//Drop empty packet, or we can get an EOF decoder error.
-			av_packet_unref(&packet_av);
-			failure = true;
-		}
-		media_stream_convert_av(&packet_av, packet_unint);
-		frame->t_current_packet = &packet_av;
-		int r = decode_audio_packet(media->codec_description, frame);
+	if (fields != 12) {
+		media_error_submit("Checkpoint journal is incomplete, starting over!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
 
-		switch (r) {
-		case 0: {
-			//Success!
-			break;
-		}
-		case AVERROR(EAGAIN): {
-			//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
-			break;
-		}
-		case AVERROR(EINVAL): {
-			//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
-			break;
-		}
-		case AVERROR_EOF: {
-			//std::cout << "AVERROR_EOF on decode!" << std::endl;
-			avcodec_flush_buffers(media->codec_description.audio_codec_context);
-			break;
+int media_checkpoint_write(const char* journal, const MediaTranscodeCheckpoint* checkpoint) {
+	//Written next to the journal and swapped in, a crash while writing leaves the previous checkpoint intact.
+	std::string temp = std::string(journal) + ".tmp";
+	FILE* f = fopen(temp.c_str(), "w");
+	if (!f) {
+		media_error_submit("Checkpoint journal could not be written!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	fprintf(f, "input_pts %lld\n", static_cast<long long>(checkpoint->input_pts));
+	fprintf(f, "output_offset %lld\n", static_cast<long long>(checkpoint->output_offset));
+	fprintf(f, "video_last_dts %lld\n", static_cast<long long>(checkpoint->video_last_dts));
+	fprintf(f, "audio_end_pts %lld\n", static_cast<long long>(checkpoint->audio_end_pts));
+	fprintf(f, "video_codec_id %d\n", checkpoint->video_codec_id);
+	fprintf(f, "audio_codec_id %d\n", checkpoint->audio_codec_id);
+	fprintf(f, "width %d\n", checkpoint->width);
+	fprintf(f, "height %d\n", checkpoint->height);
+	fprintf(f, "pix_fmt %d\n", checkpoint->pix_fmt);
+	fprintf(f, "bit_rate %lld\n", static_cast<long long>(checkpoint->bit_rate));
+	fprintf(f, "sample_rate %d\n", checkpoint->sample_rate);
+	fprintf(f, "channels %d\n", checkpoint->channels);
+	bool written = fflush(f) == 0;
+	fclose(f);
+
+#ifdef WINDOWS_SYSTEM
+	written = written && MoveFileExA(temp.c_str(), journal, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	written = written && rename(temp.c_str(), journal) == 0;
+#endif
+	if (!written) {
+		media_error_submit("Checkpoint journal could not be replaced!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+int media_checkpoint_remove(const char* journal) {
+	return remove(journal) == 0 ? 0 : -1;
+}
+
+static void media_checkpoint_from_encoders(MediaContainer* media, MediaTranscodeCheckpoint* checkpoint) {
+	AVCodecContext* video = media->codec_description.video_codec_context;
+	AVCodecContext* audio = media->codec_description.audio_codec_context;
+
+	checkpoint->input_pts = AV_NOPTS_VALUE;
+	checkpoint->output_offset = 0;
+	checkpoint->video_last_dts = AV_NOPTS_VALUE;
+	checkpoint->audio_end_pts = AV_NOPTS_VALUE;
+
+	checkpoint->video_codec_id = video->codec_id;
+	checkpoint->width = video->width;
+	checkpoint->height = video->height;
+	checkpoint->pix_fmt = video->pix_fmt;
+	checkpoint->bit_rate = video->bit_rate;
+	checkpoint->audio_codec_id = audio ? audio->codec_id : AV_CODEC_ID_NONE;
+	checkpoint->sample_rate = audio ? audio->sample_rate : 0;
+	checkpoint->channels = audio ? audio->channels : 0;
+}
+
+static bool media_checkpoint_matches(const MediaTranscodeCheckpoint* a, const MediaTranscodeCheckpoint* b) {
+	return a->video_codec_id == b->video_codec_id && a->audio_codec_id == b->audio_codec_id && a->width == b->width && a->height == b->height &&
+		a->pix_fmt == b->pix_fmt && a->bit_rate == b->bit_rate && a->sample_rate == b->sample_rate && a->channels == b->channels;
+}
+
+//Packets still sitting in the interleaver or inside the muxer would die with the process, push everything to disk before recording the offset.
+static int media_transcode_checkpoint(MediaContainer* media, MediaTranscodeJournal* journal) {
+	AVFormatContext* fc = media->format_context;
+	av_interleaved_write_frame(fc, NULL);
+	if (fc->oformat->flags & AVFMT_ALLOW_FLUSH) {
+		av_write_frame(fc, NULL);
+	}
+	avio_flush(fc->pb);
+	//A position the output never reached must not become the resume point.
+	if (fc->pb->error < 0) {
+		media_error_submit("Output could not be flushed for a checkpoint!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	journal->checkpoint.input_pts = journal->pending_input;
+	journal->checkpoint.output_offset = avio_tell(fc->pb);
+	journal->checkpoint.video_last_dts = journal->written[0];
+	journal->checkpoint.audio_end_pts = journal->written[1];
+	return media_checkpoint_write(journal->path, &journal->checkpoint);
+}
+
+//Writes queued packets in dts order. A packet is only safe to write once the other stream has something queued too, unless the window is
+//full, then the lagging stream is assumed to be sparse and the oldest packet goes out anyway.
+static int media_transcode_interleave(MediaContainer* media, std::deque<MediaPacket>* queues, AVRational* time_bases, int window, bool drain, MediaTranscodeJournal* journal) {
+	bool failure = false;
+
+	while (true) {
+		bool have_video = !queues[0].empty();
+		bool have_audio = !queues[1].empty();
+		int held = queues[0].size() + queues[1].size();
+		int next = -1;
+
+		if (have_video && have_audio) {
+			AVPacket* v = queues[0].front().packet;
+			AVPacket* a = queues[1].front().packet;
+			int64_t v_ts = v->dts != AV_NOPTS_VALUE ? v->dts : v->pts;
+			int64_t a_ts = a->dts != AV_NOPTS_VALUE ? a->dts : a->pts;
+			next = av_compare_ts(v_ts, time_bases[0], a_ts, time_bases[1]) <= 0 ? 0 : 1;
 		}
-		case AVERROR(ENOMEM): {
-			//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
-			break;
+		else if ((drain && held > 0) || held > window) {
+			next = have_video ? 0 : 1;
 		}
-		default: {
-			failure = true;
+		else {
 			break;
 		}
 
+		MediaPacket packet = queues[next].front();
+		queues[next].pop_front();
+		AVPacket* p = packet.packet;
+
+		if (journal) {
+			//Resumed files already hold the overlap, audio restarts up to a frame early and the encoder priming lands before the cut.
+			int64_t& resume = journal->resume_after[next];
+			if (resume != AV_NOPTS_VALUE) {
+				bool duplicate = next == 0 ? p->dts <= resume : p->pts + p->duration / 2 < resume;
+				if (duplicate) {
+					free_media_packet(&packet);
+					continue;
+				}
+				resume = AV_NOPTS_VALUE;
+			}
+
+			if (next == 0 && journal->pending_pts != AV_NOPTS_VALUE && (p->flags & AV_PKT_FLAG_KEY) && p->pts == journal->pending_pts) {
+				//A stale journal would resume from the wrong place later, so a failed checkpoint fails the transcode.
+				if (media_transcode_checkpoint(media, journal) < 0) {
+					failure = true;
+				}
+				journal->pending_pts = AV_NOPTS_VALUE;
+			}
+			journal->written[next] = next == 0 ? p->dts : p->pts + p->duration;
 		}
 
-		av_packet_unref(&packet_av);
-	}
-	else {
-		failure = true;
+		if (open_media_write_packet(media, &packet) < 0) {
+			failure = true;
+		}
+		free_media_packet(&packet);
 	}
 
 	if (!failure) {
@@ -1122,82 +2248,4547 @@ int decode_next_frame_audio(MediaStreamContainer* media, MediaFrame* frame) {
 	}
 }
 
-void malloc_media_file_stream_container(MediaFileStreamingBuffer* media, float timebase_num, float timebase_den, int fps) {
-	media->last_frame_pts_video = 0;
-	media->last_frame_pts_audio = 0;
-	media->time_base = av_make_q(timebase_num, timebase_den);
-	media->m_fps = fps;
-}
-void free_media_file_stream_container(MediaFileStreamingBuffer* media) {
-	for (auto i : media->stack_buffer_video) {
-		av_packet_free(&i.packet);
-	}
-
-	for (auto i : media->stack_buffer_audio) {
-		av_packet_free(&i.packet);
-	}
-}
+/*
+Replaces the decode all video, seek back, decode all audio pattern from the demos. Packets are read once, each decoded frame goes straight
+to its encoder and the encoded packets sit in a small window until they can be muxed in dts order. Nothing grows with the input length.
+Frames are scaled when the output size or pixel format differs and audio is resampled and reframed to suit the encoder.
 
-static float media_file_stream_gen_pts_video(MediaFileStreamingBuffer* media) {
-	if (media->last_frame_pts_video == 0 ) {
-		float pts_inc_this_frame = 0.0f;
-		pts_inc_this_frame = media->time_base.den / media->m_fps;
-		return pts_inc_this_frame;
+With a checkpoint journal, every interval an input keyframe is forced to a keyframe in the output too. Once that packet reaches the muxer
+everything before it is flushed to disk and the position recorded. Resuming seeks the input back to that keyframe and drops what the
+output already has.
+*/
+int transcode_media(MediaContainer* media_from, MediaContainer* media_to, const MediaTranscodeOptions* options) {
+	MediaTranscodeOptions transcode_options;
+	if (options) {
+		transcode_options = *options;
 	}
 	else {
-		float pts_inc_this_frame = 0.0f;
-		pts_inc_this_frame = media->time_base.den / media->m_fps;
+		media_transcode_options_init(&transcode_options);
+	}
 
-		return media->last_frame_pts_video + pts_inc_this_frame;
+	AVCodecContext* video_encoder = media_to->codec_description.video_codec_context;
+	AVCodecContext* audio_encoder = media_to->codec_description.audio_codec_context;
+	if (!video_encoder || media_from->m_video_stream_index < 0) {
+		media_error_submit("Transcode needs a video stream on both containers!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	bool has_audio = audio_encoder && media_from->m_audio_stream_index >= 0 && media_to->m_audio_stream_index >= 0;
+
+	AVRational video_in = media_from->format_context->streams[media_from->m_video_stream_index]->time_base;
+	AVRational audio_in = { 0, 1 };
+	AVRational out_time_bases[2] = { media_to->format_context->streams[media_to->m_video_stream_index]->time_base, { 0, 1 } };
+	if (has_audio) {
+		audio_in = media_from->format_context->streams[media_from->m_audio_stream_index]->time_base;
+		out_time_bases[1] = media_to->format_context->streams[media_to->m_audio_stream_index]->time_base;
 	}
-}
 
-static float media_file_stream_gen_pts_audio(MediaFileStreamingBuffer* media) {
-	if (media->last_frame_pts_audio == 0) {
-		float pts_inc_this_frame = 0.0f;
-		pts_inc_this_frame = media->time_base.den / media->m_fps;
-		return pts_inc_this_frame;
+	MediaTranscodeJournal journal;
+	MediaTranscodeJournal* journal_ptr = NULL;
+	int64_t next_checkpoint = AV_NOPTS_VALUE;   //Input video time base.
+	int64_t skip_video_before = AV_NOPTS_VALUE; //Input video time base.
+	int64_t skip_audio_before = AV_NOPTS_VALUE; //Input audio time base.
+	int64_t checkpoint_interval = av_rescale_q(static_cast<int64_t>(transcode_options.checkpoint_interval * AV_TIME_BASE), AV_TIME_BASE_Q, video_in);
+
+	if (transcode_options.checkpoint_journal || transcode_options.resume) {
+		media_checkpoint_from_encoders(media_to, &journal.checkpoint);
+		journal.path = transcode_options.checkpoint_journal;
+		journal.pending_input = AV_NOPTS_VALUE;
+		journal.pending_pts = AV_NOPTS_VALUE;
+		journal.written[0] = journal.written[1] = AV_NOPTS_VALUE;
+		journal.resume_after[0] = journal.resume_after[1] = AV_NOPTS_VALUE;
+		journal_ptr = &journal;
+
+		if (journal.path && !media_output_resumable(media_to)) {
+			media_error_submit("Output format cannot be resumed, checkpoints disabled!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			journal.path = NULL;
+		}
 	}
-	else {
-		float pts_inc_this_frame = 0.0f;
-		pts_inc_this_frame = media->time_base.den / media->m_fps;
 
-		return media->last_frame_pts_audio + pts_inc_this_frame;
+	//Filters can drop, add and retime frames, checkpoints could no longer be matched to input keyframes.
+	if (transcode_options.video_filter && journal_ptr) {
+		media_error_submit("Checkpoints are not supported together with a video filter!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
 	}
-}
 
-void media_submit_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket packet) {
-	packet.pts = media_file_stream_gen_pts_video(media);
-	media->last_frame_pts_video = packet.pts;
-	media->stack_buffer_video.push_back(packet);
-}
+	if (transcode_options.resume) {
+		const MediaTranscodeCheckpoint* resume = transcode_options.resume;
+		if (!media_checkpoint_matches(&journal.checkpoint, resume)) {
+			media_error_submit("Checkpoint was written with different encoder parameters!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		if (media_build_keyframe_index(media_from) < 0) {
+			return -1;
+		}
 
-void media_submit_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket packet) {
-	packet.pts = media_file_stream_gen_pts_audio(media);
-	media->last_frame_pts_audio = packet.pts;
-	media->stack_buffer_audio.push_back(packet);
-}
+		//Audio may trail the video keyframe in the file, start early enough to cover it and drop the video frames before the cut.
+		int64_t target = resume->input_pts;
+		if (has_audio && resume->audio_end_pts != AV_NOPTS_VALUE) {
+			skip_audio_before = av_rescale_q(resume->audio_end_pts, out_time_bases[1], audio_in);
+			target = FFMIN(target, av_rescale_q(resume->audio_end_pts, out_time_bases[1], video_in));
+		}
+		int key = FFMAX(media_keyframe_at_or_before(media_from, target), 0);
+		if (av_seek_frame(media_from->format_context, media_from->m_video_stream_index, media_from->keyframe_index.keyframes[key].timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+			media_error_submit("Seek to checkpoint failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		avcodec_flush_buffers(media_from->codec_description.video_codec_context);
+		if (media_from->codec_description.audio_codec_context) {
+			avcodec_flush_buffers(media_from->codec_description.audio_codec_context);
+		}
+		media_from->m_demux_eof = false;
 
-int media_request_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket& packet) {
-	if (media->stack_buffer_video.empty()) {
-		return -1;
+		skip_video_before = resume->input_pts;
+		next_checkpoint = resume->input_pts + checkpoint_interval;
+		journal.checkpoint = *resume;
+		journal.written[0] = journal.resume_after[0] = resume->video_last_dts;
+		journal.written[1] = journal.resume_after[1] = resume->audio_end_pts;
 	}
-	packet = media->stack_buffer_video.front();
-	packet.packet->pts = packet.pts;
-	//packet.packet->dts = packet.pts;
-	media->stack_buffer_video.pop_front();
 
-	return 0;
-}
-
-int media_request_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket& packet) {
-	if (media->stack_buffer_audio.empty()) {
+	MediaAudioConverter audio_converter;
+	if (has_audio && malloc_media_audio_converter(&audio_converter, audio_encoder) < 0) {
 		return -1;
 	}
-	packet = media->stack_buffer_audio.front();
-	packet.packet->pts = packet.pts;
-	//packet.packet->dts = packet.pts;
-	media->stack_buffer_audio.pop_front();
 
-	return 0;
-}
\ No newline at end of file
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	//Frames handed to the encoders, either the decoded frame itself or a converted copy.
+	MediaFrame encode_frame;
+	encode_frame.video_frame = NULL;
+	encode_frame.audio_frame = av_frame_alloc();
+
+	SwsContext* scale_context = NULL;
+	AVFrame* scaled = av_frame_alloc();
+
+	std::deque<MediaPacket> queues[2];
+	std::vector<MediaPacket> packets;
+	bool failure = false;
+	AVMediaType type;
+
+	//Scales to the encoder when needed and encodes one picture, pts is in time_base: the input's, or the filter graph's.
+	auto encode_video = [&](AVFrame* source, int64_t pts, AVRational time_base) {
+		encode_frame.video_frame = source;
+
+		if (source->width != video_encoder->width || source->height != video_encoder->height || source->format != video_encoder->pix_fmt) {
+			scale_context = sws_getCachedContext(scale_context, source->width, source->height, static_cast<AVPixelFormat>(source->format),
+				video_encoder->width, video_encoder->height, video_encoder->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+
+			if (!scaled->buf[0]) {
+				scaled->width = video_encoder->width;
+				scaled->height = video_encoder->height;
+				scaled->format = video_encoder->pix_fmt;
+				av_frame_get_buffer(scaled, 32);
+			}
+			//The encoder may still hold a reference to the last scaled picture.
+			if (!scale_context || av_frame_make_writable(scaled) < 0) {
+				media_error_submit("Transcode scaler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+				failure = true;
+				return;
+			}
+			sws_scale(scale_context, source->data, source->linesize, 0, source->height, scaled->data, scaled->linesize);
+			av_frame_copy_props(scaled, source);
+			encode_frame.video_frame = scaled;
+		}
+
+		encode_frame.video_frame->pts = av_rescale_q(pts, time_base, video_encoder->time_base);
+		encode_frame.video_frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+		//Checkpoints sit on input keyframes so a resume can seek straight to them. Never with a filter, time_base is the input's here.
+		if (journal_ptr && journal.path && source->key_frame) {
+			if (next_checkpoint == AV_NOPTS_VALUE) {
+				next_checkpoint = pts + checkpoint_interval;
+			}
+			else if (pts >= next_checkpoint) {
+				encode_frame.video_frame->pict_type = AV_PICTURE_TYPE_I;
+				journal.pending_input = pts;
+				journal.pending_pts = av_rescale_q(encode_frame.video_frame->pts, video_encoder->time_base, out_time_bases[0]);
+				next_checkpoint = pts + checkpoint_interval;
+			}
+		}
+
+		if (encode_next_frame_video(media_to, &encode_frame, packets, video_encoder->time_base, out_time_bases[0]) < 0) {
+			failure = true;
+		}
+		queues[0].insert(queues[0].end(), packets.begin(), packets.end());
+		packets.clear();
+
+		if (transcode_options.progress) {
+			transcode_options.progress(transcode_options.progress_user, pts * av_q2d(time_base));
+		}
+	};
+
+	//Built on the first decoded frame, which knows the real size and format better than the codec parameters do.
+	MediaFilterGraph video_filter;
+	video_filter.graph = NULL;
+	MediaFrame filtered;
+	malloc_media_frame(&filtered);
+	auto drain_filter = [&]() {
+		while (!failure && media_filter_receive(&video_filter, &filtered) == 0) {
+			AVFrame* picture = filtered.video_frame;
+			encode_video(picture, picture->pts != AV_NOPTS_VALUE ? picture->pts : picture->best_effort_timestamp, video_filter.time_base);
+		}
+	};
+
+	while (!failure && decode_next_frame_any(media_from, &frame, &type) == 0) {
+		if (type == AVMEDIA_TYPE_VIDEO) {
+			AVFrame* source = frame.video_frame;
+			int64_t pts = source->pts != AV_NOPTS_VALUE ? source->pts : source->best_effort_timestamp;
+			if (skip_video_before != AV_NOPTS_VALUE && pts < skip_video_before) {
+				continue;
+			}
+
+			if (!transcode_options.video_filter) {
+				encode_video(source, pts, video_in);
+			}
+			else {
+				if (!video_filter.graph) {
+					AVStream* stream = media_from->format_context->streams[media_from->m_video_stream_index];
+					if (malloc_media_filter_graph(&video_filter, transcode_options.video_filter, source->width, source->height, source->format,
+						source->sample_aspect_ratio, video_in, av_guess_frame_rate(media_from->format_context, stream, NULL), video_encoder->pix_fmt,
+						transcode_options.filter_threads) < 0) {
+						failure = true;
+						break;
+					}
+				}
+				source->pts = pts;
+				if (media_filter_submit(&video_filter, source) < 0) {
+					failure = true;
+					break;
+				}
+				drain_filter();
+			}
+		}
+		else if (type == AVMEDIA_TYPE_AUDIO && has_audio) {
+			AVFrame* audio = frame.audio_frame;
+			if (skip_audio_before != AV_NOPTS_VALUE && audio->pts != AV_NOPTS_VALUE &&
+				audio->pts + av_rescale_q(audio->nb_samples, av_make_q(1, audio->sample_rate), audio_in) <= skip_audio_before) {
+				continue;
+			}
+			skip_audio_before = AV_NOPTS_VALUE;
+			media_audio_converter_submit(&audio_converter, frame.audio_frame, audio_in);
+			while (!failure && media_audio_converter_receive(&audio_converter, encode_frame.audio_frame, false) == 0) {
+				if (encode_next_frame_audio(media_to, &encode_frame, packets, audio_encoder->time_base, out_time_bases[1]) < 0) {
+					failure = true;
+				}
+			}
+			queues[1].insert(queues[1].end(), packets.begin(), packets.end());
+			packets.clear();
+		}
+
+		if (media_transcode_interleave(media_to, queues, out_time_bases, transcode_options.interleave_window, false, journal_ptr) < 0) {
+			failure = true;
+		}
+	}
+
+	//Drain filter, resampler and encoders so the tail of both streams makes it into the file.
+	if (video_filter.graph && !failure) {
+		media_filter_submit(&video_filter, NULL);
+		drain_filter();
+	}
+	//A tail that fails to encode leaves a truncated file, so it fails the transcode like any other encode error.
+	if (encode_flush_video(media_to, packets, video_encoder->time_base, out_time_bases[0]) < 0) {
+		failure = true;
+	}
+	queues[0].insert(queues[0].end(), packets.begin(), packets.end());
+	packets.clear();
+
+	if (has_audio) {
+		media_audio_converter_submit(&audio_converter, NULL, audio_in);
+		while (media_audio_converter_receive(&audio_converter, encode_frame.audio_frame, true) == 0) {
+			if (encode_next_frame_audio(media_to, &encode_frame, packets, audio_encoder->time_base, out_time_bases[1]) < 0) {
+				failure = true;
+			}
+		}
+		if (encode_flush_audio(media_to, packets, audio_encoder->time_base, out_time_bases[1]) < 0) {
+			failure = true;
+		}
+		queues[1].insert(queues[1].end(), packets.begin(), packets.end());
+		packets.clear();
+	}
+
+	if (media_transcode_interleave(media_to, queues, out_time_bases, transcode_options.interleave_window, true, journal_ptr) < 0) {
+		failure = true;
+	}
+
+	sws_freeContext(scale_context);
+	av_frame_free(&scaled);
+	av_frame_free(&encode_frame.audio_frame);
+	free_media_filter_graph(&video_filter);
+	free_media_frame(&filtered);
+	free_media_frame(&frame);
+	if (has_audio) {
+		free_media_audio_converter(&audio_converter);
+	}
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
+
+int media_build_keyframe_index(MediaContainer* media) {
+	MediaKeyframeIndex& index = media->keyframe_index;
+	if (index.built) {
+		return 0;
+	}
+	if (media->type != MEDIA_FILE_INPUT || media->m_video_stream_index < 0) {
+		media_error_submit("Keyframe index needs an input with a video stream!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	AVStream* stream = media->format_context->streams[media->m_video_stream_index];
+	index.keyframes.clear();
+	index.end_pts = 0;
+
+	//MP4 style demuxers know every sample after opening, only trust the index when it reaches the end of the stream. Index timestamps
+	//are dts, they only equal pts when the stream has no frame reordering, B frame streams are scanned for the real pts instead.
+	bool reordered = stream->codecpar->video_delay > 0;
+	if (!reordered && stream->nb_index_entries > 1 && stream->duration != AV_NOPTS_VALUE) {
+		int64_t last = stream->index_entries[stream->nb_index_entries - 1].timestamp;
+		if (last - stream->index_entries[0].timestamp >= stream->duration * 9 / 10) {
+			for (int i = 0; i < stream->nb_index_entries; i++) {
+				AVIndexEntry& entry = stream->index_entries[i];
+				if (entry.flags & AVINDEX_KEYFRAME) {
+					index.keyframes.push_back({ entry.timestamp, entry.timestamp, entry.pos });
+				}
+			}
+			index.end_pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time + stream->duration : stream->duration;
+		}
+	}
+
+	if (index.keyframes.empty()) {
+		AVPacket packet;
+		av_init_packet(&packet);
+		reset_input_container_state(media);
+
+		while (av_read_frame(media->format_context, &packet) >= 0) {
+			if (packet.stream_index == media->m_video_stream_index) {
+				int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+				if ((packet.flags & AV_PKT_FLAG_KEY) && pts != AV_NOPTS_VALUE) {
+					index.keyframes.push_back({ pts, packet.dts != AV_NOPTS_VALUE ? packet.dts : pts, packet.pos });
+				}
+				if (pts != AV_NOPTS_VALUE) {
+					index.end_pts = FFMAX(index.end_pts, pts + packet.duration);
+				}
+			}
+			av_packet_unref(&packet);
+		}
+		reset_input_container_state(media);
+	}
+
+	std::sort(index.keyframes.begin(), index.keyframes.end(), [](const MediaKeyframe& a, const MediaKeyframe& b) { return a.pts < b.pts; });
+	if (index.keyframes.empty()) {
+		media_error_submit("No keyframes found in video stream!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	index.built = true;
+	return 0;
+}
+
+int media_keyframe_at_or_before(MediaContainer* media, int64_t pts) {
+	const std::vector<MediaKeyframe>& keyframes = media->keyframe_index.keyframes;
+	auto it = std::upper_bound(keyframes.begin(), keyframes.end(), pts, [](int64_t value, const MediaKeyframe& k) { return value < k.pts; });
+	return static_cast<int>(it - keyframes.begin()) - 1;
+}
+
+int media_plan_trim_segments(MediaContainer* media, const std::vector<MediaTrimRange>& ranges, std::vector<MediaTrimSegment>& segments) {
+	if (media_build_keyframe_index(media) < 0) {
+		return -1;
+	}
+
+	AVRational time_base = media->format_context->streams[media->m_video_stream_index]->time_base;
+	segments.clear();
+
+	for (const MediaTrimRange& range : ranges) {
+		if (range.end <= range.start) {
+			media_error_submit("Empty trim range skipped!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			continue;
+		}
+
+		MediaTrimSegment segment;
+		segment.range = range;
+		int64_t start = av_rescale_q(static_cast<int64_t>(range.start * AV_TIME_BASE), AV_TIME_BASE_Q, time_base);
+		segment.keyframe = FFMAX(media_keyframe_at_or_before(media, start), 0);
+		segment.start_pts = media->keyframe_index.keyframes[segment.keyframe].pts;
+		segment.end_pts = FFMIN(av_rescale_q(static_cast<int64_t>(range.end * AV_TIME_BASE), AV_TIME_BASE_Q, time_base), media->keyframe_index.end_pts);
+		segments.push_back(segment);
+	}
+
+	return segments.empty() ? -1 : 0;
+}
+
+/*
+Copies the ranges back to back without touching the decoders. Every segment starts from the keyframe at or before its start, so it
+may begin slightly early, and stops once both streams are past its end, video by decode timestamp so no kept frame loses a reference. Timestamps are rebased so the output plays from zero and
+continues seamlessly from one segment into the next.
+*/
+int remux_media_data_ranges(MediaContainer* media_from, MediaContainer* media_to, const std::vector<MediaTrimRange>& ranges) {
+	std::vector<MediaTrimSegment> segments;
+	if (media_plan_trim_segments(media_from, ranges, segments) < 0) {
+		return -1;
+	}
+
+	int video_in = media_from->m_video_stream_index;
+	int audio_in = media_from->m_audio_stream_index;
+	AVRational video_tb = media_from->format_context->streams[video_in]->time_base;
+
+	bool failure = false;
+	int64_t output_offset = 0; //AV_TIME_BASE units, where the next segment starts in the output.
+	int64_t last_video_dts = AV_NOPTS_VALUE; //AV_TIME_BASE units.
+	AVPacket packet;
+	av_init_packet(&packet);
+
+	for (MediaTrimSegment& segment : segments) {
+		const MediaKeyframe& keyframe = media_from->keyframe_index.keyframes[segment.keyframe];
+		if (av_seek_frame(media_from->format_context, video_in, keyframe.timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+			media_error_submit("Seek to segment keyframe failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			failure = true;
+			break;
+		}
+
+		int64_t segment_start = av_rescale_q(segment.start_pts, video_tb, AV_TIME_BASE_Q);
+		int64_t segment_end = av_rescale_q(segment.end_pts, video_tb, AV_TIME_BASE_Q);
+		int64_t segment_length = 0;
+
+		//B frame reordering puts the first dts before the first pts, keep dts increasing across the joint.
+		int64_t reorder_delay = av_rescale_q(keyframe.pts - keyframe.timestamp, video_tb, AV_TIME_BASE_Q);
+		if (last_video_dts != AV_NOPTS_VALUE && output_offset - reorder_delay <= last_video_dts) {
+			output_offset = last_video_dts + reorder_delay + 1;
+		}
+
+		bool video_done = false;
+		bool audio_done = audio_in < 0;
+		bool seen_keyframe = false;
+
+		while (!failure && !(video_done && audio_done) && av_read_frame(media_from->format_context, &packet) >= 0) {
+			bool is_video = packet.stream_index == video_in;
+			bool is_audio = packet.stream_index == audio_in;
+			if (!is_video && !is_audio) {
+				av_packet_unref(&packet);
+				continue;
+			}
+
+			AVRational in_tb = media_from->format_context->streams[packet.stream_index]->time_base;
+			int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+			int64_t time = av_rescale_q(pts, in_tb, AV_TIME_BASE_Q);
+
+			bool keep = true;
+			if (is_video) {
+				//Anything demuxed before the keyframe itself cannot be decoded without its references.
+				seen_keyframe = seen_keyframe || (packet.flags & AV_PKT_FLAG_KEY);
+				//Cut in decode order, a reference frame shown after the end still has to go out for the B frames before it.
+				int64_t dts_time = av_rescale_q(packet.dts != AV_NOPTS_VALUE ? packet.dts : pts, in_tb, AV_TIME_BASE_Q);
+				if (dts_time >= segment_end) {
+					video_done = true;
+				}
+				keep = seen_keyframe && !video_done;
+			}
+			else {
+				if (time >= segment_end) {
+					audio_done = true;
+				}
+				keep = time >= segment_start && time < segment_end;
+			}
+
+			if (keep) {
+				int out_index = is_video ? media_to->m_video_stream_index : media_to->m_audio_stream_index;
+				AVRational out_tb = media_to->format_context->streams[out_index]->time_base;
+				int64_t shift = av_rescale_q(output_offset - segment_start, AV_TIME_BASE_Q, in_tb);
+
+				if (packet.pts != AV_NOPTS_VALUE) packet.pts += shift;
+				if (packet.dts != AV_NOPTS_VALUE) packet.dts += shift;
+				int64_t end_time = av_rescale_q(pts + packet.duration, in_tb, AV_TIME_BASE_Q) - segment_start;
+				segment_length = FFMAX(segment_length, end_time);
+				if (is_video && packet.dts != AV_NOPTS_VALUE) {
+					last_video_dts = av_rescale_q(packet.dts, in_tb, AV_TIME_BASE_Q);
+				}
+
+				av_packet_rescale_ts(&packet, in_tb, out_tb);
+				packet.stream_index = out_index;
+				packet.pos = -1;
+
+				MediaPacket pack;
+				pack.packet = &packet;
+				if (open_media_write_packet(media_to, &pack) < 0) {
+					failure = true;
+				}
+			}
+			av_packet_unref(&packet);
+		}
+
+		output_offset += segment_length;
+	}
+
+	reset_input_container_state(media_from);
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
+
+int malloc_media_frame(MediaFrame* frame) {
+	frame->video_frame = av_frame_alloc();
+	frame->audio_frame = av_frame_alloc();
+
+	frame->t_current_packet = av_packet_alloc();
+	if (!frame->video_frame || !frame->t_current_packet || !frame->audio_frame) {
+		media_error_submit("Frame Could not be allocated!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+int malloc_media_packet(MediaPacket* packet) {
+	packet->packet = av_packet_alloc();
+	if (!packet) {
+		media_error_submit("Packet Could not be allocated!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	return 0;
+}
+
+void free_media_frame(MediaFrame* frame) {
+	//av_packet_free(&frame->t_current_packet);
+	av_frame_free(&frame->video_frame);
+	av_frame_free(&frame->audio_frame);
+}
+
+void free_media_packet(MediaPacket* packet) {
+	av_packet_free(&packet->packet);
+}
+
+static int decode_video_packet(MediaCodecDescriptor& codec, MediaFrame* frame)
+{
+	int send_resp = -1;
+	int response = -1;
+	send_resp = avcodec_send_packet(codec.video_codec_context, frame->t_current_packet);
+	if (send_resp == 0)
+	{
+		response = avcodec_receive_frame(codec.video_codec_context, frame->video_frame);
+		return response;
+	}
+
+	return send_resp;
+}
+
+static int decode_audio_packet(MediaCodecDescriptor& codec, MediaFrame* frame)
+{
+	int response = -1;
+	int send_resp = -1;
+	send_resp = avcodec_send_packet(codec.audio_codec_context, frame->t_current_packet);
+	if (send_resp == 0)
+	{
+		response = avcodec_receive_frame(codec.audio_codec_context, frame->audio_frame);
+		return response;
+	}
+
+	return send_resp;
+}
+
+/*
+I think the part when you "get to correct timestamp to discard prior frames up to desired seconds" is incorrect.
+As I understand it, we can't just ignore the packed: av_packet_unref(pPacket);.
+We have to decode all the packets up to the correct frame (decode and then ignore),
+because after each key frame, there is a "frame dependency chain" up to the next key frames
+(there are P-frames and B-frames...).
+
+okay so its simple just decoe every packet, DONT SKIP ANY PACKET DECODE, and simply use frame number to get the right
+frame data at the right time!
+
+
+So essentially I was getting th issue why? because my packets werent getting decoded sequentially,
+the audio pacets in the middle were proving to be a problem as they broke contiuinty and thus B Frames and P frames were
+messed up. Now seperating both streams makes things easier
+
+Very inefficinet as im essentially doing two while loops, make another funtion that takes in a function ptr which will give it
+instructions on how to deal with caputred frame (so only while loop)
+*/
+
+int decode_next_frame_video(MediaContainer* media, MediaFrame* frame) {
+	bool video_frame_recorded = false;
+
+	bool failure = false;
+
+	//Read Frame gives -ve if eof or error, splits stream into packets only.
+	while (!video_frame_recorded && !failure) {
+
+		if (av_read_frame(media->format_context, frame->t_current_packet) >= 0) {
+
+			if (video_frame_recorded == false && frame->t_current_packet->stream_index == media->m_video_stream_index) {
+				int r = decode_video_packet(media->codec_description, frame);
+				switch (r) {
+				case 0: {
+					video_frame_recorded = true;
+					//std::cout << "video frame recorded" << std::endl;
+					break;
+				}
+				case AVERROR(EAGAIN): {
+					//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
+					break;
+				}
+				case AVERROR(EINVAL): {
+					//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
+					break;
+				}
+				case AVERROR_EOF: {
+					//std::cout << "AVERROR_EOF on decode! (End of File reached, terminating)" << std::endl;
+					break;
+				}
+				case AVERROR(ENOMEM): {
+					//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
+					break;
+				}
+				default: {
+					failure = true;
+					break;
+				}
+
+				}
+			}
+			av_packet_unref(frame->t_current_packet);
+		}
+		else {
+			failure = true;
+		}
+	}
+
+	if (!failure) {
+		frame->frame_pts = frame->video_frame->pts;
+		retrieve_pts_seconds(media, frame);
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
+
+//One packet can hold several audio frames, those are handed out before reading more. At EOF the decoder is drained so the tail of
+//the stream is not lost.
+int decode_next_frame_audio(MediaContainer* media, MediaFrame* frame) {
+	AVCodecContext* audio_ctx = media->codec_description.audio_codec_context;
+	if (!audio_ctx || media->m_audio_stream_index < 0) {
+		return -1;
+	}
+
+	while (true) {
+		if (avcodec_receive_frame(audio_ctx, frame->audio_frame) == 0) {
+			AVFrame* audio = frame->audio_frame;
+			frame->frame_pts = audio->pts != AV_NOPTS_VALUE ? audio->pts : audio->best_effort_timestamp;
+			frame->frame_pts_seconds = frame->frame_pts * av_q2d(media->format_context->streams[media->m_audio_stream_index]->time_base);
+			return 0;
+		}
+
+		if (media->m_demux_eof) {
+			return -1;
+		}
+
+		if (av_read_frame(media->format_context, frame->t_current_packet) < 0) {
+			media->m_demux_eof = true;
+			avcodec_send_packet(audio_ctx, NULL);
+			continue;
+		}
+
+		int r = 0;
+		if (frame->t_current_packet->stream_index == media->m_audio_stream_index) {
+			r = avcodec_send_packet(audio_ctx, frame->t_current_packet);
+		}
+		av_packet_unref(frame->t_current_packet);
+
+		if (r < 0 && r != AVERROR(EAGAIN) && r != AVERROR_INVALIDDATA) {
+			media_error_submit("Audio packet could not be sent to decoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+	}
+}
+
+/*
+Unlike the two functions above this one never throws packets away, whichever decoder the packet belongs to gets it, so both streams
+come out of a single pass over the file. Frames already sitting in the decoders are handed out before reading more, one audio packet
+can hold several frames. At EOF both decoders are drained so the last B frames are not lost.
+*/
+int decode_next_frame_any(MediaContainer* media, MediaFrame* frame, AVMediaType* type) {
+	AVCodecContext* video_ctx = media->codec_description.video_codec_context;
+	AVCodecContext* audio_ctx = media->codec_description.audio_codec_context;
+
+	while (true) {
+		if (video_ctx && avcodec_receive_frame(video_ctx, frame->video_frame) == 0) {
+			*type = AVMEDIA_TYPE_VIDEO;
+			frame->frame_pts = frame->video_frame->pts;
+			retrieve_pts_seconds(media, frame);
+			return 0;
+		}
+
+		if (audio_ctx && avcodec_receive_frame(audio_ctx, frame->audio_frame) == 0) {
+			*type = AVMEDIA_TYPE_AUDIO;
+			frame->frame_pts = frame->audio_frame->pts;
+			AVRational audio_time_base = media->format_context->streams[media->m_audio_stream_index]->time_base;
+			frame->frame_pts_seconds = frame->frame_pts * av_q2d(audio_time_base);
+			return 0;
+		}
+
+		if (media->m_demux_eof) {
+			//Both decoders fully drained.
+			return -1;
+		}
+
+		if (av_read_frame(media->format_context, frame->t_current_packet) < 0) {
+			media->m_demux_eof = true;
+			if (video_ctx) {
+				avcodec_send_packet(video_ctx, NULL);
+			}
+			if (audio_ctx) {
+				avcodec_send_packet(audio_ctx, NULL);
+			}
+			continue;
+		}
+
+		int r = 0;
+		if (frame->t_current_packet->stream_index == media->m_video_stream_index && video_ctx) {
+			r = avcodec_send_packet(video_ctx, frame->t_current_packet);
+		}
+		else if (frame->t_current_packet->stream_index == media->m_audio_stream_index && audio_ctx) {
+			r = avcodec_send_packet(audio_ctx, frame->t_current_packet);
+		}
+		av_packet_unref(frame->t_current_packet);
+
+		if (r < 0 && r != AVERROR(EAGAIN) && r != AVERROR_INVALIDDATA) {
+			media_error_submit("Packet could not be sent to decoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+	}
+}
+
+static int encode_receive_packets(AVCodecContext* codec_context, int stream_index, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to) {
+	int received = 0;
+	MediaPacket packet;
+	malloc_media_packet(&packet);
+
+	while (true) {
+		int response = avcodec_receive_packet(codec_context, packet.packet);
+		if (response == 0) {
+			packet.packet->stream_index = stream_index;
+			av_packet_rescale_ts(packet.packet, time_from, time_to);
+			packet.pts = packet.packet->pts;
+			packets.push_back(packet);
+			received++;
+			malloc_media_packet(&packet);
+		}
+		else if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+			//Encoder wants more input, or has been fully drained.
+			break;
+		}
+		else {
+			media_error_submit("Encoder failed while receiving packets!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			free_media_packet(&packet);
+			return -1;
+		}
+	}
+
+	free_media_packet(&packet);
+	return received;
+}
+
+int encode_next_frame_video(MediaContainer* media, MediaFrame* frame, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to) {
+	if (avcodec_send_frame(media->codec_description.video_codec_context, frame->video_frame) < 0) {
+		media_error_submit("Video frame could not be sent to encoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return encode_receive_packets(media->codec_description.video_codec_context, media->m_video_stream_index, packets, time_from, time_to);
+}
+
+int encode_next_frame_audio(MediaContainer* media, MediaFrame* frame, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to) {
+	if (avcodec_send_frame(media->codec_description.audio_codec_context, frame->audio_frame) < 0) {
+		media_error_submit("Audio frame could not be sent to encoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return encode_receive_packets(media->codec_description.audio_codec_context, media->m_audio_stream_index, packets, time_from, time_to);
+}
+
+int encode_flush_video(MediaContainer* media, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to) {
+	//A NULL frame puts the encoder in draining mode, EOF here only means it was already flushed.
+	int response = avcodec_send_frame(media->codec_description.video_codec_context, NULL);
+	if (response < 0 && response != AVERROR_EOF) {
+		media_error_submit("Video encoder could not be flushed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return encode_receive_packets(media->codec_description.video_codec_context, media->m_video_stream_index, packets, time_from, time_to);
+}
+
+int encode_flush_audio(MediaContainer* media, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to) {
+	int response = avcodec_send_frame(media->codec_description.audio_codec_context, NULL);
+	if (response < 0 && response != AVERROR_EOF) {
+		media_error_submit("Audio encoder could not be flushed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return encode_receive_packets(media->codec_description.audio_codec_context, media->m_audio_stream_index, packets, time_from, time_to);
+}
+
+int malloc_media_audio_converter(MediaAudioConverter* converter, AVCodecContext* encoder) {
+	converter->resample_context = NULL;
+	converter->encoder = encoder;
+	converter->scratch = NULL;
+	converter->scratch_samples = 0;
+	converter->next_pts = AV_NOPTS_VALUE;
+
+	converter->fifo = av_audio_fifo_alloc(encoder->sample_fmt, encoder->channels, encoder->frame_size > 0 ? encoder->frame_size * 2 : 4096);
+	if (!converter->fifo) {
+		media_error_submit("Audio fifo could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+void free_media_audio_converter(MediaAudioConverter* converter) {
+	swr_free(&converter->resample_context);
+	av_audio_fifo_free(converter->fifo);
+	converter->fifo = NULL;
+	if (converter->scratch) {
+		av_freep(&converter->scratch[0]);
+		av_freep(&converter->scratch);
+	}
+}
+
+int media_audio_converter_submit(MediaAudioConverter* converter, AVFrame* frame, AVRational time_base) {
+	AVCodecContext* encoder = converter->encoder;
+
+	if (!converter->resample_context) {
+		if (!frame) {
+			return 0;
+		}
+		//Resampler is set up from the first decoded frame, codec parameters are not always filled in before decoding starts.
+		uint64_t in_layout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+		uint64_t out_layout = encoder->channel_layout ? encoder->channel_layout : av_get_default_channel_layout(encoder->channels);
+		converter->resample_context = swr_alloc_set_opts(NULL, out_layout, encoder->sample_fmt, encoder->sample_rate,
+			in_layout, static_cast<AVSampleFormat>(frame->format), frame->sample_rate, 0, NULL);
+		if (!converter->resample_context || swr_init(converter->resample_context) < 0) {
+			media_error_submit("Audio resampler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			swr_free(&converter->resample_context);
+			return -1;
+		}
+	}
+
+	if (converter->next_pts == AV_NOPTS_VALUE) {
+		converter->next_pts = (frame && frame->pts != AV_NOPTS_VALUE) ? av_rescale_q(frame->pts, time_base, av_make_q(1, encoder->sample_rate)) : 0;
+	}
+
+	int in_samples = frame ? frame->nb_samples : 0;
+	int out_samples = swr_get_out_samples(converter->resample_context, in_samples);
+	if (out_samples > converter->scratch_samples) {
+		if (converter->scratch) {
+			av_freep(&converter->scratch[0]);
+			av_freep(&converter->scratch);
+		}
+		if (av_samples_alloc_array_and_samples(&converter->scratch, NULL, encoder->channels, out_samples, encoder->sample_fmt, 0) < 0) {
+			converter->scratch_samples = 0;
+			return -1;
+		}
+		converter->scratch_samples = out_samples;
+	}
+
+	int converted = swr_convert(converter->resample_context, converter->scratch, converter->scratch_samples,
+		frame ? const_cast<const uint8_t**>(frame->extended_data) : NULL, in_samples);
+	if (converted < 0) {
+		media_error_submit("Audio resampling failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	if (converted > 0 && av_audio_fifo_write(converter->fifo, reinterpret_cast<void**>(converter->scratch), converted) < converted) {
+		return -1;
+	}
+	return 0;
+}
+
+int media_audio_converter_receive(MediaAudioConverter* converter, AVFrame* frame, bool flush) {
+	AVCodecContext* encoder = converter->encoder;
+	int available = av_audio_fifo_size(converter->fifo);
+	//Encoders without a fixed frame size take whatever is buffered.
+	int wanted = encoder->frame_size > 0 ? encoder->frame_size : available;
+
+	if (available == 0 || (available < wanted && !flush)) {
+		return -1;
+	}
+	int samples = FFMIN(available, wanted);
+
+	av_frame_unref(frame);
+	frame->nb_samples = samples;
+	frame->format = encoder->sample_fmt;
+	frame->sample_rate = encoder->sample_rate;
+	frame->channels = encoder->channels;
+	frame->channel_layout = encoder->channel_layout ? encoder->channel_layout : av_get_default_channel_layout(encoder->channels);
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		return -1;
+	}
+
+	av_audio_fifo_read(converter->fifo, reinterpret_cast<void**>(frame->data), samples);
+	frame->pts = av_rescale_q(converter->next_pts, av_make_q(1, encoder->sample_rate), encoder->time_base);
+	converter->next_pts += samples;
+	return 0;
+}
+
+int malloc_media_filter_graph(MediaFilterGraph* filter, const char* description, int width, int height, int pix_fmt, AVRational sample_aspect,
+	AVRational time_base, AVRational frame_rate, int out_pix_fmt, int threads) {
+	filter->source = NULL;
+	filter->sink = NULL;
+	filter->time_base = time_base;
+	filter->frame_rate = frame_rate;
+	filter->eof = false;
+
+	filter->graph = avfilter_graph_alloc();
+	if (!filter->graph) {
+		media_error_submit("Filter graph could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	filter->graph->nb_threads = threads;
+
+	char args[256];
+	snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d", width, height, pix_fmt,
+		time_base.num, time_base.den, sample_aspect.num > 0 ? sample_aspect.num : 1, sample_aspect.num > 0 ? sample_aspect.den : 1,
+		frame_rate.num, frame_rate.den > 0 ? frame_rate.den : 1);
+
+	if (avfilter_graph_create_filter(&filter->source, avfilter_get_by_name("buffer"), "in", args, NULL, filter->graph) < 0 ||
+		avfilter_graph_create_filter(&filter->sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, filter->graph) < 0) {
+		media_error_submit("Filter graph endpoints could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		free_media_filter_graph(filter);
+		return -1;
+	}
+
+	if (out_pix_fmt != AV_PIX_FMT_NONE) {
+		enum AVPixelFormat formats[] = { static_cast<AVPixelFormat>(out_pix_fmt), AV_PIX_FMT_NONE };
+		av_opt_set_int_list(filter->sink, "pix_fmts", formats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+	}
+
+	//The string's open input is fed by the buffer source, its open output drains into the sink.
+	AVFilterInOut* outputs = avfilter_inout_alloc();
+	AVFilterInOut* inputs = avfilter_inout_alloc();
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = filter->source;
+	outputs->pad_idx = 0;
+	outputs->next = NULL;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = filter->sink;
+	inputs->pad_idx = 0;
+	inputs->next = NULL;
+
+	int response = avfilter_graph_parse_ptr(filter->graph, description, &inputs, &outputs, NULL);
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	if (response < 0 || avfilter_graph_config(filter->graph, NULL) < 0) {
+		media_error_submit("Filter string could not be parsed or configured!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		free_media_filter_graph(filter);
+		return -1;
+	}
+
+	filter->time_base = av_buffersink_get_time_base(filter->sink);
+	filter->frame_rate = av_buffersink_get_frame_rate(filter->sink);
+	return 0;
+}
+
+int malloc_media_filter_graph(MediaFilterGraph* filter, const char* description, MediaContainer* input, int out_pix_fmt, int threads) {
+	AVCodecContext* decoder = input->codec_description.video_codec_context;
+	if (!decoder || input->m_video_stream_index < 0) {
+		media_error_submit("Filter graph needs an input with a video decoder!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	AVStream* stream = input->format_context->streams[input->m_video_stream_index];
+	return malloc_media_filter_graph(filter, description, decoder->width, decoder->height, decoder->pix_fmt, decoder->sample_aspect_ratio,
+		stream->time_base, av_guess_frame_rate(input->format_context, stream, NULL), out_pix_fmt, threads);
+}
+
+void free_media_filter_graph(MediaFilterGraph* filter) {
+	//The graph owns every filter in it, endpoints included.
+	avfilter_graph_free(&filter->graph);
+	filter->source = NULL;
+	filter->sink = NULL;
+}
+
+int media_filter_submit(MediaFilterGraph* filter, AVFrame* frame) {
+	if (av_buffersrc_add_frame_flags(filter->source, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
+		media_error_submit("Frame could not be sent to the filter graph!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+int media_filter_receive(MediaFilterGraph* filter, MediaFrame* frame) {
+	av_frame_unref(frame->video_frame);
+	int response = av_buffersink_get_frame(filter->sink, frame->video_frame);
+	if (response < 0) {
+		if (response == AVERROR_EOF) {
+			filter->eof = true;
+		}
+		else if (response != AVERROR(EAGAIN)) {
+			media_error_submit("Filter graph failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		}
+		return -1;
+	}
+
+	frame->frame_pts = frame->video_frame->pts;
+	frame->frame_pts_seconds = frame->video_frame->pts * av_q2d(filter->time_base);
+	return 0;
+}
+
+//acc += src * gain, with the gain moving by step every sample for fades.
+static void media_mix_add(float* acc, const float* src, int count, float gain, float step) {
+	int i = 0;
+#ifdef MEDIA_HAVE_SSE2
+	__m128 ramp = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+	const __m128 ramp_step = _mm_set1_ps(4 * step);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(src + i), ramp)));
+		ramp = _mm_add_ps(ramp, ramp_step);
+	}
+#endif
+	for (; i < count; i++) {
+		acc[i] += src[i] * (gain + step * i);
+	}
+}
+
+//Linear up to the knee, then bends towards full scale without reaching it: knee + (1 - knee) * u / (1 + u). The slope is 1 on both
+//sides of the knee, so quiet mixes pass untouched and loud peaks do not turn into hard clipping.
+static void media_mix_soft_clip(float* samples, int count) {
+	const float knee = 0.8f;
+	const float range = 1.0f - knee;
+	int i = 0;
+#ifdef MEDIA_HAVE_SSE2
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	const __m128 knee_v = _mm_set1_ps(knee);
+	const __m128 range_v = _mm_set1_ps(range);
+	const __m128 inv_range = _mm_set1_ps(1.0f / range);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(samples + i);
+		__m128 sign = _mm_and_ps(x, sign_mask);
+		__m128 magnitude = _mm_andnot_ps(sign_mask, x);
+		__m128 over = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(magnitude, knee_v), _mm_setzero_ps()), inv_range);
+		__m128 bent = _mm_add_ps(_mm_min_ps(magnitude, knee_v), _mm_mul_ps(range_v, _mm_div_ps(over, _mm_add_ps(one, over))));
+		_mm_storeu_ps(samples + i, _mm_or_ps(bent, sign));
+	}
+#endif
+	for (; i < count; i++) {
+		float magnitude = fabsf(samples[i]);
+		float over = FFMAX(magnitude - knee, 0.0f) / range;
+		float bent = FFMIN(magnitude, knee) + range * over / (1.0f + over);
+		samples[i] = samples[i] < 0 ? -bent : bent;
+	}
+}
+
+//Gain of a track at t seconds after its start.
+static float media_mixer_envelope(const MediaMixerTrack* track, double t) {
+	double gain = track->gain;
+	if (track->fade_in > 0) {
+		gain *= av_clipd(t / track->fade_in, 0.0, 1.0);
+	}
+	if (track->fade_out_start >= 0) {
+		gain *= track->fade_out > 0 ? av_clipd(1.0 - (t - track->fade_out_start) / track->fade_out, 0.0, 1.0) : (t < track->fade_out_start ? 1.0 : 0.0);
+	}
+	return static_cast<float>(gain);
+}
+
+int malloc_media_audio_mixer(MediaAudioMixer* mixer, int sample_rate, uint64_t channel_layout, int sample_format, int frame_size) {
+	mixer->sample_rate = sample_rate;
+	mixer->channel_layout = channel_layout;
+	mixer->channels = av_get_channel_layout_nb_channels(channel_layout);
+	mixer->sample_format = sample_format;
+	mixer->frame_size = frame_size > 0 ? frame_size : 1024;
+	mixer->position = 0;
+	mixer->tracks.clear();
+	mixer->mix.assign(static_cast<size_t>(mixer->frame_size) * mixer->channels, 0.0f);
+	mixer->output_context = NULL;
+
+	if (sample_format != AV_SAMPLE_FMT_FLTP) {
+		mixer->output_context = swr_alloc_set_opts(NULL, channel_layout, static_cast<AVSampleFormat>(sample_format), sample_rate,
+			channel_layout, AV_SAMPLE_FMT_FLTP, sample_rate, 0, NULL);
+		if (!mixer->output_context || swr_init(mixer->output_context) < 0) {
+			swr_free(&mixer->output_context);
+			media_error_submit("Mixer output converter could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int malloc_media_audio_mixer(MediaAudioMixer* mixer, AVCodecContext* encoder) {
+	uint64_t layout = encoder->channel_layout ? encoder->channel_layout : av_get_default_channel_layout(encoder->channels);
+	return malloc_media_audio_mixer(mixer, encoder->sample_rate, layout, encoder->sample_fmt, encoder->frame_size);
+}
+
+void free_media_audio_mixer(MediaAudioMixer* mixer) {
+	for (MediaMixerTrack& track : mixer->tracks) {
+		swr_free(&track.resample_context);
+		av_audio_fifo_free(track.fifo);
+	}
+	mixer->tracks.clear();
+	swr_free(&mixer->output_context);
+}
+
+int media_audio_mixer_add_track(MediaAudioMixer* mixer, float gain, double start) {
+	MediaMixerTrack track;
+	track.resample_context = NULL;
+	track.in_format = AV_SAMPLE_FMT_NONE;
+	track.in_rate = 0;
+	track.in_layout = 0;
+	track.fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, mixer->channels, mixer->frame_size * 4);
+	track.start = FFMAX(start, 0.0);
+	track.gain = gain;
+	track.fade_in = 0;
+	track.fade_out_start = -1;
+	track.fade_out = 0;
+	track.ended = false;
+	if (!track.fifo) {
+		media_error_submit("Mixer track fifo could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	mixer->tracks.push_back(track);
+	return static_cast<int>(mixer->tracks.size()) - 1;
+}
+
+//Points planes at consecutive blocks of the scratch buffer, each samples long.
+static void media_mixer_scratch_planes(MediaAudioMixer* mixer, int samples, std::vector<uint8_t*>& planes) {
+	if (mixer->scratch.size() < static_cast<size_t>(samples) * mixer->channels) {
+		mixer->scratch.resize(static_cast<size_t>(samples) * mixer->channels);
+	}
+	planes.resize(mixer->channels);
+	for (int c = 0; c < mixer->channels; c++) {
+		planes[c] = reinterpret_cast<uint8_t*>(mixer->scratch.data() + static_cast<size_t>(c) * samples);
+	}
+}
+
+int media_audio_mixer_submit(MediaAudioMixer* mixer, int index, AVFrame* frame) {
+	if (index < 0 || index >= static_cast<int>(mixer->tracks.size()) || mixer->tracks[index].ended) {
+		media_error_submit("Not an open track of this mixer!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	MediaMixerTrack& track = mixer->tracks[index];
+	std::vector<uint8_t*> planes;
+
+	if (!frame) {
+		//Whatever the resampler still holds belongs to the end of the track.
+		if (track.resample_context) {
+			int pending = swr_get_out_samples(track.resample_context, 0);
+			if (pending > 0) {
+				media_mixer_scratch_planes(mixer, pending, planes);
+				int converted = swr_convert(track.resample_context, planes.data(), pending, NULL, 0);
+				if (converted > 0) {
+					av_audio_fifo_write(track.fifo, reinterpret_cast<void**>(planes.data()), converted);
+				}
+			}
+		}
+		track.ended = true;
+		return 0;
+	}
+
+	uint64_t layout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+	if (!track.resample_context || track.in_format != frame->format || track.in_rate != frame->sample_rate || track.in_layout != layout) {
+		swr_free(&track.resample_context);
+		track.resample_context = swr_alloc_set_opts(NULL, mixer->channel_layout, AV_SAMPLE_FMT_FLTP, mixer->sample_rate,
+			layout, static_cast<AVSampleFormat>(frame->format), frame->sample_rate, 0, NULL);
+		if (!track.resample_context || swr_init(track.resample_context) < 0) {
+			swr_free(&track.resample_context);
+			media_error_submit("Mixer track resampler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		track.in_format = frame->format;
+		track.in_rate = frame->sample_rate;
+		track.in_layout = layout;
+	}
+
+	int capacity = swr_get_out_samples(track.resample_context, frame->nb_samples);
+	media_mixer_scratch_planes(mixer, capacity, planes);
+	int converted = swr_convert(track.resample_context, planes.data(), capacity, const_cast<const uint8_t**>(frame->extended_data), frame->nb_samples);
+	if (converted < 0) {
+		media_error_submit("Mixer track could not be resampled!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	if (converted > 0 && av_audio_fifo_write(track.fifo, reinterpret_cast<void**>(planes.data()), converted) < converted) {
+		media_error_submit("Mixer track fifo could not grow!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+int media_audio_mixer_receive(MediaAudioMixer* mixer, AVFrame* frame) {
+	const int size = mixer->frame_size;
+	const int64_t block_start = mixer->position;
+
+	//Live tracks overlapping this frame must have all their samples for it, tracks that start later do not hold it up.
+	bool pending = false;
+	for (MediaMixerTrack& track : mixer->tracks) {
+		int buffered = av_audio_fifo_size(track.fifo);
+		if (!track.ended || buffered > 0) {
+			pending = true;
+		}
+		int64_t begin = llrint(track.start * mixer->sample_rate);
+		if (track.ended || begin >= block_start + size) {
+			continue;
+		}
+		int needed = size - static_cast<int>(FFMAX(begin - block_start, 0));
+		if (buffered < needed) {
+			return -1;
+		}
+	}
+	if (!pending) {
+		return -1;
+	}
+
+	std::fill(mixer->mix.begin(), mixer->mix.end(), 0.0f);
+	std::vector<uint8_t*> planes;
+	for (MediaMixerTrack& track : mixer->tracks) {
+		int64_t begin = llrint(track.start * mixer->sample_rate);
+		if (begin >= block_start + size) {
+			continue;
+		}
+		int offset = static_cast<int>(FFMAX(begin - block_start, 0));
+		int samples = FFMIN(size - offset, av_audio_fifo_size(track.fifo));
+		if (samples <= 0) {
+			continue;
+		}
+		media_mixer_scratch_planes(mixer, samples, planes);
+		av_audio_fifo_read(track.fifo, reinterpret_cast<void**>(planes.data()), samples);
+
+		//Envelope at both ends of the span, ramped linearly in between.
+		double t = static_cast<double>(block_start + offset - begin) / mixer->sample_rate;
+		float gain_from = media_mixer_envelope(&track, t);
+		float gain_to = media_mixer_envelope(&track, t + static_cast<double>(samples) / mixer->sample_rate);
+		float step = (gain_to - gain_from) / samples;
+		if (gain_from == 0.0f && gain_to == 0.0f) {
+			continue;
+		}
+		for (int c = 0; c < mixer->channels; c++) {
+			media_mix_add(mixer->mix.data() + static_cast<size_t>(c) * size + offset, reinterpret_cast<float*>(planes[c]), samples, gain_from, step);
+		}
+	}
+	media_mix_soft_clip(mixer->mix.data(), static_cast<int>(mixer->mix.size()));
+
+	av_frame_unref(frame);
+	frame->nb_samples = size;
+	frame->format = mixer->sample_format;
+	frame->sample_rate = mixer->sample_rate;
+	frame->channel_layout = mixer->channel_layout;
+	frame->channels = mixer->channels;
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		media_error_submit("Mixer frame could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	if (!mixer->output_context) {
+		for (int c = 0; c < mixer->channels; c++) {
+			memcpy(frame->extended_data[c], mixer->mix.data() + static_cast<size_t>(c) * size, size * sizeof(float));
+		}
+	}
+	else {
+		std::vector<const uint8_t*> mix_planes(mixer->channels);
+		for (int c = 0; c < mixer->channels; c++) {
+			mix_planes[c] = reinterpret_cast<const uint8_t*>(mixer->mix.data() + static_cast<size_t>(c) * size);
+		}
+		swr_convert(mixer->output_context, frame->extended_data, size, mix_planes.data(), size);
+	}
+
+	frame->pts = block_start;
+	mixer->position += size;
+	return 0;
+}
+
+int malloc_media_audio_reader(MediaAudioReader* reader, const char* path, int sample_rate, uint64_t channel_layout, int sample_format) {
+	reader->resample_context = NULL;
+	reader->in_format = AV_SAMPLE_FMT_NONE;
+	reader->in_rate = 0;
+	reader->in_layout = 0;
+	reader->capacity = 0;
+	reader->head = 0;
+	reader->size = 0;
+	reader->position = 0;
+	reader->skip_to = 0;
+	reader->synced = false;
+	reader->eof = false;
+
+	malloc_media_container(&reader->media, MEDIA_FILE_INPUT);
+	if (malloc_media_frame(&reader->frame) < 0) {
+		return -1;
+	}
+	//Audio only files have no video stream for populate_codecs_source, so just the first audio decoder is opened.
+	if (open_media(&reader->media, path) < 0 || media_select_audio_stream(&reader->media, 0) < 0) {
+		return -1;
+	}
+
+	AVCodecContext* decoder = reader->media.codec_description.audio_codec_context;
+	AVStream* stream = reader->media.format_context->streams[reader->media.m_audio_stream_index];
+	reader->origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+	reader->sample_rate = sample_rate > 0 ? sample_rate : decoder->sample_rate;
+	reader->channel_layout = channel_layout ? channel_layout : (decoder->channel_layout ? decoder->channel_layout : av_get_default_channel_layout(decoder->channels));
+	reader->channels = av_get_channel_layout_nb_channels(reader->channel_layout);
+	reader->sample_format = sample_format != AV_SAMPLE_FMT_NONE ? sample_format : decoder->sample_fmt;
+
+	AVSampleFormat format = static_cast<AVSampleFormat>(reader->sample_format);
+	bool planar = av_sample_fmt_is_planar(format) != 0;
+	reader->planes = planar ? reader->channels : 1;
+	reader->sample_bytes = av_get_bytes_per_sample(format) * (planar ? 1 : reader->channels);
+	if (reader->sample_rate <= 0 || reader->channels <= 0 || reader->sample_bytes <= 0 || reader->planes > AV_NUM_DATA_POINTERS) {
+		media_error_submit("Audio reader output format is not usable!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	//A second of audio, it only grows if a caller asks for more than that at once.
+	reader->capacity = reader->sample_rate;
+	for (int p = 0; p < reader->planes; p++) {
+		reader->ring[p].assign(static_cast<size_t>(reader->capacity) * reader->sample_bytes, 0);
+	}
+	return 0;
+}
+
+void free_media_audio_reader(MediaAudioReader* reader) {
+	swr_free(&reader->resample_context);
+	free_media_frame(&reader->frame);
+	free_media_container(&reader->media);
+	for (int p = 0; p < AV_NUM_DATA_POINTERS; p++) {
+		std::vector<uint8_t>().swap(reader->ring[p]);
+	}
+	std::vector<uint8_t>().swap(reader->scratch);
+	reader->capacity = 0;
+	reader->size = 0;
+}
+
+//Makes room for samples more behind the buffered ones, unwrapping the ring into the new storage when it has to grow.
+static void media_audio_reader_reserve(MediaAudioReader* reader, int samples) {
+	if (reader->capacity - reader->size >= samples) {
+		return;
+	}
+	int capacity = FFMAX(reader->capacity * 2, reader->size + samples);
+	int first = FFMIN(reader->size, reader->capacity - reader->head);
+	for (int p = 0; p < reader->planes; p++) {
+		std::vector<uint8_t> grown(static_cast<size_t>(capacity) * reader->sample_bytes);
+		memcpy(grown.data(), reader->ring[p].data() + static_cast<size_t>(reader->head) * reader->sample_bytes, static_cast<size_t>(first) * reader->sample_bytes);
+		memcpy(grown.data() + static_cast<size_t>(first) * reader->sample_bytes, reader->ring[p].data(), static_cast<size_t>(reader->size - first) * reader->sample_bytes);
+		reader->ring[p].swap(grown);
+	}
+	reader->capacity = capacity;
+	reader->head = 0;
+}
+
+//Converts into the ring. When the free space is one block the resampler writes there directly, otherwise it goes through scratch
+//and is copied in two parts around the end of the ring.
+static int media_audio_reader_convert(MediaAudioReader* reader, const uint8_t** input, int in_samples) {
+	int out_samples = swr_get_out_samples(reader->resample_context, in_samples);
+	if (out_samples <= 0) {
+		return 0;
+	}
+	media_audio_reader_reserve(reader, out_samples);
+
+	int tail = (reader->head + reader->size) % reader->capacity;
+	uint8_t* planes[AV_NUM_DATA_POINTERS];
+	bool direct = tail + out_samples <= reader->capacity;
+	if (direct) {
+		for (int p = 0; p < reader->planes; p++) {
+			planes[p] = reader->ring[p].data() + static_cast<size_t>(tail) * reader->sample_bytes;
+		}
+	}
+	else {
+		size_t plane_size = static_cast<size_t>(out_samples) * reader->sample_bytes;
+		if (reader->scratch.size() < plane_size * reader->planes) {
+			reader->scratch.resize(plane_size * reader->planes);
+		}
+		for (int p = 0; p < reader->planes; p++) {
+			planes[p] = reader->scratch.data() + plane_size * p;
+		}
+	}
+
+	int converted = swr_convert(reader->resample_context, planes, out_samples, input, in_samples);
+	if (converted < 0) {
+		media_error_submit("Audio reader could not resample!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	if (!direct) {
+		int first = FFMIN(converted, reader->capacity - tail);
+		for (int p = 0; p < reader->planes; p++) {
+			memcpy(reader->ring[p].data() + static_cast<size_t>(tail) * reader->sample_bytes, planes[p], static_cast<size_t>(first) * reader->sample_bytes);
+			memcpy(reader->ring[p].data(), planes[p] + static_cast<size_t>(first) * reader->sample_bytes, static_cast<size_t>(converted - first) * reader->sample_bytes);
+		}
+	}
+	reader->size += converted;
+	return 0;
+}
+
+//Drops buffered samples in front of the seek target.
+static void media_audio_reader_trim(MediaAudioReader* reader) {
+	if (reader->position >= reader->skip_to) {
+		return;
+	}
+	int drop = static_cast<int>(FFMIN(static_cast<int64_t>(reader->size), reader->skip_to - reader->position));
+	reader->head = (reader->head + drop) % reader->capacity;
+	reader->size -= drop;
+	reader->position += drop;
+}
+
+//The first frame after a seek places the ring on the timeline. Anything before the target gets trimmed later, a gap between the
+//target and the first decoded sample is filled with silence so the read still starts exactly where it was asked to.
+static void media_audio_reader_sync(MediaAudioReader* reader, AVFrame* frame) {
+	AVRational time_base = reader->media.format_context->streams[reader->media.m_audio_stream_index]->time_base;
+	int64_t start = reader->skip_to;
+	if (frame->pts != AV_NOPTS_VALUE) {
+		start = av_rescale_q(frame->pts - reader->origin, time_base, av_make_q(1, reader->sample_rate));
+	}
+	else if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+		start = av_rescale_q(frame->best_effort_timestamp - reader->origin, time_base, av_make_q(1, reader->sample_rate));
+	}
+
+	reader->head = 0;
+	reader->size = 0;
+	reader->position = start;
+	if (start > reader->skip_to) {
+		int gap = static_cast<int>(start - reader->skip_to);
+		media_audio_reader_reserve(reader, gap);
+		uint8_t* planes[AV_NUM_DATA_POINTERS];
+		for (int p = 0; p < reader->planes; p++) {
+			planes[p] = reader->ring[p].data();
+		}
+		av_samples_set_silence(planes, 0, gap, reader->channels, static_cast<AVSampleFormat>(reader->sample_format));
+		reader->size = gap;
+		reader->position = reader->skip_to;
+	}
+	reader->synced = true;
+}
+
+//Decodes until samples are buffered or the file ends, 0 either way, -1 on errors.
+static int media_audio_reader_fill(MediaAudioReader* reader, int samples) {
+	while (reader->size < samples && !reader->eof) {
+		if (decode_next_frame_audio(&reader->media, &reader->frame) < 0) {
+			//The resampler's delay line holds the last few samples of the stream.
+			reader->eof = true;
+			if (reader->resample_context && reader->synced) {
+				if (media_audio_reader_convert(reader, NULL, 0) < 0) {
+					return -1;
+				}
+				media_audio_reader_trim(reader);
+			}
+			break;
+		}
+
+		AVFrame* frame = reader->frame.audio_frame;
+		uint64_t layout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+		if (!reader->resample_context || reader->in_format != frame->format || reader->in_rate != frame->sample_rate || reader->in_layout != layout) {
+			swr_free(&reader->resample_context);
+			reader->resample_context = swr_alloc_set_opts(NULL, reader->channel_layout, static_cast<AVSampleFormat>(reader->sample_format), reader->sample_rate,
+				layout, static_cast<AVSampleFormat>(frame->format), frame->sample_rate, 0, NULL);
+			if (!reader->resample_context || swr_init(reader->resample_context) < 0) {
+				swr_free(&reader->resample_context);
+				media_error_submit("Audio reader resampler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+				return -1;
+			}
+			reader->in_format = frame->format;
+			reader->in_rate = frame->sample_rate;
+			reader->in_layout = layout;
+		}
+		if (!reader->synced) {
+			media_audio_reader_sync(reader, frame);
+		}
+
+		if (media_audio_reader_convert(reader, const_cast<const uint8_t**>(frame->extended_data), frame->nb_samples) < 0) {
+			return -1;
+		}
+		media_audio_reader_trim(reader);
+	}
+	return 0;
+}
+
+int media_audio_reader_seek(MediaAudioReader* reader, int64_t sample) {
+	sample = FFMAX(sample, static_cast<int64_t>(0));
+
+	//Targets inside what is already buffered are just skipped to.
+	if (reader->synced && sample >= reader->position && sample <= reader->position + reader->size) {
+		reader->skip_to = sample;
+		media_audio_reader_trim(reader);
+		return 0;
+	}
+
+	//Decoders need some audio before the target to settle (codec pre-roll, MDCT overlap), so the demuxer is sent a little earlier
+	//and the surplus is trimmed once the first frame tells us where we landed.
+	MediaContainer* media = &reader->media;
+	AVCodecContext* decoder = media->codec_description.audio_codec_context;
+	AVStream* stream = media->format_context->streams[media->m_audio_stream_index];
+	int preroll = FFMAX(decoder->seek_preroll, 4096);
+	int64_t target = reader->origin + av_rescale_q(sample, av_make_q(1, reader->sample_rate), stream->time_base)
+		- av_rescale_q(preroll, av_make_q(1, FFMAX(decoder->sample_rate, 1)), stream->time_base);
+	target = FFMAX(target, reader->origin);
+
+	if (av_seek_frame(media->format_context, media->m_audio_stream_index, target, AVSEEK_FLAG_BACKWARD) < 0 &&
+		av_seek_frame(media->format_context, media->m_audio_stream_index, reader->origin, AVSEEK_FLAG_BACKWARD) < 0) {
+		media_error_submit("Audio reader could not seek!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	avcodec_flush_buffers(decoder);
+	media->m_demux_eof = false;
+	swr_free(&reader->resample_context);
+	reader->in_format = AV_SAMPLE_FMT_NONE;
+	reader->head = 0;
+	reader->size = 0;
+	reader->position = sample;
+	reader->skip_to = sample;
+	reader->synced = false;
+	reader->eof = false;
+	return 0;
+}
+
+int media_audio_reader_read(MediaAudioReader* reader, uint8_t** data, int samples) {
+	if (samples <= 0) {
+		return 0;
+	}
+	if (media_audio_reader_fill(reader, samples) < 0) {
+		return -1;
+	}
+
+	int count = FFMIN(samples, reader->size);
+	int first = FFMIN(count, reader->capacity - reader->head);
+	for (int p = 0; p < reader->planes; p++) {
+		memcpy(data[p], reader->ring[p].data() + static_cast<size_t>(reader->head) * reader->sample_bytes, static_cast<size_t>(first) * reader->sample_bytes);
+		memcpy(data[p] + static_cast<size_t>(first) * reader->sample_bytes, reader->ring[p].data(), static_cast<size_t>(count - first) * reader->sample_bytes);
+	}
+	if (count > 0) {
+		reader->head = (reader->head + count) % reader->capacity;
+	}
+	reader->size -= count;
+	reader->position += count;
+	return count;
+}
+
+void retrieve_pts_seconds(MediaContainer* media, MediaFrame* frame) {
+	frame->frame_pts_seconds = frame->frame_pts * (double)media->time_base.num / (double)media->time_base.den;
+}
+
+
+void media_stream_submit_packet(MediaStreamContainer* media, const std::vector<uint8_t>& packet) {
+	media->rtp_packet_stack_buffer.push_back(packet);
+}
+
+static int media_stream_request_packet(MediaStreamContainer* media, std::vector<uint8_t>& packet) {
+	if (media->rtp_packet_stack_buffer.empty()) {
+		return -1;
+	}
+	packet = media->rtp_packet_stack_buffer.front();
+	media->rtp_packet_stack_buffer.pop_front();
+
+	/*
+	for (std::vector<uint8_t> i : media->packet_stack_buffer) {
+		std::cout <<"PACKET DATA: " << uint8_vector_to_hex_string(i) << std::endl;
+	}
+	*/
+
+	return 0;
+}
+
+static void media_stream_convert_av(AVPacket* av_packet, std::vector<uint8_t>& packet) {
+	av_packet->data = packet.data();
+	av_packet->size = sizeof(uint8_t) * packet.size();
+}
+
+int malloc_media_stream_container(MediaStreamContainer* media, int width, int height) {
+	media->stream_width = width;
+	media->stream_height = height;
+
+	media->codec_description.video_codec = avcodec_find_decoder(MEDIA_STREAM_VIDEO_CODEC);
+	media->codec_description.audio_codec = avcodec_find_decoder(MEDIA_STREAM_AUDIO_CODEC);
+	media->codec_description.video_codec_context = avcodec_alloc_context3(media->codec_description.video_codec);
+
+	media->codec_description.video_codec_context->pix_fmt = AV_PIX_FMT_ARGB;
+	media->codec_description.video_codec_context->height = media->stream_height;
+	media->codec_description.video_codec_context->width = media->stream_width;
+
+	//Temporary flags, could be removed after testing, not sure if these reduce artifacting during slow interent or not.
+	media->codec_description.video_codec_context->workaround_bugs = AV_EF_EXPLODE | AV_EF_AGGRESSIVE;
+	if (avcodec_open2(media->codec_description.video_codec_context, media->codec_description.video_codec, NULL) < 0)
+	{
+		media_error_submit("Media Stream Error: Video codec context could not be created!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	media->codec_description.audio_codec_context = avcodec_alloc_context3(media->codec_description.audio_codec);
+
+	if (avcodec_open2(media->codec_description.audio_codec_context, media->codec_description.audio_codec, NULL) < 0)
+	{
+		media_error_submit("Media Stream Error: Audio codec context could not be created!", __FILE__, MEDIA_ERROR_CRITICAL, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	return 0;
+}
+
+void free_media_stream_container(MediaStreamContainer* media) {
+	avcodec_close(media->codec_description.video_codec_context);
+	avcodec_close(media->codec_description.audio_codec_context);
+}
+
+int decode_next_frame_video(MediaStreamContainer* media, MediaFrame* frame) {
+	bool failure = false;
+	std::vector<uint8_t> packet_unint;
+	AVPacket packet_av;
+	av_init_packet(&packet_av);
+
+	//Unlike video files, every frame packet built and put in queue (should) and must be a complete frame.
+	//No need for while to get more packets from queue
+
+	if (media_stream_request_packet(media, packet_unint) >= 0) {
+		if (packet_unint.size() == 0) {
+			//Drop empty packet, or we can get an EOF decoder error.
+			av_packet_unref(&packet_av);
+			failure = true;
+		}
+		media_stream_convert_av(&packet_av, packet_unint);
+		frame->t_current_packet = &packet_av;
+		int r = decode_video_packet(media->codec_description, frame);
+
+		switch (r) {
+		case 0: {
+			//Success!
+			break;
+		}
+		case AVERROR(EAGAIN): {
+			//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
+			break;
+		}
+		case AVERROR(EINVAL): {
+			//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
+			break;
+		}
+		case AVERROR_EOF: {
+			//std::cout << "AVERROR_EOF on decode!" << std::endl;
+			avcodec_flush_buffers(media->codec_description.video_codec_context);
+			break;
+		}
+		case AVERROR(ENOMEM): {
+			//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
+			break;
+		}
+		default: {
+			failure = true;
+			break;
+		}
+
+		}
+
+		av_packet_unref(&packet_av);
+	}
+	else {
+		failure = true;
+	}
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+	/*
+	* ERROR REFERENCE:
+	* concealing errors / no frame - Packet loss, incorrect packet ordering. Poor connection.
+	* cannot find ref at POC - H265 specific, packet loss, incorrect ordering. Poor connection.
+	* stream stops / EOF - null packet input into deocoder, it assumes eof and cleans up, remedy? av_codec_flush_decoder when EOF encountered.
+	* no frame - incomplete packet submitted, associated with poor connection, can also happen if data handling produces random data.
+	*/
+}
+
+int decode_next_frame_audio(MediaStreamContainer* media, MediaFrame* frame) {
+
+	bool failure = false;
+	std::vector<uint8_t> packet_unint;
+	AVPacket packet_av;
+	av_init_packet(&packet_av);
+
+	//Unlike video files, every frame packet built and put in queue (should) and must be a complete frame.
+	//No need for while to get more packets from queue
+
+	if (media_stream_request_packet(media, packet_unint) >= 0) {
+		if (packet_unint.size() == 0) {
+			//Drop empty packet, or we can get an EOF decoder error.
+			av_packet_unref(&packet_av);
+			failure = true;
+		}
+		media_stream_convert_av(&packet_av, packet_unint);
+		frame->t_current_packet = &packet_av;
+		int r = decode_audio_packet(media->codec_description, frame);
+
+		switch (r) {
+		case 0: {
+			//Success!
+			break;
+		}
+		case AVERROR(EAGAIN): {
+			//std::cout << "AVERROR(EAGAIN) on decode!" << std::endl;
+			break;
+		}
+		case AVERROR(EINVAL): {
+			//std::cout << "AVERROR(EINVAL) on decode!" << std::endl;
+			break;
+		}
+		case AVERROR_EOF: {
+			//std::cout << "AVERROR_EOF on decode!" << std::endl;
+			avcodec_flush_buffers(media->codec_description.audio_codec_context);
+			break;
+		}
+		case AVERROR(ENOMEM): {
+			//std::cout << "AVERROR(ENOMEM) on decode!" << std::endl;
+			break;
+		}
+		default: {
+			failure = true;
+			break;
+		}
+
+		}
+
+		av_packet_unref(&packet_av);
+	}
+	else {
+		failure = true;
+	}
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
+
+//Spill file helpers, the mapping is redone whenever the file grows, offsets stay valid as the data is file backed.
+static int media_spill_map(MediaSpillFile* spill, int64_t capacity) {
+#ifdef WINDOWS_SYSTEM
+	if (spill->base) {
+		UnmapViewOfFile(spill->base);
+		CloseHandle(spill->mapping);
+	}
+	//Mapping a larger size than the file extends the file.
+	spill->mapping = CreateFileMappingA(spill->file, NULL, PAGE_READWRITE, static_cast<DWORD>(capacity >> 32), static_cast<DWORD>(capacity & 0xFFFFFFFF), NULL);
+	if (!spill->mapping) {
+		spill->base = NULL;
+		return -1;
+	}
+	spill->base = static_cast<uint8_t*>(MapViewOfFile(spill->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+#else
+	if (spill->base) {
+		munmap(spill->base, spill->capacity);
+	}
+	if (ftruncate(spill->file, capacity) < 0) {
+		spill->base = NULL;
+		return -1;
+	}
+	void* base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, spill->file, 0);
+	spill->base = base == MAP_FAILED ? NULL : static_cast<uint8_t*>(base);
+#endif
+	if (!spill->base) {
+		return -1;
+	}
+	spill->capacity = capacity;
+	return 0;
+}
+
+static int media_spill_open(MediaSpillFile* spill, const char* path) {
+	spill->path = path;
+	spill->base = NULL;
+	spill->capacity = 0;
+	spill->write_offset = 0;
+	spill->live_bytes = 0;
+	spill->records.clear();
+	spill->first_record = 0;
+	spill->pending = 0;
+#ifdef WINDOWS_SYSTEM
+	spill->mapping = NULL;
+	spill->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (spill->file == INVALID_HANDLE_VALUE) {
+		spill->file = NULL;
+		return -1;
+	}
+#else
+	spill->file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (spill->file < 0) {
+		return -1;
+	}
+	//Unlinked straight away, the file disappears with the descriptor even if the process dies.
+	unlink(path);
+#endif
+	return media_spill_map(spill, 64 * 1024 * 1024);
+}
+
+static void media_spill_close(MediaSpillFile* spill) {
+#ifdef WINDOWS_SYSTEM
+	if (spill->base) {
+		UnmapViewOfFile(spill->base);
+	}
+	if (spill->mapping) {
+		CloseHandle(spill->mapping);
+	}
+	if (spill->file) {
+		CloseHandle(spill->file);
+	}
+	spill->mapping = NULL;
+	spill->file = NULL;
+#else
+	if (spill->base) {
+		munmap(spill->base, spill->capacity);
+	}
+	if (spill->file >= 0) {
+		close(spill->file);
+	}
+	spill->file = -1;
+#endif
+	spill->base = NULL;
+	spill->capacity = 0;
+	spill->records.clear();
+}
+
+static int media_spill_write(MediaSpillFile* spill, const uint8_t* data, int size, int64_t* record) {
+	if (spill->records.empty()) {
+		spill->write_offset = 0;
+		spill->live_bytes = 0;
+	}
+
+	if (spill->write_offset + size > spill->capacity) {
+		if ((spill->live_bytes + size) * 2 <= spill->capacity) {
+			//Mostly read back already, slide the live records down over the consumed ones. Records are in offset order, so moving
+			//each one towards the start never overwrites one that has not moved yet.
+			int64_t packed = 0;
+			for (MediaSpillRecord& r : spill->records) {
+				if (!r.released) {
+					memmove(spill->base + packed, spill->base + r.offset, r.size);
+					r.offset = packed;
+					packed += r.size;
+				}
+			}
+			spill->write_offset = packed;
+		}
+		else {
+			int64_t capacity = spill->capacity;
+			while (spill->write_offset + size > capacity) {
+				capacity *= 2;
+			}
+			if (media_spill_map(spill, capacity) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	memcpy(spill->base + spill->write_offset, data, size);
+	spill->records.push_back({ spill->write_offset, size, false });
+	*record = spill->first_record + static_cast<int64_t>(spill->records.size()) - 1;
+	spill->write_offset += size;
+	spill->live_bytes += size;
+	spill->pending++;
+	return 0;
+}
+
+static void media_spill_release(MediaSpillFile* spill, int64_t record) {
+	MediaSpillRecord& r = spill->records[record - spill->first_record];
+	r.released = true;
+	spill->live_bytes -= r.size;
+	spill->pending--;
+	while (!spill->records.empty() && spill->records.front().released) {
+		spill->records.pop_front();
+		spill->first_record++;
+	}
+}
+
+int malloc_media_file_stream_container(MediaFileStreamingBuffer* media, AVRational time_base, AVRational frame_rate, int audio_sample_rate, int audio_frame_size) {
+	if (frame_rate.num <= 0 || frame_rate.den <= 0 || audio_sample_rate <= 0) {
+		media_error_submit("Streaming buffer needs a valid frame rate and sample rate!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	media->time_base = time_base;
+	media->packet_time_base = time_base;
+	media->m_fps = frame_rate.num / frame_rate.den;
+
+	media->video_frame_duration = av_inv_q(frame_rate);
+	//Encoders without a fixed frame size are assumed to use the AAC default.
+	media->audio_frame_duration = av_make_q(audio_frame_size > 0 ? audio_frame_size : 1024, audio_sample_rate);
+	media->video_frames_submitted = 0;
+	media->audio_frames_submitted = 0;
+
+	media->overflow = MEDIA_BUFFER_BLOCK;
+	media->max_packets = 0;
+	media->max_bytes = 0;
+	media->held_packets = 0;
+	media->held_bytes = 0;
+	media->spill.base = NULL;
+#ifdef WINDOWS_SYSTEM
+	media->spill.file = NULL;
+	media->spill.mapping = NULL;
+#else
+	media->spill.file = -1;
+#endif
+	media->spill.records.clear();
+	media->spill.first_record = 0;
+	media->spill.pending = 0;
+	media->backed_up = false;
+	return 0;
+}
+
+int media_file_stream_set_budget(MediaFileStreamingBuffer* media, size_t max_packets, size_t max_bytes, media_buffer_overflow overflow, const char* spill_path) {
+	std::lock_guard<std::mutex> guard(media->lock);
+	media->max_packets = max_packets;
+	media->max_bytes = max_bytes;
+	media->overflow = overflow;
+
+	if (overflow == MEDIA_BUFFER_SPILL && !media->spill.base) {
+		if (!spill_path || media_spill_open(&media->spill, spill_path) < 0) {
+			media_error_submit("Spill file could not be created, falling back to blocking!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			media->overflow = MEDIA_BUFFER_BLOCK;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void media_file_stream_set_packet_time_base(MediaFileStreamingBuffer* media, AVRational time_base) {
+	std::lock_guard<std::mutex> guard(media->lock);
+	media->packet_time_base = time_base;
+}
+
+void free_media_file_stream_container(MediaFileStreamingBuffer* media) {
+	//Only packets still queued belong to the buffer, requested packets were handed to the caller.
+	for (MediaBufferEntry& i : media->stack_buffer_video) {
+		av_packet_free(&i.packet.packet);
+	}
+
+	for (MediaBufferEntry& i : media->stack_buffer_audio) {
+		av_packet_free(&i.packet.packet);
+	}
+	media->stack_buffer_video.clear();
+	media->stack_buffer_audio.clear();
+	media->held_packets = 0;
+	media->held_bytes = 0;
+
+	media_spill_close(&media->spill);
+}
+
+static int64_t media_file_stream_gen_pts_video(MediaFileStreamingBuffer* media) {
+	//n * (1 / fps) rescaled in one step, nothing accumulates between frames.
+	return av_rescale_q(media->video_frames_submitted, media->video_frame_duration, media->time_base);
+}
+
+static int64_t media_file_stream_gen_pts_audio(MediaFileStreamingBuffer* media) {
+	return av_rescale_q(media->audio_frames_submitted, media->audio_frame_duration, media->time_base);
+}
+
+static bool media_file_stream_over_budget(MediaFileStreamingBuffer* media, int size) {
+	if (media->held_packets == 0) {
+		//A single packet larger than the budget must still get through.
+		return false;
+	}
+	if (media->max_packets > 0 && media->held_packets + 1 > media->max_packets) {
+		return true;
+	}
+	if (media->max_bytes > 0 && media->held_bytes + size > media->max_bytes) {
+		return true;
+	}
+	return false;
+}
+
+static int media_file_stream_submit(MediaFileStreamingBuffer* media, std::deque<MediaBufferEntry>& queue, MediaPacket packet, int64_t pts, int64_t duration) {
+	std::unique_lock<std::mutex> lock(media->lock);
+	int size = packet.packet->size;
+
+	//Generated timestamp becomes the dts, pts keeps the encoder reorder offset so B frames still present in order.
+	int64_t offset = 0;
+	if (packet.packet->pts != AV_NOPTS_VALUE && packet.packet->dts != AV_NOPTS_VALUE) {
+		offset = av_rescale_q(packet.packet->pts - packet.packet->dts, media->packet_time_base, media->time_base);
+	}
+	packet.pts = pts + offset;
+	packet.packet->dts = pts;
+	packet.packet->pts = pts + offset;
+	packet.packet->duration = duration;
+
+	MediaBufferEntry entry;
+	entry.packet = packet;
+	entry.spill_record = -1;
+	entry.spill_size = 0;
+
+	if (media_file_stream_over_budget(media, size)) {
+		media->backed_up = true;
+		switch (media->overflow) {
+		case MEDIA_BUFFER_SIGNAL: {
+			return -1;
+		}
+		case MEDIA_BUFFER_SPILL: {
+			AVPacket* shell = av_packet_alloc();
+			if (!shell || av_packet_copy_props(shell, packet.packet) < 0 || media_spill_write(&media->spill, packet.packet->data, size, &entry.spill_record) < 0) {
+				av_packet_free(&shell);
+				media_error_submit("Packet could not be spilled to disk!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+				return -1;
+			}
+			entry.spill_size = size;
+			av_packet_free(&packet.packet);
+			entry.packet.packet = shell;
+			queue.push_back(entry);
+			return 1;
+		}
+		default: {
+			media->signal.wait(lock, [&] { return !media_file_stream_over_budget(media, size); });
+			break;
+		}
+		}
+	}
+
+	media->backed_up = false;
+	media->held_packets++;
+	media->held_bytes += size;
+	queue.push_back(entry);
+	return 0;
+}
+
+int media_submit_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket packet) {
+	int64_t pts = media_file_stream_gen_pts_video(media);
+	int64_t duration = av_rescale_q(media->video_frames_submitted + 1, media->video_frame_duration, media->time_base) - pts;
+	int r = media_file_stream_submit(media, media->stack_buffer_video, packet, pts, duration);
+	if (r >= 0) {
+		media->video_frames_submitted++;
+	}
+	return r;
+}
+
+int media_submit_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket packet) {
+	int64_t pts = media_file_stream_gen_pts_audio(media);
+	int64_t duration = av_rescale_q(media->audio_frames_submitted + 1, media->audio_frame_duration, media->time_base) - pts;
+	int r = media_file_stream_submit(media, media->stack_buffer_audio, packet, pts, duration);
+	if (r >= 0) {
+		media->audio_frames_submitted++;
+	}
+	return r;
+}
+
+static int media_file_stream_request(MediaFileStreamingBuffer* media, std::deque<MediaBufferEntry>& queue, MediaPacket& packet) {
+	std::lock_guard<std::mutex> guard(media->lock);
+	if (queue.empty()) {
+		return -1;
+	}
+	MediaBufferEntry entry = queue.front();
+	queue.pop_front();
+
+	if (entry.spill_record < 0) {
+		media->held_packets--;
+		media->held_bytes -= entry.packet.packet->size;
+		packet = entry.packet;
+	}
+	else {
+		//Read back into a fresh packet, av_new_packet resets properties so they are copied afterwards.
+		AVPacket* restored = av_packet_alloc();
+		if (!restored || av_new_packet(restored, entry.spill_size) < 0) {
+			av_packet_free(&restored);
+			av_packet_free(&entry.packet.packet);
+			media_spill_release(&media->spill, entry.spill_record);
+			return -1;
+		}
+		const MediaSpillRecord& record = media->spill.records[entry.spill_record - media->spill.first_record];
+		memcpy(restored->data, media->spill.base + record.offset, entry.spill_size);
+		av_packet_copy_props(restored, entry.packet.packet);
+		av_packet_free(&entry.packet.packet);
+		media_spill_release(&media->spill, entry.spill_record);
+
+		packet.packet = restored;
+		packet.pts = entry.packet.pts;
+	}
+
+	media->signal.notify_all();
+	return 0;
+}
+
+int media_request_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket& packet) {
+	return media_file_stream_request(media, media->stack_buffer_video, packet);
+}
+
+int media_request_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket& packet) {
+	return media_file_stream_request(media, media->stack_buffer_audio, packet);
+}
+
+//Proxy generation
+static void media_proxy_report(void* user, double seconds) {
+	MediaProxyProgress* progress = static_cast<MediaProxyProgress*>(user);
+	if (progress->duration > 0) {
+		progress->job->progress = FFMIN(FFMAX((seconds - progress->start) / progress->duration, 0.0), 1.0);
+	}
+}
+
+//Runs on the pool, so opening a bad asset fails the job instead of ending the process.
+static int media_proxy_generate(MediaProxyGenerator* generator, MediaProxyJob* job) {
+	MediaContainer input;
+	malloc_media_container(&input, MEDIA_FILE_INPUT);
+	if (media_open_quiet(&input, job->source.c_str(), job->error) < 0) {
+		free_media_container(&input);
+		return -1;
+	}
+	if (populate_codecs_source(&input) < 0) {
+		job->error = "Source has no decodable streams (" + job->source + ")";
+		free_media_container(&input);
+		return -1;
+	}
+
+	int height = FFMIN(generator->height, input.m_height) & ~1;
+	int width = static_cast<int>(av_rescale(input.m_width, height, input.m_height)) & ~1;
+
+	MediaContainer output;
+	malloc_media_container(&output, MEDIA_FILE_OUTPUT);
+	if (media_open_quiet(&output, job->proxy.c_str(), job->error) < 0) {
+		free_media_container(&input);
+		free_media_container(&output);
+		return -1;
+	}
+
+	//Every frame a keyframe, so seeking in the proxy never decodes more than one frame. Parallelism comes from the pool, not the encoder.
+	MediaEncoderOptions options;
+	media_encoder_options_init(&options, MEDIA_ENCODER_PROFILE_DEFAULT);
+	options.gop_size = 1;
+	options.max_b_frames = 0;
+	options.threads = 1;
+	if (generator->codec == AV_CODEC_ID_H264) {
+		options.preset = "ultrafast";
+	}
+
+	int pix_fmt = generator->codec == AV_CODEC_ID_MJPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+	int bitrate = width * height * (generator->codec == AV_CODEC_ID_MJPEG ? 8 : 3);
+
+	//Same time base as the source, so every proxy frame carries exactly the source frame's timestamp. 1 / den alone is only right when
+	//the source numerator is 1, 1001/30000 style time bases are passed whole.
+	options.time_base = input.time_base;
+	int r = populate_codecs_user(&output, generator->codec, AV_CODEC_ID_AAC, width, height, pix_fmt, bitrate, 0, 0, 0, input.time_base.den,
+		input.codec_description.m_audio_sample_rate, &options);
+
+	if (r == 0) {
+		r = open_media_write_header(&output);
+	}
+	if (r == 0) {
+		MediaProxyProgress progress;
+		progress.job = job;
+		progress.start = input.format_context->start_time != AV_NOPTS_VALUE ? input.format_context->start_time / static_cast<double>(AV_TIME_BASE) : 0;
+		progress.duration = input.format_context->duration != AV_NOPTS_VALUE ? input.format_context->duration / static_cast<double>(AV_TIME_BASE) : 0;
+
+		MediaTranscodeOptions transcode_options;
+		media_transcode_options_init(&transcode_options);
+		transcode_options.progress = media_proxy_report;
+		transcode_options.progress_user = &progress;
+
+		r = transcode_media(&input, &output, &transcode_options);
+		open_media_write_trailer(&output);
+	}
+	if (r < 0) {
+		job->error = "Proxy could not be encoded (" + job->proxy + ")";
+	}
+
+	free_media_container(&input);
+	free_media_container(&output);
+	return r;
+}
+
+static void media_proxy_worker(MediaProxyGenerator* generator) {
+	while (true) {
+		MediaProxyJob* job;
+		{
+			std::unique_lock<std::mutex> guard(generator->lock);
+			generator->wake.wait(guard, [&]() { return generator->stop || !generator->queue.empty(); });
+			if (generator->stop) {
+				return;
+			}
+			job = generator->queue.front();
+			generator->queue.pop_front();
+			generator->running++;
+		}
+
+		job->state = MEDIA_PROXY_RUNNING;
+		bool failed = media_proxy_generate(generator, job) < 0;
+		if (!failed) {
+			job->progress = 1.0;
+		}
+		job->state = failed ? MEDIA_PROXY_FAILED : MEDIA_PROXY_DONE;
+
+		{
+			std::lock_guard<std::mutex> guard(generator->lock);
+			generator->running--;
+		}
+		generator->idle.notify_all();
+	}
+}
+
+int malloc_media_proxy_generator(MediaProxyGenerator* generator, int threads, int height, AVCodecID codec) {
+	if (codec != AV_CODEC_ID_MJPEG && codec != AV_CODEC_ID_H264) {
+		media_error_submit("Proxies are MJPEG or all intra H.264!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	generator->height = height;
+	generator->codec = codec;
+	generator->jobs.clear();
+	generator->queue.clear();
+	generator->running = 0;
+	generator->stop = false;
+
+	threads = threads > 0 ? threads : FFMAX(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	for (int i = 0; i < threads; i++) {
+		generator->workers.push_back(std::thread(media_proxy_worker, generator));
+	}
+	return 0;
+}
+
+void free_media_proxy_generator(MediaProxyGenerator* generator) {
+	{
+		std::lock_guard<std::mutex> guard(generator->lock);
+		generator->stop = true;
+		generator->queue.clear();
+	}
+	generator->wake.notify_all();
+	for (std::thread& worker : generator->workers) {
+		worker.join();
+	}
+	generator->workers.clear();
+
+	for (MediaProxyJob* job : generator->jobs) {
+		delete job;
+	}
+	generator->jobs.clear();
+}
+
+MediaProxyJob* media_proxy_submit(MediaProxyGenerator* generator, const char* source, const char* proxy) {
+	MediaProxyJob* job = new MediaProxyJob;
+	job->source = source;
+	job->proxy = proxy;
+	job->progress = 0.0;
+	job->state = MEDIA_PROXY_QUEUED;
+
+	{
+		std::lock_guard<std::mutex> guard(generator->lock);
+		generator->jobs.push_back(job);
+		generator->queue.push_back(job);
+	}
+	generator->wake.notify_one();
+	return job;
+}
+
+void media_proxy_wait(MediaProxyGenerator* generator) {
+	std::unique_lock<std::mutex> guard(generator->lock);
+	generator->idle.wait(guard, [&]() { return generator->queue.empty() && generator->running == 0; });
+}
+
+//Thread pool
+static void media_thread_pool_worker(MediaThreadPool* pool) {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> guard(pool->lock);
+			pool->wake.wait(guard, [&]() { return pool->stop || !pool->tasks.empty(); });
+			if (pool->tasks.empty()) {
+				return;
+			}
+			task = std::move(pool->tasks.front());
+			pool->tasks.pop_front();
+			pool->running++;
+		}
+
+		task();
+
+		{
+			std::lock_guard<std::mutex> guard(pool->lock);
+			pool->running--;
+		}
+		pool->idle.notify_all();
+	}
+}
+
+int malloc_media_thread_pool(MediaThreadPool* pool, int threads) {
+	pool->tasks.clear();
+	pool->running = 0;
+	pool->stop = false;
+
+	threads = threads > 0 ? threads : FFMAX(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	for (int i = 0; i < threads; i++) {
+		pool->workers.push_back(std::thread(media_thread_pool_worker, pool));
+	}
+	return 0;
+}
+
+void free_media_thread_pool(MediaThreadPool* pool) {
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		pool->stop = true;
+	}
+	pool->wake.notify_all();
+	for (std::thread& worker : pool->workers) {
+		worker.join();
+	}
+	pool->workers.clear();
+}
+
+void media_thread_pool_submit(MediaThreadPool* pool, std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		pool->tasks.push_back(std::move(task));
+	}
+	pool->wake.notify_one();
+}
+
+void media_thread_pool_wait(MediaThreadPool* pool) {
+	std::unique_lock<std::mutex> guard(pool->lock);
+	pool->idle.wait(guard, [&]() { return pool->tasks.empty() && pool->running == 0; });
+}
+
+//Thumbnails
+static std::string media_vtt_time(double seconds) {
+	char text[32];
+	int64_t ms = static_cast<int64_t>(seconds * 1000 + 0.5);
+	snprintf(text, sizeof(text), "%02d:%02d:%02d.%03d", static_cast<int>(ms / 3600000), static_cast<int>(ms / 60000 % 60), static_cast<int>(ms / 1000 % 60), static_cast<int>(ms % 1000));
+	return text;
+}
+
+static void media_thumbnail_release(MediaThumbnailFile* file) {
+	bool last;
+	{
+		std::lock_guard<std::mutex> guard(file->lock);
+		last = --file->tasks_remaining == 0;
+	}
+	if (last) {
+		for (AVFrame* sheet : file->sheets) {
+			av_frame_free(&sheet);
+		}
+		delete file;
+	}
+}
+
+static void media_thumbnail_tile_done(MediaThumbnailEngine* engine, MediaThumbnailFile* file, int sheet) {
+	bool complete;
+	{
+		std::lock_guard<std::mutex> guard(file->lock);
+		complete = --file->sheet_remaining[sheet] == 0;
+	}
+	//Tiles are disjoint, so only the encode has to wait for every tile of the sheet. The exporter takes its own reference.
+	if (complete) {
+		std::string path = file->request.prefix + "_" + std::to_string(sheet) + ".jpg";
+		if (media_image_export_to(&engine->exporter, file->sheets[sheet], path.c_str()) < 0) {
+			engine->failures++;
+		}
+	}
+}
+
+static void media_thumbnail_decode(MediaThumbnailEngine* engine, MediaThumbnailFile* file, int first, int last) {
+	const MediaThumbnailRequest& request = file->request;
+	int per_sheet = request.columns * request.rows;
+
+	MediaContainer media;
+	malloc_media_container(&media, MEDIA_FILE_INPUT);
+	//Pool thread, an open error is a warning and every tile of the range counts as a failure.
+	std::string error;
+	bool opened = media_open_quiet(&media, request.source.c_str(), error) == 0 && populate_codecs_source(&media) == 0;
+	if (!error.empty()) {
+		media_error_submit(error, __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+	}
+
+	AVFrame* decoded = av_frame_alloc();
+	AVPacket* packet = av_packet_alloc();
+	SwsContext* scaler = NULL;
+
+	if (opened) {
+		media.keyframe_index = file->index;
+		//Deblocking is invisible after a downscale this large.
+		media.codec_description.video_codec_context->skip_loop_filter = AVDISCARD_ALL;
+	}
+
+	for (int i = first; i < last; i++) {
+		int sheet_index = i / per_sheet;
+		int tile = i % per_sheet;
+
+		if (opened && media_decode_keyframe(&media, file->keyframes[i], true, packet, decoded) == 0) {
+			AVFrame* sheet = file->sheets[sheet_index];
+			int x = (tile % request.columns) * request.width;
+			int y = (tile / request.columns) * request.height;
+
+			scaler = sws_getCachedContext(scaler, decoded->width, decoded->height, static_cast<AVPixelFormat>(decoded->format),
+				request.width, request.height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+			if (scaler) {
+				uint8_t* tile_planes[3] = {
+					sheet->data[0] + y * sheet->linesize[0] + x,
+					sheet->data[1] + (y / 2) * sheet->linesize[1] + x / 2,
+					sheet->data[2] + (y / 2) * sheet->linesize[2] + x / 2 };
+				sws_scale(scaler, decoded->data, decoded->linesize, 0, decoded->height, tile_planes, sheet->linesize);
+				engine->thumbnails++;
+			}
+			av_frame_unref(decoded);
+		}
+		else {
+			engine->failures++;
+		}
+		media_thumbnail_tile_done(engine, file, sheet_index);
+	}
+
+	sws_freeContext(scaler);
+	av_packet_free(&packet);
+	av_frame_free(&decoded);
+	free_media_container(&media);
+	media_thumbnail_release(file);
+}
+
+//Runs on the pool too, so probing and indexing of many files overlaps as well.
+static void media_thumbnail_plan(MediaThumbnailEngine* engine, MediaThumbnailRequest request) {
+	MediaContainer media;
+	malloc_media_container(&media, MEDIA_FILE_INPUT);
+	std::string error;
+	if (media_open_quiet(&media, request.source.c_str(), error) < 0 || populate_codecs_source(&media) < 0 || media_build_keyframe_index(&media) < 0) {
+		//One unreadable file in a batch is a failure of that file only.
+		if (!error.empty()) {
+			media_error_submit(error, __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		}
+		free_media_container(&media);
+		engine->failures++;
+		return;
+	}
+
+	MediaThumbnailFile* file = new MediaThumbnailFile;
+	file->request = request;
+	file->index = media.keyframe_index;
+
+	const std::vector<MediaKeyframe>& keyframes = file->index.keyframes;
+	AVRational time_base = media.format_context->streams[media.m_video_stream_index]->time_base;
+	int64_t start = keyframes.front().pts;
+	int64_t span = FFMAX(file->index.end_pts - start, 1);
+
+	for (int i = 0; i < request.count; i++) {
+		int64_t target = start + static_cast<int64_t>((i + 0.5) * span / request.count);
+		int k = FFMAX(media_keyframe_at_or_before(&media, target), 0);
+		if (k + 1 < keyframes.size() && keyframes[k + 1].pts - target < target - keyframes[k].pts) {
+			k++;
+		}
+		file->keyframes.push_back(k);
+	}
+	free_media_container(&media);
+
+	int per_sheet = request.columns * request.rows;
+	int sheet_count = (request.count + per_sheet - 1) / per_sheet;
+	for (int s = 0; s < sheet_count; s++) {
+		AVFrame* sheet = av_frame_alloc();
+		sheet->format = AV_PIX_FMT_YUVJ420P;
+		sheet->width = request.columns * request.width;
+		sheet->height = request.rows * request.height;
+		av_frame_get_buffer(sheet, 32);
+		//Unused tiles on the last sheet stay black.
+		memset(sheet->data[0], 0, sheet->linesize[0] * sheet->height);
+		memset(sheet->data[1], 128, sheet->linesize[1] * (sheet->height / 2));
+		memset(sheet->data[2], 128, sheet->linesize[2] * (sheet->height / 2));
+		file->sheets.push_back(sheet);
+		file->sheet_remaining.push_back(FFMIN(per_sheet, request.count - s * per_sheet));
+	}
+
+	//Cue file for players that show sprite previews on the seek bar.
+	std::string vtt_path = request.prefix + ".vtt";
+	std::string sheet_name = request.prefix.substr(request.prefix.find_last_of("/\\") + 1);
+	FILE* vtt = fopen(vtt_path.c_str(), "w");
+	if (vtt) {
+		fprintf(vtt, "WEBVTT\n\n");
+		double seconds_per_thumbnail = span * av_q2d(time_base) / request.count;
+		for (int i = 0; i < request.count; i++) {
+			int tile = i % per_sheet;
+			fprintf(vtt, "%s --> %s\n%s_%d.jpg#xywh=%d,%d,%d,%d\n\n", media_vtt_time(i * seconds_per_thumbnail).c_str(), media_vtt_time((i + 1) * seconds_per_thumbnail).c_str(),
+				sheet_name.c_str(), i / per_sheet, (tile % request.columns) * request.width, (tile / request.columns) * request.height, request.width, request.height);
+		}
+		fclose(vtt);
+	}
+
+	//Two chunks per worker keeps every core busy without reopening the file for each thumbnail.
+	int per_task = FFMAX(1, request.count / (2 * static_cast<int>(engine->pool.workers.size())));
+	file->tasks_remaining = (request.count + per_task - 1) / per_task;
+	for (int first = 0; first < request.count; first += per_task) {
+		int last = FFMIN(first + per_task, request.count);
+		media_thread_pool_submit(&engine->pool, [engine, file, first, last]() { media_thumbnail_decode(engine, file, first, last); });
+	}
+}
+
+int malloc_media_thumbnail_engine(MediaThumbnailEngine* engine, int threads) {
+	engine->thumbnails = 0;
+	engine->sheets = 0;
+	engine->failures = 0;
+	//Sheet paths come with each request, the exporter's directory and pattern are not used.
+	if (malloc_media_image_exporter(&engine->exporter, MEDIA_IMAGE_JPEG, ".", "%d", threads) < 0) {
+		return -1;
+	}
+	return malloc_media_thread_pool(&engine->pool, threads);
+}
+
+void free_media_thumbnail_engine(MediaThumbnailEngine* engine) {
+	free_media_thread_pool(&engine->pool);
+	free_media_image_exporter(&engine->exporter);
+}
+
+int media_thumbnail_submit(MediaThumbnailEngine* engine, const MediaThumbnailRequest* request) {
+	if (request->count <= 0 || request->columns <= 0 || request->rows <= 0 || request->width < 2 || request->height < 2) {
+		media_error_submit("Thumbnail request needs a count, a sheet layout and a size!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	MediaThumbnailRequest copy = *request;
+	copy.width &= ~1;
+	copy.height &= ~1;
+	media_thread_pool_submit(&engine->pool, [engine, copy]() { media_thumbnail_plan(engine, copy); });
+	return 0;
+}
+
+void media_thumbnail_wait(MediaThumbnailEngine* engine) {
+	media_thread_pool_wait(&engine->pool);
+	media_image_exporter_flush(&engine->exporter);
+	engine->sheets = engine->exporter.written.load();
+	engine->failures += engine->exporter.failures.exchange(0);
+}
+
+//Image export
+static MediaImageEncoder* media_image_encoder_acquire(MediaImageExporter* exporter, int width, int height) {
+	{
+		std::lock_guard<std::mutex> guard(exporter->encoders_lock);
+		for (int i = 0; i < exporter->idle_encoders.size(); i++) {
+			MediaImageEncoder* encoder = exporter->idle_encoders[i];
+			if (encoder->ctx->width == width && encoder->ctx->height == height) {
+				exporter->idle_encoders.erase(exporter->idle_encoders.begin() + i);
+				return encoder;
+			}
+		}
+	}
+
+	//No warm encoder for this size yet, open one. It joins the idle list once released and stays open until the exporter is freed.
+	bool png = exporter->format == MEDIA_IMAGE_PNG;
+	AVCodec* codec = avcodec_find_encoder(png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+	AVCodecContext* ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+	if (!ctx) {
+		return NULL;
+	}
+	ctx->pix_fmt = png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+	ctx->width = width;
+	ctx->height = height;
+	ctx->time_base = { 1, 25 };
+	ctx->thread_count = 1; //Frames are spread over the pool instead.
+	if (!png) {
+		ctx->flags |= AV_CODEC_FLAG_QSCALE;
+		ctx->global_quality = FF_QP2LAMBDA * exporter->quality;
+	}
+	if (avcodec_open2(ctx, codec, NULL) < 0) {
+		media_error_submit("Image encoder could not be opened!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		avcodec_free_context(&ctx);
+		return NULL;
+	}
+
+	MediaImageEncoder* encoder = new MediaImageEncoder;
+	encoder->ctx = ctx;
+	encoder->scaler = NULL;
+	encoder->converted = av_frame_alloc();
+	encoder->converted->format = ctx->pix_fmt;
+	encoder->converted->width = width;
+	encoder->converted->height = height;
+	av_frame_get_buffer(encoder->converted, 32);
+	return encoder;
+}
+
+static void media_image_encoder_release(MediaImageExporter* exporter, MediaImageEncoder* encoder) {
+	std::lock_guard<std::mutex> guard(exporter->encoders_lock);
+	exporter->idle_encoders.push_back(encoder);
+}
+
+static void media_image_finished(MediaImageExporter* exporter) {
+	{
+		std::lock_guard<std::mutex> guard(exporter->write_lock);
+		exporter->in_flight--;
+	}
+	exporter->write_signal.notify_all();
+}
+
+static void media_image_encode(MediaImageExporter* exporter, AVFrame* frame, int number, std::string path) {
+	MediaImageEncoder* encoder = media_image_encoder_acquire(exporter, frame->width, frame->height);
+	AVPacket* packet = av_packet_alloc();
+	bool encoded = false;
+
+	if (encoder) {
+		AVFrame* input = frame;
+		if (frame->format != encoder->ctx->pix_fmt) {
+			encoder->scaler = sws_getCachedContext(encoder->scaler, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+				frame->width, frame->height, encoder->ctx->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+			if (encoder->scaler && av_frame_make_writable(encoder->converted) == 0) {
+				sws_scale(encoder->scaler, frame->data, frame->linesize, 0, frame->height, encoder->converted->data, encoder->converted->linesize);
+				input = encoder->converted;
+			}
+		}
+		input->quality = encoder->ctx->global_quality;
+		input->pts = number;
+
+		//Both encoders are intra only without delay, the packet is ready straight away and the context stays usable.
+		encoded = input->format == encoder->ctx->pix_fmt && avcodec_send_frame(encoder->ctx, input) == 0 && avcodec_receive_packet(encoder->ctx, packet) == 0;
+		media_image_encoder_release(exporter, encoder);
+	}
+	av_frame_free(&frame);
+
+	if (!encoded) {
+		av_packet_free(&packet);
+		exporter->failures++;
+		media_image_finished(exporter);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(exporter->write_lock);
+		exporter->writes.push_back({ path, packet });
+	}
+	exporter->write_signal.notify_all();
+}
+
+//Disk writes on their own thread, so encoders never wait on the file system.
+static void media_image_writer(MediaImageExporter* exporter) {
+	while (true) {
+		MediaImageWrite write;
+		{
+			std::unique_lock<std::mutex> guard(exporter->write_lock);
+			exporter->write_signal.wait(guard, [&]() { return exporter->stop || !exporter->writes.empty(); });
+			if (exporter->writes.empty()) {
+				return;
+			}
+			write = exporter->writes.front();
+			exporter->writes.pop_front();
+		}
+
+		FILE* f = fopen(write.path.c_str(), "wb");
+		bool written = f && fwrite(write.packet->data, 1, write.packet->size, f) == write.packet->size;
+		if (f) {
+			fclose(f);
+		}
+		if (written) {
+			exporter->written++;
+		}
+		else {
+			media_error_submit("Image could not be written!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			exporter->failures++;
+		}
+		av_packet_free(&write.packet);
+		media_image_finished(exporter);
+	}
+}
+
+int malloc_media_image_exporter(MediaImageExporter* exporter, media_image_format format, const char* directory, const char* pattern, int threads) {
+	exporter->format = format;
+	exporter->directory = directory;
+	exporter->pattern = pattern;
+	exporter->quality = 3;
+	exporter->idle_encoders.clear();
+	exporter->writes.clear();
+	exporter->in_flight = 0;
+	exporter->stop = false;
+	exporter->written = 0;
+	exporter->failures = 0;
+
+	media_make_directory(directory);
+	malloc_media_thread_pool(&exporter->encode_pool, threads);
+	exporter->max_in_flight = 4 * exporter->encode_pool.workers.size();
+	exporter->writer = std::thread(media_image_writer, exporter);
+	return 0;
+}
+
+static int media_image_submit(MediaImageExporter* exporter, AVFrame* frame, int number, const std::string& path) {
+	//New reference to the same buffers, the caller can reuse its frame for the next decode straight away.
+	AVFrame* reference = av_frame_clone(frame);
+	if (!reference) {
+		return -1;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(exporter->write_lock);
+		exporter->write_signal.wait(guard, [&]() { return exporter->in_flight < exporter->max_in_flight; });
+		exporter->in_flight++;
+	}
+	media_thread_pool_submit(&exporter->encode_pool, [exporter, reference, number, path]() { media_image_encode(exporter, reference, number, path); });
+	return 0;
+}
+
+int media_image_export(MediaImageExporter* exporter, AVFrame* frame, int number) {
+	char name[512];
+	snprintf(name, sizeof(name), exporter->pattern.c_str(), number);
+	std::string path = exporter->directory + "/" + name + (exporter->format == MEDIA_IMAGE_PNG ? ".png" : ".jpg");
+	return media_image_submit(exporter, frame, number, path);
+}
+
+int media_image_export_to(MediaImageExporter* exporter, AVFrame* frame, const char* path) {
+	return media_image_submit(exporter, frame, 0, path);
+}
+
+void media_image_exporter_flush(MediaImageExporter* exporter) {
+	std::unique_lock<std::mutex> guard(exporter->write_lock);
+	exporter->write_signal.wait(guard, [&]() { return exporter->in_flight == 0; });
+}
+
+void free_media_image_exporter(MediaImageExporter* exporter) {
+	media_image_exporter_flush(exporter);
+	free_media_thread_pool(&exporter->encode_pool);
+	{
+		std::lock_guard<std::mutex> guard(exporter->write_lock);
+		exporter->stop = true;
+	}
+	exporter->write_signal.notify_all();
+	exporter->writer.join();
+
+	for (MediaImageEncoder* encoder : exporter->idle_encoders) {
+		avcodec_free_context(&encoder->ctx);
+		sws_freeContext(encoder->scaler);
+		av_frame_free(&encoder->converted);
+		delete encoder;
+	}
+	exporter->idle_encoders.clear();
+}
+
+//Image sequences
+static inline uint8_t media_rgb_to_y(int r, int g, int b) {
+	return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+static inline uint8_t media_rgb_to_u(int r, int g, int b) {
+	return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+static inline uint8_t media_rgb_to_v(int r, int g, int b) {
+	return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+//Scalar version for the frame edges and builds without SSE2. Chroma is the average of each 2x2 block, odd edges repeat the last pixel.
+static void media_rgba_to_yuv420p_block(const uint8_t* rgba, int stride, int width, int height, int x, int y, AVFrame* out) {
+	int r = 0, g = 0, b = 0;
+	for (int dy = 0; dy < 2; dy++) {
+		for (int dx = 0; dx < 2; dx++) {
+			int px = FFMIN(x + dx, width - 1);
+			int py = FFMIN(y + dy, height - 1);
+			const uint8_t* p = rgba + py * stride + px * 4;
+			out->data[0][py * out->linesize[0] + px] = media_rgb_to_y(p[0], p[1], p[2]);
+			r += p[0];
+			g += p[1];
+			b += p[2];
+		}
+	}
+	out->data[1][(y / 2) * out->linesize[1] + x / 2] = media_rgb_to_u(r >> 2, g >> 2, b >> 2);
+	out->data[2][(y / 2) * out->linesize[2] + x / 2] = media_rgb_to_v(r >> 2, g >> 2, b >> 2);
+}
+
+#ifdef MEDIA_HAVE_SSE2
+//Eight pixels of one row as three vectors of 16 bit channels.
+static inline void media_load_rgba8(const uint8_t* p, __m128i* r, __m128i* g, __m128i* b) {
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+	*r = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+	*g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+	*b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+}
+
+//Luma fits unsigned 16 bit before the shift, so the sums may wrap the sign bit and a logical shift still gives the right value.
+static inline __m128i media_luma8(__m128i r, __m128i g, __m128i b) {
+	__m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+		_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+//Sums horizontal pairs of both rows and averages, four chroma samples from two rows of eight pixels.
+static inline __m128i media_average_2x2(__m128i top, __m128i bottom) {
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(top, _mm_set1_epi16(1)), _mm_madd_epi16(bottom, _mm_set1_epi16(1)));
+	sum = _mm_srai_epi32(sum, 2);
+	return _mm_packs_epi32(sum, sum);
+}
+#endif
+
+void media_rgba_to_yuv420p(const uint8_t* rgba, int stride, int width, int height, AVFrame* out) {
+	for (int y = 0; y < height; y += 2) {
+		int x = 0;
+#ifdef MEDIA_HAVE_SSE2
+		if (y + 1 < height) {
+			const uint8_t* row0 = rgba + y * stride;
+			const uint8_t* row1 = row0 + stride;
+			uint8_t* y0 = out->data[0] + y * out->linesize[0];
+			uint8_t* y1 = y0 + out->linesize[0];
+			uint8_t* u = out->data[1] + (y / 2) * out->linesize[1];
+			uint8_t* v = out->data[2] + (y / 2) * out->linesize[2];
+
+			for (; x + 8 <= width; x += 8) {
+				__m128i r0, g0, b0, r1, g1, b1;
+				media_load_rgba8(row0 + x * 4, &r0, &g0, &b0);
+				media_load_rgba8(row1 + x * 4, &r1, &g1, &b1);
+
+				__m128i luma0 = media_luma8(r0, g0, b0);
+				__m128i luma1 = media_luma8(r1, g1, b1);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + x), _mm_packus_epi16(luma0, luma0));
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + x), _mm_packus_epi16(luma1, luma1));
+
+				//Chroma sums stay within signed 16 bit, arithmetic shift keeps the sign.
+				__m128i r = media_average_2x2(r0, r1);
+				__m128i g = media_average_2x2(g0, g1);
+				__m128i b = media_average_2x2(b0, b1);
+				__m128i cu = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)), _mm_mullo_epi16(g, _mm_set1_epi16(-74)));
+				cu = _mm_add_epi16(cu, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)), _mm_set1_epi16(128)));
+				cu = _mm_add_epi16(_mm_srai_epi16(cu, 8), _mm_set1_epi16(128));
+				__m128i cv = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)), _mm_mullo_epi16(g, _mm_set1_epi16(-94)));
+				cv = _mm_add_epi16(cv, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(-18)), _mm_set1_epi16(128)));
+				cv = _mm_add_epi16(_mm_srai_epi16(cv, 8), _mm_set1_epi16(128));
+
+				int packed_u = _mm_cvtsi128_si32(_mm_packus_epi16(cu, cu));
+				int packed_v = _mm_cvtsi128_si32(_mm_packus_epi16(cv, cv));
+				memcpy(u + x / 2, &packed_u, 4);
+				memcpy(v + x / 2, &packed_v, 4);
+			}
+		}
+#endif
+		for (; x < width; x += 2) {
+			media_rgba_to_yuv420p_block(rgba, stride, width, height, x, y, out);
+		}
+	}
+}
+
+static void media_image_sequence_load(MediaImageSequence* media, int number) {
+	char path[1024];
+	snprintf(path, sizeof(path), media->pattern.c_str(), number);
+
+	int width, height, components;
+	uint8_t* pixels = stbi_load(path, &width, &height, &components, 4);
+	AVFrame* frame = NULL;
+
+	if (pixels && width == media->width && height == media->height) {
+		frame = av_frame_alloc();
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = width;
+		frame->height = height;
+		if (av_frame_get_buffer(frame, 32) == 0) {
+			media_rgba_to_yuv420p(pixels, width * 4, width, height, frame);
+			frame->pts = number - media->first;
+		}
+		else {
+			av_frame_free(&frame);
+		}
+	}
+	else if (pixels) {
+		media_error_submit("Image size changes inside the sequence, stopping there!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+	}
+	stbi_image_free(pixels);
+
+	{
+		std::lock_guard<std::mutex> guard(media->lock);
+		media->ready[number] = frame;
+	}
+	media->ready_signal.notify_all();
+}
+
+//Called with the lock held, keeps read_ahead images requested beyond the one the consumer waits for.
+static void media_image_sequence_fill(MediaImageSequence* media) {
+	while (media->next_submit < media->next_out + media->read_ahead) {
+		int number = media->next_submit++;
+		media_thread_pool_submit(&media->pool, [media, number]() { media_image_sequence_load(media, number); });
+	}
+}
+
+int malloc_media_image_sequence(MediaImageSequence* media, const char* pattern, int first, AVRational frame_rate, int read_ahead, int threads) {
+	char path[1024];
+	snprintf(path, sizeof(path), pattern, first);
+	int components;
+	if (!stbi_info(path, &media->width, &media->height, &components)) {
+		media_error_submit("First image of the sequence could not be read!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	media->pattern = pattern;
+	media->first = first;
+	media->time_base = av_inv_q(frame_rate);
+	media->read_ahead = FFMAX(read_ahead, 1);
+	media->next_submit = first;
+	media->next_out = first;
+	media->ready.clear();
+	malloc_media_thread_pool(&media->pool, threads);
+
+	std::lock_guard<std::mutex> guard(media->lock);
+	media_image_sequence_fill(media);
+	return 0;
+}
+
+void free_media_image_sequence(MediaImageSequence* media) {
+	free_media_thread_pool(&media->pool);
+	for (auto& entry : media->ready) {
+		av_frame_free(&entry.second);
+	}
+	media->ready.clear();
+}
+
+int decode_next_frame_video(MediaImageSequence* media, MediaFrame* frame) {
+	AVFrame* image;
+	{
+		std::unique_lock<std::mutex> guard(media->lock);
+		media->ready_signal.wait(guard, [&]() { return media->ready.count(media->next_out) > 0; });
+		image = media->ready[media->next_out];
+		if (!image) {
+			//End of the sequence, leave the marker so further calls fail too.
+			return -1;
+		}
+		media->ready.erase(media->next_out);
+		media->next_out++;
+		media_image_sequence_fill(media);
+	}
+
+	av_frame_unref(frame->video_frame);
+	av_frame_move_ref(frame->video_frame, image);
+	av_frame_free(&image);
+
+	frame->frame_pts = frame->video_frame->pts;
+	frame->frame_pts_seconds = frame->frame_pts * av_q2d(media->time_base);
+	return 0;
+}
+
+//Pixel conversion
+static int media_detect_cpu_features() {
+	int features = 0;
+#if defined(MEDIA_HAVE_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int highest = info[0];
+	__cpuid(info, 1);
+	if (info[2] & (1 << 19)) {
+		features |= MEDIA_CPU_SSE41;
+	}
+	//AVX2 also needs the OS to save ymm registers.
+	bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	if (highest >= 7 && os_avx) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) {
+			features |= MEDIA_CPU_AVX2;
+		}
+	}
+#elif defined(MEDIA_HAVE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		features |= MEDIA_CPU_SSE41;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		features |= MEDIA_CPU_AVX2;
+	}
+#endif
+	return features;
+}
+
+static std::atomic<int> media_cpu_features_limit(-1);
+
+int media_cpu_features() {
+	static const int detected = media_detect_cpu_features();
+	int limit = media_cpu_features_limit.load();
+	return limit < 0 ? detected : detected & limit;
+}
+
+void media_cpu_features_override(int features) {
+	media_cpu_features_limit.store(features);
+}
+
+//Splits rows into one band per thread, band starts are multiples of align so subsampled chroma rows are never shared.
+//The calling thread takes the first band, small frames are not worth a thread.
+static void media_run_bands(int rows, int threads, int align, const std::function<void(int, int)>& band) {
+	const int min_rows = 64;
+	threads = threads > 0 ? threads : FFMAX(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	threads = FFMAX(FFMIN(threads, rows / min_rows), 1);
+
+	int step = (rows + threads - 1) / threads;
+	step = (step + align - 1) / align * align;
+
+	std::vector<std::thread> workers;
+	for (int start = step; start < rows; start += step) {
+		workers.emplace_back(band, start, FFMIN(start + step, rows));
+	}
+	band(0, FFMIN(step, rows));
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+//[matrix][full range], gains are scaled by 64.
+static const MediaYuvCoefficients media_yuv_coefficients[2][2] = {
+	{ { 16, 75, 102, 25, 52, 129 }, { 0, 64, 90, 22, 46, 113 } }, //BT.601
+	{ { 16, 75, 115, 14, 34, 135 }, { 0, 64, 101, 12, 30, 119 } }, //BT.709
+};
+
+static inline uint8_t media_clamp_pixel(int value) {
+	return static_cast<uint8_t>(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+template <int Format>
+static inline void media_store_rgb_pixel(uint8_t* dst, int r, int g, int b) {
+	if (Format == MEDIA_RGB24) {
+		dst[0] = media_clamp_pixel(r);
+		dst[1] = media_clamp_pixel(g);
+		dst[2] = media_clamp_pixel(b);
+	}
+	else {
+		dst[Format == MEDIA_BGRA ? 2 : 0] = media_clamp_pixel(r);
+		dst[1] = media_clamp_pixel(g);
+		dst[Format == MEDIA_BGRA ? 0 : 2] = media_clamp_pixel(b);
+		dst[3] = 255;
+	}
+}
+
+//For NV12 u points at the interleaved plane and v is unused.
+template <int Layout, int Format>
+static void media_yuv_row_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int start, int width, const MediaYuvCoefficients* c) {
+	const int bytes = Format == MEDIA_RGB24 ? 3 : 4;
+	for (int x = start; x < width; x++) {
+		int cu, cv;
+		if (Layout == MEDIA_CHROMA_444P) {
+			cu = u[x];
+			cv = v[x];
+		}
+		else if (Layout == MEDIA_CHROMA_420P) {
+			cu = u[x / 2];
+			cv = v[x / 2];
+		}
+		else {
+			cu = u[(x / 2) * 2];
+			cv = u[(x / 2) * 2 + 1];
+		}
+		int luma = (y[x] - c->y_offset) * c->y_gain + 32;
+		cu -= 128;
+		cv -= 128;
+		media_store_rgb_pixel<Format>(dst + x * bytes, (luma + c->v_to_r * cv) >> 6, (luma - c->u_to_g * cu - c->v_to_g * cv) >> 6,
+			(luma + c->u_to_b * cu) >> 6);
+	}
+}
+
+#ifdef MEDIA_HAVE_X86
+//Chroma for 16 pixels as one byte per pixel, subsampled layouts repeat each sample twice.
+template <int Layout>
+static inline MEDIA_TARGET("sse4.1") void media_load_chroma16(const uint8_t* u, const uint8_t* v, int x, __m128i* cu, __m128i* cv) {
+	if (Layout == MEDIA_CHROMA_444P) {
+		*cu = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x));
+		*cv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + x));
+	}
+	else if (Layout == MEDIA_CHROMA_420P) {
+		__m128i su = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u + x / 2));
+		__m128i sv = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + x / 2));
+		*cu = _mm_unpacklo_epi8(su, su);
+		*cv = _mm_unpacklo_epi8(sv, sv);
+	}
+	else {
+		//Eight u,v pairs, spreading each byte over its 16 bit lane duplicates it.
+		__m128i pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x));
+		__m128i su = _mm_and_si128(pairs, _mm_set1_epi16(0xFF));
+		__m128i sv = _mm_srli_epi16(pairs, 8);
+		*cu = _mm_or_si128(su, _mm_slli_epi16(su, 8));
+		*cv = _mm_or_si128(sv, _mm_slli_epi16(sv, 8));
+	}
+}
+
+//Interleaves 16 pixels of r,g,b bytes into the output format.
+template <int Format>
+static inline MEDIA_TARGET("sse4.1") void media_store_rgb16(uint8_t* dst, __m128i r, __m128i g, __m128i b) {
+	if (Format == MEDIA_BGRA) {
+		std::swap(r, b);
+	}
+	__m128i alpha = _mm_set1_epi8(static_cast<char>(0xFF));
+	__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+	__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+	__m128i ba_lo = _mm_unpacklo_epi8(b, alpha);
+	__m128i ba_hi = _mm_unpackhi_epi8(b, alpha);
+	__m128i px[4] = { _mm_unpacklo_epi16(rg_lo, ba_lo), _mm_unpackhi_epi16(rg_lo, ba_lo), _mm_unpacklo_epi16(rg_hi, ba_hi), _mm_unpackhi_epi16(rg_hi, ba_hi) };
+
+	if (Format != MEDIA_RGB24) {
+		for (int i = 0; i < 4; i++) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 16), px[i]);
+		}
+		return;
+	}
+
+	//Drop alpha, 12 useful bytes per vector. Each store runs 4 bytes into the next one, the last is split so nothing past
+	//the 48 bytes of these pixels is written.
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	for (int i = 0; i < 3; i++) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 12), _mm_shuffle_epi8(px[i], pack));
+	}
+	__m128i last = _mm_shuffle_epi8(px[3], pack);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 36), last);
+	int tail = _mm_cvtsi128_si32(_mm_srli_si128(last, 8));
+	memcpy(dst + 44, &tail, 4);
+}
+
+//Eight pixels in 16 bit lanes. Saturating adds only clip values that end up clamped to 0 or 255 anyway.
+static inline MEDIA_TARGET("sse4.1") void media_yuv_math8(__m128i y, __m128i u, __m128i v, const MediaYuvCoefficients* c, __m128i* r, __m128i* g, __m128i* b) {
+	__m128i luma = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(c->y_offset)), _mm_set1_epi16(c->y_gain)), _mm_set1_epi16(32));
+	u = _mm_sub_epi16(u, _mm_set1_epi16(128));
+	v = _mm_sub_epi16(v, _mm_set1_epi16(128));
+	*r = _mm_srai_epi16(_mm_adds_epi16(luma, _mm_mullo_epi16(v, _mm_set1_epi16(c->v_to_r))), 6);
+	*g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(luma, _mm_mullo_epi16(u, _mm_set1_epi16(c->u_to_g))), _mm_mullo_epi16(v, _mm_set1_epi16(c->v_to_g))), 6);
+	*b = _mm_srai_epi16(_mm_adds_epi16(luma, _mm_mullo_epi16(u, _mm_set1_epi16(c->u_to_b))), 6);
+}
+
+template <int Layout, int Format>
+static MEDIA_TARGET("sse4.1") void media_yuv_row_sse41(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const MediaYuvCoefficients* c) {
+	const int bytes = Format == MEDIA_RGB24 ? 3 : 4;
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i luma = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+		__m128i cu, cv;
+		media_load_chroma16<Layout>(u, v, x, &cu, &cv);
+
+		__m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+		media_yuv_math8(_mm_unpacklo_epi8(luma, zero), _mm_unpacklo_epi8(cu, zero), _mm_unpacklo_epi8(cv, zero), c, &r_lo, &g_lo, &b_lo);
+		media_yuv_math8(_mm_unpackhi_epi8(luma, zero), _mm_unpackhi_epi8(cu, zero), _mm_unpackhi_epi8(cv, zero), c, &r_hi, &g_hi, &b_hi);
+		media_store_rgb16<Format>(dst + x * bytes, _mm_packus_epi16(r_lo, r_hi), _mm_packus_epi16(g_lo, g_hi), _mm_packus_epi16(b_lo, b_hi));
+	}
+	media_yuv_row_scalar<Layout, Format>(y, u, v, dst, x, width, c);
+}
+
+//Same arithmetic as the SSE4.1 row with all 16 pixels in one register, the interleave stays 128 bit.
+template <int Layout, int Format>
+static MEDIA_TARGET("avx2") void media_yuv_row_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const MediaYuvCoefficients* c) {
+	const int bytes = Format == MEDIA_RGB24 ? 3 : 4;
+	const __m256i y_offset = _mm256_set1_epi16(c->y_offset);
+	const __m256i y_gain = _mm256_set1_epi16(c->y_gain);
+	const __m256i v_to_r = _mm256_set1_epi16(c->v_to_r);
+	const __m256i u_to_g = _mm256_set1_epi16(c->u_to_g);
+	const __m256i v_to_g = _mm256_set1_epi16(c->v_to_g);
+	const __m256i u_to_b = _mm256_set1_epi16(c->u_to_b);
+	const __m256i bias = _mm256_set1_epi16(128);
+	const __m256i round = _mm256_set1_epi16(32);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i cu, cv;
+		media_load_chroma16<Layout>(u, v, x, &cu, &cv);
+		__m256i luma = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x)));
+		__m256i wu = _mm256_sub_epi16(_mm256_cvtepu8_epi16(cu), bias);
+		__m256i wv = _mm256_sub_epi16(_mm256_cvtepu8_epi16(cv), bias);
+
+		luma = _mm256_adds_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(luma, y_offset), y_gain), round);
+		__m256i r = _mm256_srai_epi16(_mm256_adds_epi16(luma, _mm256_mullo_epi16(wv, v_to_r)), 6);
+		__m256i g = _mm256_srai_epi16(_mm256_subs_epi16(_mm256_subs_epi16(luma, _mm256_mullo_epi16(wu, u_to_g)), _mm256_mullo_epi16(wv, v_to_g)), 6);
+		__m256i b = _mm256_srai_epi16(_mm256_adds_epi16(luma, _mm256_mullo_epi16(wu, u_to_b)), 6);
+
+		//packus works per 128 bit lane, the permute puts r (or b) in the low half and g in the high half in pixel order.
+		__m256i rg = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, g), 0xD8);
+		__m256i bb = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0xD8);
+		media_store_rgb16<Format>(dst + x * bytes, _mm256_castsi256_si128(rg), _mm256_extracti128_si256(rg, 1), _mm256_castsi256_si128(bb));
+	}
+	media_yuv_row_scalar<Layout, Format>(y, u, v, dst, x, width, c);
+}
+#endif
+
+typedef void (*MediaYuvRowFunction)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const MediaYuvCoefficients* c);
+
+template <int Layout, int Format>
+static void media_yuv_row_plain(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const MediaYuvCoefficients* c) {
+	media_yuv_row_scalar<Layout, Format>(y, u, v, dst, 0, width, c);
+}
+
+template <int Layout, int Format>
+static MediaYuvRowFunction media_pick_yuv_row(int features) {
+#ifdef MEDIA_HAVE_X86
+	if (features & MEDIA_CPU_AVX2) {
+		return media_yuv_row_avx2<Layout, Format>;
+	}
+	if (features & MEDIA_CPU_SSE41) {
+		return media_yuv_row_sse41<Layout, Format>;
+	}
+#endif
+	return media_yuv_row_plain<Layout, Format>;
+}
+
+template <int Layout>
+static MediaYuvRowFunction media_pick_yuv_row(media_rgb_format format, int features) {
+	switch (format) {
+	case MEDIA_RGB24:
+		return media_pick_yuv_row<Layout, MEDIA_RGB24>(features);
+	case MEDIA_BGRA:
+		return media_pick_yuv_row<Layout, MEDIA_BGRA>(features);
+	default:
+		return media_pick_yuv_row<Layout, MEDIA_RGBA>(features);
+	}
+}
+
+int media_yuv_to_rgb(const AVFrame* frame, uint8_t* dst, int dst_stride, media_rgb_format format, media_yuv_matrix matrix, media_yuv_range range, int threads) {
+	media_chroma_layout layout;
+	switch (frame->format) {
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		layout = MEDIA_CHROMA_420P;
+		break;
+	case AV_PIX_FMT_NV12:
+		layout = MEDIA_CHROMA_NV12;
+		break;
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+		layout = MEDIA_CHROMA_444P;
+		break;
+	default:
+		media_error_submit("Pixel format has no RGB conversion kernel, use swscale!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	if (matrix == MEDIA_MATRIX_AUTO) {
+		bool hd = frame->colorspace == AVCOL_SPC_UNSPECIFIED && frame->height >= 720;
+		matrix = (frame->colorspace == AVCOL_SPC_BT709 || hd) ? MEDIA_MATRIX_BT709 : MEDIA_MATRIX_BT601;
+	}
+	if (range == MEDIA_RANGE_AUTO) {
+		bool full = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ444P;
+		range = full ? MEDIA_RANGE_FULL : MEDIA_RANGE_LIMITED;
+	}
+	const MediaYuvCoefficients* c = &media_yuv_coefficients[matrix == MEDIA_MATRIX_BT709][range == MEDIA_RANGE_FULL];
+
+	//One runtime decision per frame, the rows run without any format checks.
+	int features = media_cpu_features();
+	MediaYuvRowFunction row;
+	switch (layout) {
+	case MEDIA_CHROMA_420P:
+		row = media_pick_yuv_row<MEDIA_CHROMA_420P>(format, features);
+		break;
+	case MEDIA_CHROMA_NV12:
+		row = media_pick_yuv_row<MEDIA_CHROMA_NV12>(format, features);
+		break;
+	default:
+		row = media_pick_yuv_row<MEDIA_CHROMA_444P>(format, features);
+		break;
+	}
+
+	int chroma_shift = layout == MEDIA_CHROMA_444P ? 0 : 1;
+	media_run_bands(frame->height, threads, 2, [&](int first, int last) {
+		for (int line = first; line < last; line++) {
+			int chroma_line = line >> chroma_shift;
+			const uint8_t* u = frame->data[1] + chroma_line * frame->linesize[1];
+			const uint8_t* v = layout == MEDIA_CHROMA_NV12 ? NULL : frame->data[2] + chroma_line * frame->linesize[2];
+			row(frame->data[0] + line * frame->linesize[0], u, v, dst + line * dst_stride, frame->width, c);
+		}
+	});
+	return 0;
+}
+
+//Pixel format kernels
+template <typename Format>
+static MediaFrameView<Format> media_frame_view(const AVFrame* frame) {
+	MediaFrameView<Format> view;
+	for (int plane = 0; plane < 3; plane++) {
+		view.data[plane] = plane < Format::planes ? reinterpret_cast<typename Format::sample*>(frame->data[plane]) : NULL;
+		view.linesize[plane] = plane < Format::planes ? frame->linesize[plane] : 0;
+	}
+	view.width = frame->width;
+	view.height = frame->height;
+	return view;
+}
+
+//Pointer arithmetic only, x and y snap down to the chroma grid so every plane starts on a whole sample.
+template <typename Format>
+static MediaFrameView<Format> media_view_crop(const MediaFrameView<Format>& view, int x, int y, int width, int height) {
+	x &= ~((1 << Format::chroma_shift_x) - 1);
+	y &= ~((1 << Format::chroma_shift_y) - 1);
+
+	MediaFrameView<Format> crop = view;
+	for (int plane = 0; plane < Format::planes; plane++) {
+		crop.data[plane] = view.row(plane, Format::plane_y(plane, y)) + Format::plane_x(plane, x);
+	}
+	crop.width = FFMIN(width, view.width - x);
+	crop.height = FFMIN(height, view.height - y);
+	return crop;
+}
+
+template <typename Format>
+static void media_view_copy(const MediaFrameView<Format>& src, const MediaFrameView<Format>& dst) {
+	int width = FFMIN(src.width, dst.width);
+	int height = FFMIN(src.height, dst.height);
+	for (int plane = 0; plane < Format::planes; plane++) {
+		size_t bytes = Format::plane_width(plane, width) * sizeof(typename Format::sample);
+		for (int y = 0; y < Format::plane_height(plane, height); y++) {
+			memcpy(dst.row(plane, y), src.row(plane, y), bytes);
+		}
+	}
+}
+
+//Alpha in 1/256 steps, the same weight for every plane.
+template <typename Format>
+static void media_view_blend(const MediaFrameView<Format>& dst, const MediaFrameView<Format>& src, int alpha) {
+	int width = FFMIN(src.width, dst.width);
+	int height = FFMIN(src.height, dst.height);
+	for (int plane = 0; plane < Format::planes; plane++) {
+		int samples = Format::plane_width(plane, width);
+		for (int y = 0; y < Format::plane_height(plane, height); y++) {
+			typename Format::sample* d = dst.row(plane, y);
+			const typename Format::sample* s = src.row(plane, y);
+			for (int x = 0; x < samples; x++) {
+				d[x] = static_cast<typename Format::sample>(d[x] + (((s[x] - d[x]) * alpha + 128) >> 8));
+			}
+		}
+	}
+}
+
+template <int FromDepth, int ToDepth>
+static inline int media_rescale_sample(int value) {
+	const int up = ToDepth > FromDepth ? ToDepth - FromDepth : 0;
+	const int down = FromDepth > ToDepth ? FromDepth - ToDepth : 0;
+	//Rounding can carry the top codes one past the narrower range (1023 -> 256), clamp instead of letting the cast wrap to black.
+	return FFMIN(((value << up) + ((1 << down) >> 1)) >> down, (1 << ToDepth) - 1);
+}
+
+//Chroma sample c (0 for U, 1 for V) at chroma coordinates cx,cy.
+template <typename Format>
+static inline typename Format::sample* media_view_chroma(const MediaFrameView<Format>& view, int c, int cx, int cy) {
+	if (Format::packed_chroma) {
+		return view.row(1, cy) + cx * 2 + c;
+	}
+	return view.row(1 + c, cy) + cx;
+}
+
+template <typename From, typename To>
+static void media_view_convert(const MediaFrameView<From>& src, const MediaFrameView<To>& dst) {
+	int width = FFMIN(src.width, dst.width);
+	int height = FFMIN(src.height, dst.height);
+
+	for (int y = 0; y < height; y++) {
+		const typename From::sample* s = src.row(0, y);
+		typename To::sample* d = dst.row(0, y);
+		if (From::depth == To::depth && sizeof(typename From::sample) == sizeof(typename To::sample)) {
+			memcpy(d, s, width * sizeof(typename To::sample));
+			continue;
+		}
+		for (int x = 0; x < width; x++) {
+			d[x] = static_cast<typename To::sample>(media_rescale_sample<From::depth, To::depth>(s[x]));
+		}
+	}
+
+	//Each destination chroma sample covers span_x * span_y source samples when it is more subsampled, one repeated sample otherwise.
+	const int span_shift_x = To::chroma_shift_x > From::chroma_shift_x ? To::chroma_shift_x - From::chroma_shift_x : 0;
+	const int span_shift_y = To::chroma_shift_y > From::chroma_shift_y ? To::chroma_shift_y - From::chroma_shift_y : 0;
+	const int span_x = 1 << span_shift_x;
+	const int span_y = 1 << span_shift_y;
+	int src_cw = (width + (1 << From::chroma_shift_x) - 1) >> From::chroma_shift_x;
+	int src_ch = From::plane_height(1, height);
+	int dst_cw = (width + (1 << To::chroma_shift_x) - 1) >> To::chroma_shift_x;
+	int dst_ch = To::plane_height(1, height);
+
+	for (int c = 0; c < 2; c++) {
+		for (int cy = 0; cy < dst_ch; cy++) {
+			int sy = ((cy << To::chroma_shift_y) >> From::chroma_shift_y);
+			for (int cx = 0; cx < dst_cw; cx++) {
+				int sx = ((cx << To::chroma_shift_x) >> From::chroma_shift_x);
+				int sum = 0;
+				for (int j = 0; j < span_y; j++) {
+					for (int i = 0; i < span_x; i++) {
+						sum += *media_view_chroma(src, c, FFMIN(sx + i, src_cw - 1), FFMIN(sy + j, src_ch - 1));
+					}
+				}
+				int value = (sum + ((span_x * span_y) >> 1)) >> (span_shift_x + span_shift_y);
+				*media_view_chroma(dst, c, cx, cy) = static_cast<typename To::sample>(media_rescale_sample<From::depth, To::depth>(value));
+			}
+		}
+	}
+}
+
+//The one place a runtime pixel format becomes a compile time one, op is called with a MediaPixelFormat tag.
+template <typename Op>
+static int media_dispatch_pixel_format(int pix_fmt, Op&& op) {
+	switch (pix_fmt) {
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV420P>());
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUVJ422P:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV422P>());
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV444P>());
+	case AV_PIX_FMT_NV12:
+		return op(MediaPixelFormat<AV_PIX_FMT_NV12>());
+	case AV_PIX_FMT_YUV420P10LE:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV420P10LE>());
+	case AV_PIX_FMT_YUV422P10LE:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV422P10LE>());
+	case AV_PIX_FMT_YUV444P10LE:
+		return op(MediaPixelFormat<AV_PIX_FMT_YUV444P10LE>());
+	default:
+		media_error_submit("Pixel format has no kernels!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+}
+
+bool media_pixel_format_supported(int pix_fmt) {
+	switch (pix_fmt) {
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUVJ422P:
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+	case AV_PIX_FMT_NV12:
+	case AV_PIX_FMT_YUV420P10LE:
+	case AV_PIX_FMT_YUV422P10LE:
+	case AV_PIX_FMT_YUV444P10LE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int media_frame_copy(const AVFrame* src, AVFrame* dst) {
+	return media_frame_crop(src, dst, 0, 0);
+}
+
+int media_frame_crop(const AVFrame* src, AVFrame* dst, int x, int y) {
+	if (src->format != dst->format || x < 0 || y < 0 || x >= src->width || y >= src->height) {
+		media_error_submit("Crop needs the same format and an origin inside the source!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return media_dispatch_pixel_format(src->format, [&](auto format) {
+		typedef decltype(format) Format;
+		MediaFrameView<Format> view = media_frame_view<Format>(src);
+		media_view_copy(media_view_crop(view, x, y, dst->width, dst->height), media_frame_view<Format>(dst));
+		return 0;
+	});
+}
+
+int media_frame_blend(AVFrame* dst, const AVFrame* src, int x, int y, float opacity) {
+	if (src->format != dst->format) {
+		media_error_submit("Blend needs both frames in the same format!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	int alpha = static_cast<int>(av_clipf(opacity, 0.0f, 1.0f) * 256.0f + 0.5f);
+	return media_dispatch_pixel_format(dst->format, [&](auto format) {
+		typedef decltype(format) Format;
+		//Parts of src outside dst are cut off by cropping both sides.
+		int left = FFMAX(-x, 0);
+		int top = FFMAX(-y, 0);
+		int dx = FFMAX(x, 0);
+		int dy = FFMAX(y, 0);
+		if (dx >= dst->width || dy >= dst->height || left >= src->width || top >= src->height) {
+			return 0;
+		}
+		MediaFrameView<Format> from = media_view_crop(media_frame_view<Format>(src), left, top, src->width, src->height);
+		MediaFrameView<Format> to = media_view_crop(media_frame_view<Format>(dst), dx, dy, from.width, from.height);
+		media_view_blend(to, from, alpha);
+		return 0;
+	});
+}
+
+int media_frame_convert(const AVFrame* src, AVFrame* dst) {
+	if (src->width != dst->width || src->height != dst->height) {
+		media_error_submit("Conversion does not scale, use swscale!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return media_dispatch_pixel_format(src->format, [&](auto from_format) {
+		typedef decltype(from_format) From;
+		return media_dispatch_pixel_format(dst->format, [&](auto to_format) {
+			typedef decltype(to_format) To;
+			media_view_convert(media_frame_view<From>(src), media_frame_view<To>(dst));
+			return 0;
+		});
+	});
+}
+
+//Frame regions
+int media_frame_region(MediaFrameRegion* region, const AVFrame* frame) {
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+	if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL))) {
+		media_error_submit("Frame format cannot be addressed by pointer arithmetic!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	region->source = frame;
+	region->planes = av_pix_fmt_count_planes(static_cast<AVPixelFormat>(frame->format));
+	region->format = frame->format;
+	region->chroma_shift_x = desc->log2_chroma_w;
+	region->chroma_shift_y = desc->log2_chroma_h;
+	region->width = frame->width;
+	region->height = frame->height;
+	for (int plane = 0; plane < 4; plane++) {
+		region->data[plane] = plane < region->planes ? frame->data[plane] : NULL;
+		region->linesize[plane] = plane < region->planes ? frame->linesize[plane] : 0;
+		region->step[plane] = 0;
+	}
+	//Per pixel of the plane's own resolution. Packed 4:2:2 has chroma every 4 bytes but luma every 2, the luma step is the one a crop
+	//moves by, so the smallest step in each plane wins.
+	for (int i = 0; i < desc->nb_components; i++) {
+		int& step = region->step[desc->comp[i].plane];
+		step = step == 0 ? desc->comp[i].step : FFMIN(step, desc->comp[i].step);
+	}
+	return 0;
+}
+
+int media_frame_region_crop(MediaFrameRegion* region, int x, int y, int width, int height) {
+	x &= ~((1 << region->chroma_shift_x) - 1);
+	y &= ~((1 << region->chroma_shift_y) - 1);
+	if (x < 0 || y < 0 || x >= region->width || y >= region->height || width <= 0 || height <= 0) {
+		media_error_submit("Crop lies outside the region!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	for (int plane = 0; plane < region->planes; plane++) {
+		//Planes 1 and 2 carry chroma, alpha in plane 3 is full size.
+		bool chroma = plane == 1 || plane == 2;
+		int px = chroma ? x >> region->chroma_shift_x : x;
+		int py = chroma ? y >> region->chroma_shift_y : y;
+		region->data[plane] += py * region->linesize[plane] + px * region->step[plane];
+	}
+	region->width = FFMIN(width, region->width - x);
+	region->height = FFMIN(height, region->height - y);
+	return 0;
+}
+
+int media_frame_region_field(MediaFrameRegion* region, int bottom) {
+	bottom = bottom ? 1 : 0;
+	if (region->height < 2) {
+		media_error_submit("Region is too short to hold two fields!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	//Interlaced 4:2:0 stores chroma by field as well, so every plane skips alternate rows the same way.
+	for (int plane = 0; plane < region->planes; plane++) {
+		region->data[plane] += bottom * region->linesize[plane];
+		region->linesize[plane] *= 2;
+	}
+	region->height = (region->height + 1 - bottom) / 2;
+	return 0;
+}
+
+bool media_frame_region_aligned(const MediaFrameRegion* region, int alignment) {
+	if (alignment <= 1) {
+		return true;
+	}
+	for (int plane = 0; plane < region->planes; plane++) {
+		if (reinterpret_cast<uintptr_t>(region->data[plane]) % alignment != 0 || region->linesize[plane] % alignment != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int media_frame_region_to_frame(const MediaFrameRegion* region, AVFrame* out, int alignment) {
+	av_frame_unref(out);
+	bool field = region->linesize[0] != region->source->linesize[0];
+
+	//A frame without buffer references cannot be shared, av_frame_ref would copy it to new memory the region does not point into.
+	if (region->source->buf[0] && media_frame_region_aligned(region, alignment)) {
+		if (av_frame_ref(out, region->source) < 0) {
+			media_error_submit("Frame could not be referenced!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		for (int plane = 0; plane < 4; plane++) {
+			out->data[plane] = region->data[plane];
+			out->linesize[plane] = region->linesize[plane];
+		}
+		out->width = region->width;
+		out->height = region->height;
+		out->crop_top = out->crop_bottom = out->crop_left = out->crop_right = 0;
+		out->interlaced_frame = field ? 0 : out->interlaced_frame;
+		return 0;
+	}
+
+	out->format = region->format;
+	out->width = region->width;
+	out->height = region->height;
+	if (av_frame_get_buffer(out, FFMAX(alignment, 32)) < 0) {
+		media_error_submit("Region copy could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	av_image_copy(out->data, out->linesize, const_cast<const uint8_t**>(region->data), region->linesize,
+		static_cast<AVPixelFormat>(region->format), region->width, region->height);
+	av_frame_copy_props(out, region->source);
+	out->interlaced_frame = field ? 0 : out->interlaced_frame;
+	return 1;
+}
+
+//Compositing
+//d = (d * (256 - a) + s * a + 128) >> 8 with a from 0 to 256. The sum never leaves unsigned 16 bit, so logical shifts are enough.
+static void media_blend_row(uint8_t* d, const uint8_t* s, int count, int a) {
+	int x = 0;
+#ifdef MEDIA_HAVE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weight_s = _mm_set1_epi16(static_cast<short>(a));
+	const __m128i weight_d = _mm_set1_epi16(static_cast<short>(256 - a));
+	const __m128i round = _mm_set1_epi16(128);
+	for (; x + 16 <= count; x += 16) {
+		__m128i dv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + x));
+		__m128i sv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(dv, zero), weight_d), _mm_mullo_epi16(_mm_unpacklo_epi8(sv, zero), weight_s)), round);
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(dv, zero), weight_d), _mm_mullo_epi16(_mm_unpackhi_epi8(sv, zero), weight_s)), round);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+	for (; x < count; x++) {
+		d[x] = static_cast<uint8_t>((d[x] * (256 - a) + s[x] * a + 128) >> 8);
+	}
+}
+
+//Per pixel alpha scaled by the layer opacity (0 to 256) first, then mapped from 0-255 to 0-256 so opaque pixels replace exactly.
+static void media_blend_row_alpha(uint8_t* d, const uint8_t* s, const uint8_t* alpha, int count, int opacity) {
+	int x = 0;
+#ifdef MEDIA_HAVE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i scale = _mm_set1_epi16(static_cast<short>(opacity));
+	const __m128i full = _mm_set1_epi16(256);
+	const __m128i round = _mm_set1_epi16(128);
+	for (; x + 16 <= count; x += 16) {
+		__m128i dv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + x));
+		__m128i sv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+		__m128i av = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alpha + x));
+
+		__m128i a_lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(av, zero), scale), round), 8);
+		__m128i a_hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(av, zero), scale), round), 8);
+		a_lo = _mm_add_epi16(a_lo, _mm_srli_epi16(a_lo, 7));
+		a_hi = _mm_add_epi16(a_hi, _mm_srli_epi16(a_hi, 7));
+
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(dv, zero), _mm_sub_epi16(full, a_lo)), _mm_mullo_epi16(_mm_unpacklo_epi8(sv, zero), a_lo));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(dv, zero), _mm_sub_epi16(full, a_hi)), _mm_mullo_epi16(_mm_unpackhi_epi8(sv, zero), a_hi));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; x < count; x++) {
+		int a = (alpha[x] * opacity + 128) >> 8;
+		a += a >> 7;
+		d[x] = static_cast<uint8_t>((d[x] * (256 - a) + s[x] * a + 128) >> 8);
+	}
+}
+
+static void media_composite_band(MediaCompositor* compositor, AVFrame* out, int first, int last) {
+	for (int y = first; y < last; y++) {
+		memset(out->data[0] + y * out->linesize[0], compositor->background[0], out->width);
+	}
+	int chroma_width = (out->width + 1) / 2;
+	for (int cy = first / 2; cy < (last + 1) / 2; cy++) {
+		memset(out->data[1] + cy * out->linesize[1], compositor->background[1], chroma_width);
+		memset(out->data[2] + cy * out->linesize[2], compositor->background[2], chroma_width);
+	}
+
+	for (MediaCompositorLayer& layer : compositor->layers) {
+		const AVFrame* picture = layer.picture ? layer.picture : layer.frame;
+		int opacity = static_cast<int>(av_clipf(layer.opacity, 0.0f, 1.0f) * 256.0f + 0.5f);
+		if (!layer.visible || !picture || opacity == 0) {
+			continue;
+		}
+
+		//Clip the layer to the canvas and to this band, all edges on the chroma grid except the canvas' own odd edges.
+		int x0 = FFMAX(layer.x, 0);
+		int x1 = FFMIN(layer.x + layer.width, out->width);
+		int y0 = FFMAX(layer.y, first);
+		int y1 = FFMIN(layer.y + layer.height, last);
+		if (x0 >= x1 || y0 >= y1) {
+			continue;
+		}
+		bool has_alpha = !layer.alpha.empty();
+
+		for (int y = y0; y < y1; y++) {
+			uint8_t* d = out->data[0] + y * out->linesize[0] + x0;
+			const uint8_t* s = picture->data[0] + (y - layer.y) * picture->linesize[0] + (x0 - layer.x);
+			if (has_alpha) {
+				media_blend_row_alpha(d, s, &layer.alpha[(y - layer.y) * layer.width + (x0 - layer.x)], x1 - x0, opacity);
+			}
+			else {
+				media_blend_row(d, s, x1 - x0, opacity);
+			}
+		}
+
+		int layer_chroma_width = (layer.width + 1) / 2;
+		int cx0 = x0 / 2;
+		int cx1 = (x1 + 1) / 2;
+		for (int cy = y0 / 2; cy < (y1 + 1) / 2; cy++) {
+			int ly = cy - layer.y / 2;
+			for (int plane = 1; plane < 3; plane++) {
+				uint8_t* d = out->data[plane] + cy * out->linesize[plane] + cx0;
+				const uint8_t* s = picture->data[plane] + ly * picture->linesize[plane] + (cx0 - layer.x / 2);
+				if (has_alpha) {
+					media_blend_row_alpha(d, s, &layer.alpha_chroma[ly * layer_chroma_width + (cx0 - layer.x / 2)], cx1 - cx0, opacity);
+				}
+				else {
+					media_blend_row(d, s, cx1 - cx0, opacity);
+				}
+			}
+		}
+	}
+}
+
+static MediaCompositorLayer media_compositor_layer(int x, int y, int width, int height, float opacity) {
+	MediaCompositorLayer layer;
+	layer.x = x & ~1;
+	layer.y = y & ~1;
+	layer.width = width;
+	layer.height = height;
+	layer.opacity = opacity;
+	layer.visible = true;
+	layer.frame = NULL;
+	layer.picture = NULL;
+	layer.scaler = NULL;
+	return layer;
+}
+
+int malloc_media_compositor(MediaCompositor* compositor, int width, int height, int threads) {
+	compositor->width = width;
+	compositor->height = height;
+	compositor->threads = threads;
+	compositor->background[0] = 16;
+	compositor->background[1] = 128;
+	compositor->background[2] = 128;
+	compositor->layers.clear();
+	return 0;
+}
+
+void free_media_compositor(MediaCompositor* compositor) {
+	for (MediaCompositorLayer& layer : compositor->layers) {
+		av_frame_free(&layer.picture);
+		sws_freeContext(layer.scaler);
+	}
+	compositor->layers.clear();
+}
+
+int media_compositor_add_video(MediaCompositor* compositor, int x, int y, int width, int height, float opacity) {
+	if (width <= 0 || height <= 0) {
+		media_error_submit("Video layer needs a size!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	compositor->layers.push_back(media_compositor_layer(x, y, width, height, opacity));
+	return static_cast<int>(compositor->layers.size()) - 1;
+}
+
+//Stills are scaled and converted once here, rendering only blends them.
+int media_compositor_add_still(MediaCompositor* compositor, const char* path, int x, int y, int width, int height, float opacity) {
+	int image_width, image_height, components;
+	uint8_t* pixels = stbi_load(path, &image_width, &image_height, &components, 4);
+	if (!pixels) {
+		media_error_submit("Still image could not be loaded!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	MediaCompositorLayer layer = media_compositor_layer(x, y, width > 0 ? width : image_width, height > 0 ? height : image_height, opacity);
+	std::vector<uint8_t> rgba(static_cast<size_t>(layer.width) * layer.height * 4);
+	if (layer.width == image_width && layer.height == image_height) {
+		memcpy(rgba.data(), pixels, rgba.size());
+	}
+	else {
+		SwsContext* scaler = sws_getContext(image_width, image_height, AV_PIX_FMT_RGBA, layer.width, layer.height, AV_PIX_FMT_RGBA, SWS_BICUBIC, NULL, NULL, NULL);
+		if (!scaler) {
+			stbi_image_free(pixels);
+			media_error_submit("Still image could not be scaled!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		const uint8_t* src[4] = { pixels, NULL, NULL, NULL };
+		int src_stride[4] = { image_width * 4, 0, 0, 0 };
+		uint8_t* dst[4] = { rgba.data(), NULL, NULL, NULL };
+		int dst_stride[4] = { layer.width * 4, 0, 0, 0 };
+		sws_scale(scaler, src, src_stride, 0, image_height, dst, dst_stride);
+		sws_freeContext(scaler);
+	}
+	stbi_image_free(pixels);
+
+	layer.picture = av_frame_alloc();
+	layer.picture->format = AV_PIX_FMT_YUV420P;
+	layer.picture->width = layer.width;
+	layer.picture->height = layer.height;
+	if (av_frame_get_buffer(layer.picture, 32) < 0) {
+		av_frame_free(&layer.picture);
+		media_error_submit("Still image frame could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	media_rgba_to_yuv420p(rgba.data(), layer.width * 4, layer.width, layer.height, layer.picture);
+
+	//Alpha at chroma resolution is the mean of each 2x2 block, odd edges repeat the last pixel.
+	int chroma_width = (layer.width + 1) / 2;
+	int chroma_height = (layer.height + 1) / 2;
+	layer.alpha.resize(static_cast<size_t>(layer.width) * layer.height);
+	layer.alpha_chroma.resize(static_cast<size_t>(chroma_width) * chroma_height);
+	for (size_t i = 0; i < layer.alpha.size(); i++) {
+		layer.alpha[i] = rgba[i * 4 + 3];
+	}
+	for (int cy = 0; cy < chroma_height; cy++) {
+		for (int cx = 0; cx < chroma_width; cx++) {
+			int sum = 0;
+			for (int j = 0; j < 4; j++) {
+				int px = FFMIN(cx * 2 + (j & 1), layer.width - 1);
+				int py = FFMIN(cy * 2 + (j >> 1), layer.height - 1);
+				sum += layer.alpha[py * layer.width + px];
+			}
+			layer.alpha_chroma[cy * chroma_width + cx] = static_cast<uint8_t>((sum + 2) >> 2);
+		}
+	}
+
+	compositor->layers.push_back(layer);
+	return static_cast<int>(compositor->layers.size()) - 1;
+}
+
+int media_compositor_set_frame(MediaCompositor* compositor, int layer, const AVFrame* frame) {
+	if (layer < 0 || layer >= static_cast<int>(compositor->layers.size()) || !compositor->layers[layer].alpha.empty()) {
+		media_error_submit("Not a video layer of this compositor!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	compositor->layers[layer].frame = frame;
+	return 0;
+}
+
+int media_compositor_render(MediaCompositor* compositor, AVFrame* out) {
+	if (!out->buf[0]) {
+		out->format = AV_PIX_FMT_YUV420P;
+		out->width = compositor->width;
+		out->height = compositor->height;
+		if (av_frame_get_buffer(out, 32) < 0) {
+			media_error_submit("Canvas could not be allocated!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+	}
+	else if (out->format != AV_PIX_FMT_YUV420P || out->width != compositor->width || out->height != compositor->height ||
+		av_frame_make_writable(out) < 0) {
+		media_error_submit("Canvas must be a writable YUV420P frame of the compositor's size!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	//Video frames that do not fit the layer as they are get scaled first, each layer keeps its own cached scaler and picture.
+	for (MediaCompositorLayer& layer : compositor->layers) {
+		if (!layer.alpha.empty() || !layer.frame) {
+			continue;
+		}
+		const AVFrame* frame = layer.frame;
+		if (frame->format == AV_PIX_FMT_YUV420P && frame->width == layer.width && frame->height == layer.height) {
+			av_frame_free(&layer.picture);
+			continue;
+		}
+		layer.scaler = sws_getCachedContext(layer.scaler, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+			layer.width, layer.height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+		if (layer.picture && (layer.picture->width != layer.width || layer.picture->height != layer.height)) {
+			av_frame_free(&layer.picture);
+		}
+		if (!layer.picture) {
+			layer.picture = av_frame_alloc();
+			layer.picture->format = AV_PIX_FMT_YUV420P;
+			layer.picture->width = layer.width;
+			layer.picture->height = layer.height;
+			av_frame_get_buffer(layer.picture, 32);
+		}
+		if (!layer.scaler || !layer.picture->buf[0]) {
+			media_error_submit("Layer scaler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		sws_scale(layer.scaler, frame->data, frame->linesize, 0, frame->height, layer.picture->data, layer.picture->linesize);
+	}
+
+	media_run_bands(out->height, compositor->threads, 2, [&](int first, int last) {
+		media_composite_band(compositor, out, first, last);
+	});
+	return 0;
+}
+
+//Frame cache
+/*
+Decodes from the keyframe until the first frame of the next GOP shows up, so leading B frames that are stored after the next keyframe
+still land in this GOP. Frames before the keyframe, open GOP leftovers that reference the previous GOP, are dropped.
+*/
+int media_decode_gop(MediaContainer* media, int keyframe, std::vector<AVFrame*>& frames) {
+	if (media_build_keyframe_index(media) < 0) {
+		return -1;
+	}
+	const std::vector<MediaKeyframe>& keyframes = media->keyframe_index.keyframes;
+	if (keyframe < 0 || keyframe >= keyframes.size()) {
+		return -1;
+	}
+
+	AVFormatContext* fc = media->format_context;
+	AVCodecContext* decoder = media->codec_description.video_codec_context;
+	int64_t start = keyframes[keyframe].pts;
+	int64_t end = keyframe + 1 < keyframes.size() ? keyframes[keyframe + 1].pts : INT64_MAX;
+
+	if (av_seek_frame(fc, media->m_video_stream_index, keyframes[keyframe].timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+		media_error_submit("Seek to GOP failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	avcodec_flush_buffers(decoder);
+	if (media->codec_description.audio_codec_context) {
+		avcodec_flush_buffers(media->codec_description.audio_codec_context);
+	}
+	media->m_demux_eof = false;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	AVFrame* decoded = av_frame_alloc();
+	bool done = false;
+	bool eof = false;
+	bool failure = false;
+
+	while (!done && !failure) {
+		int r = avcodec_receive_frame(decoder, decoded);
+		if (r == 0) {
+			int64_t pts = decoded->best_effort_timestamp != AV_NOPTS_VALUE ? decoded->best_effort_timestamp : decoded->pts;
+			if (pts >= end) {
+				done = true;
+			}
+			else if (pts >= start) {
+				AVFrame* frame = av_frame_alloc();
+				av_frame_move_ref(frame, decoded);
+				frame->pts = pts;
+				frames.push_back(frame);
+			}
+			av_frame_unref(decoded);
+			continue;
+		}
+		if (r == AVERROR_EOF) {
+			break;
+		}
+		if (r != AVERROR(EAGAIN)) {
+			failure = true;
+			break;
+		}
+
+		if (av_read_frame(fc, &packet) < 0) {
+			eof = true;
+			avcodec_send_packet(decoder, NULL);
+			continue;
+		}
+		if (packet.stream_index == media->m_video_stream_index) {
+			r = avcodec_send_packet(decoder, &packet);
+			if (r < 0 && r != AVERROR_INVALIDDATA) {
+				failure = true;
+			}
+		}
+		av_packet_unref(&packet);
+	}
+
+	//A drained decoder refuses packets until flushed.
+	if (eof) {
+		avcodec_flush_buffers(decoder);
+	}
+	av_frame_free(&decoded);
+
+	std::sort(frames.begin(), frames.end(), [](const AVFrame* a, const AVFrame* b) { return a->pts < b->pts; });
+	if (failure) {
+		media_error_submit("GOP could not be decoded!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+static std::list<MediaFrameCacheGop>::iterator media_frame_cache_find(MediaFrameCache* cache, MediaContainer* media, int keyframe) {
+	return std::find_if(cache->gops.begin(), cache->gops.end(), [&](const MediaFrameCacheGop& gop) { return gop.media == media && gop.keyframe == keyframe; });
+}
+
+static void media_frame_cache_free_gop(MediaFrameCacheGop& gop) {
+	for (AVFrame* frame : gop.frames) {
+		av_frame_free(&frame);
+	}
+	gop.frames.clear();
+}
+
+//Frame shown at pts within a GOP's display ordered frames.
+static AVFrame* media_frame_cache_pick(const std::vector<AVFrame*>& frames, int64_t pts) {
+	auto shown = std::upper_bound(frames.begin(), frames.end(), pts, [](int64_t value, const AVFrame* f) { return value < f->pts; });
+	return shown == frames.begin() ? frames.front() : *(shown - 1);
+}
+
+/*
+Decodes a GOP unless someone else got to it first. Holds decode_lock for the whole decode, the GOP list only for the insert. With out
+set the frame shown at pts is referenced into it. A GOP larger than the whole budget is never cached, it only serves that one frame
+and is freed again, so long high resolution GOPs cannot push the cache past its budget.
+*/
+static int media_frame_cache_load(MediaFrameCache* cache, MediaContainer* media, int keyframe, int64_t pts, AVFrame* out) {
+	std::lock_guard<std::mutex> decode(cache->decode_lock);
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		auto it = media_frame_cache_find(cache, media, keyframe);
+		if (it != cache->gops.end()) {
+			if (out) {
+				cache->gops.splice(cache->gops.begin(), cache->gops, it);
+				av_frame_unref(out);
+				return av_frame_ref(out, media_frame_cache_pick(it->frames, pts)) == 0 ? 0 : -1;
+			}
+			return 0;
+		}
+	}
+
+	MediaFrameCacheGop gop;
+	gop.media = media;
+	gop.keyframe = keyframe;
+	gop.bytes = 0;
+	if (media_decode_gop(media, keyframe, gop.frames) < 0 || gop.frames.empty()) {
+		media_frame_cache_free_gop(gop);
+		return -1;
+	}
+	for (AVFrame* frame : gop.frames) {
+		for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+			gop.bytes += frame->buf[i]->size;
+		}
+	}
+
+	int result = 0;
+	if (out) {
+		av_frame_unref(out);
+		result = av_frame_ref(out, media_frame_cache_pick(gop.frames, pts)) == 0 ? 0 : -1;
+	}
+
+	std::lock_guard<std::mutex> guard(cache->lock);
+	if (gop.bytes > cache->budget) {
+		media_frame_cache_free_gop(gop);
+		cache->oversized++;
+		return result;
+	}
+
+	cache->gops.push_front(gop);
+	cache->used += gop.bytes;
+	if (!out) {
+		cache->prefetched++;
+	}
+	//The new GOP fits on its own, so eviction never reaches it.
+	while (cache->used > cache->budget) {
+		MediaFrameCacheGop& victim = cache->gops.back();
+		cache->used -= victim.bytes;
+		media_frame_cache_free_gop(victim);
+		cache->gops.pop_back();
+		cache->evictions++;
+	}
+	return result;
+}
+
+static void media_frame_cache_worker(MediaFrameCache* cache) {
+	while (true) {
+		std::pair<MediaContainer*, int> job;
+		{
+			std::unique_lock<std::mutex> guard(cache->lock);
+			cache->wake.wait(guard, [&]() { return cache->stop || !cache->prefetch_queue.empty(); });
+			if (cache->stop) {
+				return;
+			}
+			job = cache->prefetch_queue.front();
+			cache->prefetch_queue.pop_front();
+		}
+		media_frame_cache_load(cache, job.first, job.second, 0, NULL);
+	}
+}
+
+int malloc_media_frame_cache(MediaFrameCache* cache, int64_t budget, int prefetch_gops) {
+	cache->budget = budget;
+	cache->prefetch_gops = prefetch_gops;
+	cache->used = 0;
+	cache->gops.clear();
+	cache->prefetch_queue.clear();
+	cache->stop = false;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+	cache->prefetched = 0;
+	cache->oversized = 0;
+	cache->worker = std::thread(media_frame_cache_worker, cache);
+	return 0;
+}
+
+void free_media_frame_cache(MediaFrameCache* cache) {
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		cache->stop = true;
+		cache->prefetch_queue.clear();
+	}
+	cache->wake.notify_all();
+	if (cache->worker.joinable()) {
+		cache->worker.join();
+	}
+
+	for (MediaFrameCacheGop& gop : cache->gops) {
+		media_frame_cache_free_gop(gop);
+	}
+	cache->gops.clear();
+	cache->used = 0;
+}
+
+//Takes a reference to the frame shown at pts if its GOP is cached, marks the GOP as recently used.
+static bool media_frame_cache_lookup(MediaFrameCache* cache, MediaContainer* media, int keyframe, int64_t pts, AVFrame* out) {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	auto it = media_frame_cache_find(cache, media, keyframe);
+	if (it == cache->gops.end()) {
+		return false;
+	}
+	cache->gops.splice(cache->gops.begin(), cache->gops, it);
+
+	av_frame_unref(out);
+	return av_frame_ref(out, media_frame_cache_pick(it->frames, pts)) == 0;
+}
+
+int media_frame_cache_get(MediaFrameCache* cache, MediaContainer* media, int64_t pts, MediaFrame* frame) {
+	int keyframes;
+	{
+		//Building the index reads the file, the prefetch thread may be doing the same on this container.
+		std::lock_guard<std::mutex> decode(cache->decode_lock);
+		if (media_build_keyframe_index(media) < 0) {
+			return -1;
+		}
+		keyframes = media->keyframe_index.keyframes.size();
+	}
+	int keyframe = FFMAX(media_keyframe_at_or_before(media, pts), 0);
+
+	bool hit = media_frame_cache_lookup(cache, media, keyframe, pts, frame->video_frame);
+	if (!hit) {
+		if (media_frame_cache_load(cache, media, keyframe, pts, frame->video_frame) < 0) {
+			return -1;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		if (hit) {
+			cache->hits++;
+		}
+		else {
+			cache->misses++;
+		}
+
+		for (int i = 1; i <= cache->prefetch_gops && keyframe + i < keyframes; i++) {
+			std::pair<MediaContainer*, int> job(media, keyframe + i);
+			if (media_frame_cache_find(cache, media, keyframe + i) == cache->gops.end() &&
+				std::find(cache->prefetch_queue.begin(), cache->prefetch_queue.end(), job) == cache->prefetch_queue.end()) {
+				cache->prefetch_queue.push_back(job);
+			}
+		}
+	}
+	cache->wake.notify_one();
+
+	frame->frame_pts = frame->video_frame->pts;
+	retrieve_pts_seconds(media, frame);
+	return 0;
+}
+
+//Trick play
+//Decodes the next keyframe packet on its own and drains the decoder, so no reorder delay holds the picture back. Without seek the
+//demuxer is expected to already sit just before the keyframe.
+static int media_decode_keyframe(MediaContainer* media, int keyframe, bool seek, AVPacket* packet, AVFrame* out) {
+	AVCodecContext* decoder = media->codec_description.video_codec_context;
+	if (seek && av_seek_frame(media->format_context, media->m_video_stream_index, media->keyframe_index.keyframes[keyframe].timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+		media_error_submit("Keyframe seek failed!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	bool decoded = false;
+	while (!decoded && av_read_frame(media->format_context, packet) >= 0) {
+		if (packet->stream_index == media->m_video_stream_index && (packet->flags & AV_PKT_FLAG_KEY)) {
+			avcodec_flush_buffers(decoder);
+			if (avcodec_send_packet(decoder, packet) == 0) {
+				avcodec_send_packet(decoder, NULL);
+				decoded = avcodec_receive_frame(decoder, out) == 0;
+			}
+		}
+		av_packet_unref(packet);
+	}
+	avcodec_flush_buffers(decoder);
+	return decoded ? 0 : -1;
+}
+
+int media_trickplay_start(MediaContainer* media, MediaTrickPlay* trick, double speed, double display_interval, int64_t start_pts) {
+	if (speed <= 0 || media_build_keyframe_index(media) < 0) {
+		media_error_submit("Trick play needs a positive speed and a keyframe index!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	const std::vector<MediaKeyframe>& keyframes = media->keyframe_index.keyframes;
+	trick->speed = speed;
+	trick->display_interval = display_interval;
+	trick->time_base = media->format_context->streams[media->m_video_stream_index]->time_base;
+	trick->next_keyframe = -1; //Forces the first frame to seek.
+	trick->presentation_seconds = 0;
+
+	int first = FFMAX(media_keyframe_at_or_before(media, start_pts), 0);
+	trick->start_pts = keyframes[first].pts;
+	trick->last_pts = AV_NOPTS_VALUE;
+
+	//Demuxers that honour discard never hand out the other packets, for the rest they are skipped before the decoder.
+	media->format_context->streams[media->m_video_stream_index]->discard = AVDISCARD_NONKEY;
+	if (media->m_audio_stream_index >= 0) {
+		media->format_context->streams[media->m_audio_stream_index]->discard = AVDISCARD_ALL;
+	}
+	media->codec_description.video_codec_context->skip_frame = AVDISCARD_NONKEY;
+	return 0;
+}
+
+int media_trickplay_next_frame(MediaContainer* media, MediaTrickPlay* trick, MediaFrame* frame) {
+	const std::vector<MediaKeyframe>& keyframes = media->keyframe_index.keyframes;
+
+	//First keyframe at or past where the playhead should be by the next display refresh, never going backwards.
+	int64_t target = trick->start_pts;
+	if (trick->last_pts != AV_NOPTS_VALUE) {
+		target = trick->last_pts + av_rescale_q(static_cast<int64_t>(trick->speed * trick->display_interval * AV_TIME_BASE), AV_TIME_BASE_Q, trick->time_base);
+	}
+	int keyframe = media_keyframe_at_or_before(media, target);
+	if (keyframe < 0 || keyframes[keyframe].pts < target) {
+		keyframe++;
+	}
+	keyframe = FFMAX(keyframe, trick->next_keyframe);
+	if (keyframe >= keyframes.size()) {
+		return -1;
+	}
+
+	if (media_decode_keyframe(media, keyframe, keyframe != trick->next_keyframe, frame->t_current_packet, frame->video_frame) < 0) {
+		return -1;
+	}
+
+	int64_t pts = frame->video_frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->video_frame->best_effort_timestamp : frame->video_frame->pts;
+	trick->last_pts = pts;
+	trick->next_keyframe = FFMAX(media_keyframe_at_or_before(media, pts), keyframe) + 1;
+	trick->presentation_seconds = (pts - trick->start_pts) * av_q2d(trick->time_base) / trick->speed;
+
+	frame->frame_pts = pts;
+	retrieve_pts_seconds(media, frame);
+	return 0;
+}
+
+void media_trickplay_stop(MediaContainer* media, MediaTrickPlay* trick) {
+	media->format_context->streams[media->m_video_stream_index]->discard = AVDISCARD_DEFAULT;
+	if (media->m_audio_stream_index >= 0) {
+		media->format_context->streams[media->m_audio_stream_index]->discard = AVDISCARD_DEFAULT;
+	}
+	media->codec_description.video_codec_context->skip_frame = AVDISCARD_DEFAULT;
+	media_set_decode_quality(media, media->m_decode_quality);
+	//The demuxer already sits on the next keyframe, normal playback picks up from the last frame shown instead.
+	if (trick->last_pts != AV_NOPTS_VALUE) {
+		int keyframe = FFMAX(media_keyframe_at_or_before(media, trick->last_pts), 0);
+		av_seek_frame(media->format_context, media->m_video_stream_index, media->keyframe_index.keyframes[keyframe].timestamp, AVSEEK_FLAG_BACKWARD);
+	}
+	avcodec_flush_buffers(media->codec_description.video_codec_context);
+	if (media->codec_description.audio_codec_context) {
+		avcodec_flush_buffers(media->codec_description.audio_codec_context);
+	}
+	media->m_demux_eof = false;
+}
+
+//Reverse iteration
+static void media_reverse_free_frames(std::vector<AVFrame*>& frames) {
+	for (AVFrame* frame : frames) {
+		av_frame_free(&frame);
+	}
+	frames.clear();
+}
+
+static void media_reverse_prefetch(MediaReverseIterator* iterator) {
+	int keyframe = iterator->keyframe - 1;
+	if (keyframe < 0) {
+		return;
+	}
+	iterator->prefetch_failed = false;
+	iterator->worker = std::thread([iterator, keyframe]() {
+		iterator->prefetch_failed = media_decode_gop(iterator->media, keyframe, iterator->prefetched) < 0;
+	});
+}
+
+int malloc_media_reverse_iterator(MediaReverseIterator* iterator, MediaContainer* media, int64_t start_pts) {
+	iterator->media = media;
+	iterator->frames.clear();
+	iterator->prefetched.clear();
+	iterator->prefetch_failed = false;
+
+	if (media_build_keyframe_index(media) < 0) {
+		return -1;
+	}
+	iterator->keyframe = FFMAX(media_keyframe_at_or_before(media, start_pts), 0);
+	if (media_decode_gop(media, iterator->keyframe, iterator->frames) < 0) {
+		media_reverse_free_frames(iterator->frames);
+		return -1;
+	}
+
+	//Frames after start_pts are not part of the walk, but the one shown at start_pts is.
+	while (iterator->frames.size() > 1 && iterator->frames[iterator->frames.size() - 2]->pts >= start_pts) {
+		av_frame_free(&iterator->frames.back());
+		iterator->frames.pop_back();
+	}
+
+	media_reverse_prefetch(iterator);
+	return 0;
+}
+
+void free_media_reverse_iterator(MediaReverseIterator* iterator) {
+	if (iterator->worker.joinable()) {
+		iterator->worker.join();
+	}
+	media_reverse_free_frames(iterator->frames);
+	media_reverse_free_frames(iterator->prefetched);
+}
+
+int media_reverse_next_frame(MediaReverseIterator* iterator, MediaFrame* frame) {
+	if (iterator->frames.empty()) {
+		if (!iterator->worker.joinable()) {
+			//Nothing in flight, the first GOP has been handed out.
+			return -1;
+		}
+		iterator->worker.join();
+		if (iterator->prefetch_failed) {
+			media_reverse_free_frames(iterator->prefetched);
+			return -1;
+		}
+		iterator->frames.swap(iterator->prefetched);
+		iterator->keyframe--;
+		media_reverse_prefetch(iterator);
+
+		if (iterator->frames.empty()) {
+			return -1;
+		}
+	}
+
+	AVFrame* next = iterator->frames.back();
+	iterator->frames.pop_back();
+	av_frame_unref(frame->video_frame);
+	av_frame_move_ref(frame->video_frame, next);
+	av_frame_free(&next);
+
+	frame->frame_pts = frame->video_frame->pts;
+	retrieve_pts_seconds(iterator->media, frame);
+	return 0;
+}
+
+//Rendition ladder
+
+int malloc_media_rendition_ladder(MediaRenditionLadder* ladder, MediaContainer* input, int queue_capacity) {
+	if (input->type != MEDIA_FILE_INPUT || input->m_video_stream_index < 0) {
+		media_error_submit("Rendition ladder needs an opened input container!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	ladder->input = input;
+	ladder->queue_capacity = queue_capacity > 0 ? queue_capacity : 8;
+	return 0;
+}
+
+void free_media_rendition_ladder(MediaRenditionLadder* ladder) {
+	//Output containers belong to the caller, only the rungs are ours.
+	for (MediaRendition* rung : ladder->rungs) {
+		for (MediaRenditionItem& item : rung->queue) {
+			av_frame_free(&item.frame);
+		}
+		sws_freeContext(rung->scale_context);
+		delete rung;
+	}
+	ladder->rungs.clear();
+}
+
+int media_rendition_ladder_add(MediaRenditionLadder* ladder, MediaContainer* output) {
+	if (output->type != MEDIA_FILE_OUTPUT || !output->codec_description.video_codec_context) {
+		media_error_submit("Rendition output must be populated with populate_codecs_user first!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	MediaRendition* rung = new MediaRendition;
+	rung->output = output;
+	rung->parent = -1;
+	rung->scale_context = NULL;
+	rung->frames_encoded = 0;
+	rung->failure = false;
+
+	ladder->rungs.push_back(rung);
+	return static_cast<int>(ladder->rungs.size()) - 1;
+}
+
+static void media_rendition_push(MediaRenditionLadder* ladder, MediaRendition* rung, MediaRenditionItem item) {
+	std::unique_lock<std::mutex> lock(rung->queue_lock);
+	//End of stream markers are never held back, a stalled rung must still be able to exit.
+	rung->queue_signal.wait(lock, [&] { return item.frame == NULL || rung->queue.size() < ladder->queue_capacity; });
+	rung->queue.push_back(item);
+	rung->queue_signal.notify_all();
+}
+
+static MediaRenditionItem media_rendition_pop(MediaRendition* rung) {
+	std::unique_lock<std::mutex> lock(rung->queue_lock);
+	rung->queue_signal.wait(lock, [&] { return !rung->queue.empty(); });
+	MediaRenditionItem item = rung->queue.front();
+	rung->queue.pop_front();
+	rung->queue_signal.notify_all();
+	return item;
+}
+
+//Each rung scales from the smallest rung that is still at least as large as itself, so the source is only downscaled once per step.
+static void media_rendition_ladder_plan(MediaRenditionLadder* ladder) {
+	int source_width = ladder->input->m_width;
+	int source_height = ladder->input->m_height;
+
+	for (MediaRendition* rung : ladder->rungs) {
+		rung->parent = -1;
+		rung->children.clear();
+	}
+
+	for (int i = 0; i < ladder->rungs.size(); i++) {
+		MediaContainer* out_i = ladder->rungs[i]->output;
+		long area_i = (long)out_i->m_width * out_i->m_height;
+		long best_area = 0;
+
+		for (int j = 0; j < ladder->rungs.size(); j++) {
+			MediaContainer* out_j = ladder->rungs[j]->output;
+			long area_j = (long)out_j->m_width * out_j->m_height;
+			if (j == i || out_j->m_width < out_i->m_width || out_j->m_height < out_i->m_height) {
+				continue;
+			}
+			//Never scale from an upscaled rung, and break ties between equal sizes by index so the graph has no cycles.
+			if (out_j->m_width > source_width || out_j->m_height > source_height) {
+				continue;
+			}
+			if (area_j == area_i && j > i) {
+				continue;
+			}
+			if (ladder->rungs[i]->parent == -1 || area_j < best_area) {
+				ladder->rungs[i]->parent = j;
+				best_area = area_j;
+			}
+		}
+
+		if (ladder->rungs[i]->parent != -1) {
+			ladder->rungs[ladder->rungs[i]->parent]->children.push_back(i);
+		}
+	}
+}
+
+static void media_rendition_worker(MediaRenditionLadder* ladder, int index) {
+	MediaRendition* rung = ladder->rungs[index];
+	MediaContainer* input = ladder->input;
+	MediaContainer* output = rung->output;
+
+	AVRational video_from = input->format_context->streams[input->m_video_stream_index]->time_base;
+	AVRational video_to = output->format_context->streams[output->m_video_stream_index]->time_base;
+	AVRational audio_from = { 0, 1 };
+	AVRational audio_to = { 0, 1 };
+	bool has_audio = input->m_audio_stream_index >= 0 && output->m_audio_stream_index >= 0;
+
+	//Decoded audio rarely matches the rung's encoder (format, rate, frame size), every rung converts its own copy.
+	MediaAudioConverter converter;
+	if (has_audio) {
+		audio_from = input->format_context->streams[input->m_audio_stream_index]->time_base;
+		audio_to = output->format_context->streams[output->m_audio_stream_index]->time_base;
+		if (malloc_media_audio_converter(&converter, output->codec_description.audio_codec_context) < 0) {
+			rung->failure = true;
+			has_audio = false;
+		}
+	}
+
+	//Encoders only look at the frame pointers, no need to allocate a full MediaFrame here.
+	MediaFrame frame;
+	frame.video_frame = NULL;
+	frame.audio_frame = av_frame_alloc();
+	std::vector<MediaPacket> packets;
+
+	while (true) {
+		MediaRenditionItem item = media_rendition_pop(rung);
+		if (item.frame == NULL) {
+			break;
+		}
+
+		if (item.type == AVMEDIA_TYPE_VIDEO) {
+			AVFrame* scaled = item.frame;
+			AVPixelFormat out_fmt = static_cast<AVPixelFormat>(output->codec_description.m_pix_fmt);
+
+			if (!rung->failure && (scaled->width != output->m_width || scaled->height != output->m_height || scaled->format != out_fmt)) {
+				rung->scale_context = sws_getCachedContext(rung->scale_context, item.frame->width, item.frame->height, static_cast<AVPixelFormat>(item.frame->format),
+					output->m_width, output->m_height, out_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+
+				scaled = av_frame_alloc();
+				scaled->width = output->m_width;
+				scaled->height = output->m_height;
+				scaled->format = out_fmt;
+				if (!rung->scale_context || av_frame_get_buffer(scaled, 32) < 0) {
+					media_error_submit("Rendition scaler could not be created!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+					rung->failure = true;
+				}
+				else {
+					sws_scale(rung->scale_context, item.frame->data, item.frame->linesize, 0, item.frame->height, scaled->data, scaled->linesize);
+					av_frame_copy_props(scaled, item.frame);
+				}
+				av_frame_free(&item.frame);
+			}
+
+			if (!rung->failure) {
+				//Children get a new reference to the same buffers, the downscale is shared rather than copied.
+				for (int child : rung->children) {
+					media_rendition_push(ladder, ladder->rungs[child], { av_frame_clone(scaled), AVMEDIA_TYPE_VIDEO });
+				}
+
+				//Let the encoder place its own keyframes instead of copying the source GOP structure.
+				scaled->pict_type = AV_PICTURE_TYPE_NONE;
+				frame.video_frame = scaled;
+				int encoded = encode_next_frame_video(output, &frame, packets, video_from, video_to);
+				if (encoded < 0) {
+					rung->failure = true;
+				}
+				else if (encoded > 0) {
+					rung->frames_encoded += packets.size();
+					if (open_media_write_packets(output, packets) < 0) {
+						rung->failure = true;
+					}
+				}
+			}
+			av_frame_free(&scaled);
+		}
+		else {
+			if (!rung->failure && has_audio) {
+				if (media_audio_converter_submit(&converter, item.frame, audio_from) < 0) {
+					rung->failure = true;
+				}
+				while (!rung->failure && media_audio_converter_receive(&converter, frame.audio_frame, false) == 0) {
+					if (encode_next_frame_audio(output, &frame, packets, converter.encoder->time_base, audio_to) < 0) {
+						rung->failure = true;
+					}
+				}
+				if (!packets.empty() && open_media_write_packets(output, packets) < 0) {
+					rung->failure = true;
+				}
+			}
+			av_frame_free(&item.frame);
+		}
+	}
+
+	if (!rung->failure) {
+		int flushed = encode_flush_video(output, packets, video_from, video_to);
+		if (flushed < 0) {
+			rung->failure = true;
+		}
+		rung->frames_encoded += FFMAX(flushed, 0);
+		if (has_audio) {
+			media_audio_converter_submit(&converter, NULL, audio_from);
+			while (!rung->failure && media_audio_converter_receive(&converter, frame.audio_frame, true) == 0) {
+				if (encode_next_frame_audio(output, &frame, packets, converter.encoder->time_base, audio_to) < 0) {
+					rung->failure = true;
+				}
+			}
+			if (encode_flush_audio(output, packets, converter.encoder->time_base, audio_to) < 0) {
+				rung->failure = true;
+			}
+		}
+		if (open_media_write_packets(output, packets) < 0) {
+			rung->failure = true;
+		}
+	}
+
+	if (has_audio) {
+		free_media_audio_converter(&converter);
+	}
+	av_frame_free(&frame.audio_frame);
+
+	for (int child : rung->children) {
+		media_rendition_push(ladder, ladder->rungs[child], { NULL, AVMEDIA_TYPE_VIDEO });
+	}
+}
+
+int media_rendition_ladder_run(MediaRenditionLadder* ladder) {
+	if (ladder->rungs.empty()) {
+		media_error_submit("Rendition ladder has no outputs!", __FILE__, MEDIA_ERROR_WARNING, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	media_rendition_ladder_plan(ladder);
+
+	for (int i = 0; i < ladder->rungs.size(); i++) {
+		ladder->rungs[i]->worker = std::thread(media_rendition_worker, ladder, i);
+	}
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+	AVMediaType type;
+
+	//The only decode of the source, everything past this point works on refcounted copies.
+	while (decode_next_frame_any(ladder->input, &frame, &type) == 0) {
+		for (MediaRendition* rung : ladder->rungs) {
+			if (type == AVMEDIA_TYPE_VIDEO && rung->parent == -1) {
+				media_rendition_push(ladder, rung, { av_frame_clone(frame.video_frame), AVMEDIA_TYPE_VIDEO });
+			}
+			else if (type == AVMEDIA_TYPE_AUDIO) {
+				media_rendition_push(ladder, rung, { av_frame_clone(frame.audio_frame), AVMEDIA_TYPE_AUDIO });
+			}
+		}
+	}
+
+	//Child rungs are terminated by their parents once the parent queue is empty.
+	for (MediaRendition* rung : ladder->rungs) {
+		if (rung->parent == -1) {
+			media_rendition_push(ladder, rung, { NULL, AVMEDIA_TYPE_VIDEO });
+		}
+	}
+
+	bool failure = false;
+	for (MediaRendition* rung : ladder->rungs) {
+		rung->worker.join();
+		failure = failure || rung->failure;
+	}
+
+	free_media_frame(&frame);
+
+	if (!failure) {
+		return 0;
+	}
+	else {
+		return -1;
+	}
+}
@@ -4,7 +4,16 @@
 #include <cassert>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <list>
+#include <map>
 #include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
 
 #define WINDOWS_SYSTEM
 
@@ -26,6 +35,11 @@ static void media_error_submit(std::string message, std::string source, int leve
 }
 
 #else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #define MEDIA_ERROR_CRITICAL 0xF
 #define MEDIA_ERROR_WARNING  0xE
 
@@ -46,6 +60,14 @@ extern "C" {
 #include <ffmpeg/include/libavcodec/avcodec.h>
 #include <ffmpeg/include/libavformat/avformat.h>
 #include <ffmpeg/include/libswscale/swscale.h>
+#include <ffmpeg/include/libavutil/opt.h>
+#include <ffmpeg/include/libavutil/audio_fifo.h>
+#include <ffmpeg/include/libavutil/imgutils.h>
+#include <ffmpeg/include/libavutil/pixdesc.h>
+#include <ffmpeg/include/libswresample/swresample.h>
+#include <ffmpeg/include/libavfilter/avfilter.h>
+#include <ffmpeg/include/libavfilter/buffersrc.h>
+#include <ffmpeg/include/libavfilter/buffersink.h>
 }
 
 //It takes much longer to decode 265 than 264.
@@ -62,6 +84,42 @@ enum media_type {
 	MEDIA_STREAM_FILE = 3,
 };
 
+enum media_encoder_profile {
+	MEDIA_ENCODER_PROFILE_DEFAULT = 0,    //Codec defaults, same as passing no options.
+	MEDIA_ENCODER_PROFILE_THROUGHPUT = 1, //Batch work, fast preset and frame threads.
+	MEDIA_ENCODER_PROFILE_ARCHIVE = 2,    //Slow preset, constant quality.
+	MEDIA_ENCODER_PROFILE_REALTIME = 3,   //Live, zero latency, no B frames, intra refresh and slice threads.
+};
+
+//Decoder shortcuts for previews and analysis, each step trades more picture quality for speed. Resolution is only reduced for codecs
+//with lowres support, H.264 and HEVC decode at full size whatever the preset.
+enum media_decode_quality {
+	MEDIA_DECODE_QUALITY_FULL = 0,      //Every frame, bit exact.
+	MEDIA_DECODE_QUALITY_FAST = 1,      //Non spec compliant shortcuts, no loop filter on non reference frames.
+	MEDIA_DECODE_QUALITY_PREVIEW = 2,   //No loop filter, non reference frames dropped, half resolution.
+	MEDIA_DECODE_QUALITY_KEYFRAMES = 3, //Keyframes only, quarter resolution.
+};
+
+//Negative numbers and empty strings leave the codec default in place. Options a codec does not know are reported and skipped.
+typedef struct {
+	media_encoder_profile profile;
+
+	std::string preset; //x264/x265 preset names, translated to deadline / cpu-used for libvpx.
+	std::string tune;
+	int crf;
+	int gop_size;
+	int max_b_frames;
+	int lookahead;
+	int threads; //0 lets the codec pick.
+	int thread_type; //FF_THREAD_FRAME or FF_THREAD_SLICE, 0 codec default.
+	bool intra_refresh;
+	AVRational time_base; //Video encoder and stream time base, num 0 falls back to 1 / timebase_den.
+
+	int audio_bitrate;
+	int audio_channels;
+	int audio_threads;
+}MediaEncoderOptions;
+
 typedef struct {
 	AVCodecParameters* video_cparam;
 	AVCodecParameters* audio_cparam;
@@ -83,6 +141,8 @@ typedef struct {
 
 	int m_audio_sample_rate;
 
+	MediaEncoderOptions m_encoder_options; //Options the encoders were opened with, only meaningful for user populated containers.
+
 }MediaCodecDescriptor;
 
 typedef struct {
@@ -93,6 +153,19 @@ typedef struct {
 	int audio_sample_rate;
 }MediaTime;
 
+typedef struct {
+	int64_t pts;
+	int64_t timestamp; //What av_seek_frame expects for this entry, the demuxer index may store dts.
+	int64_t pos;
+}MediaKeyframe;
+
+//Video keyframe positions, built once per container so repeated seeks and trims never rescan the file.
+typedef struct {
+	std::vector<MediaKeyframe> keyframes; //Sorted by pts, video stream time base.
+	int64_t end_pts;
+	bool built;
+}MediaKeyframeIndex;
+
 typedef struct {
 	media_type type;
 
@@ -110,6 +183,12 @@ typedef struct {
 
 	int m_fps;
 
+	bool m_demux_eof; //Set once av_read_frame runs dry and the decoders have been put into draining mode.
+
+	media_decode_quality m_decode_quality;
+
+	MediaKeyframeIndex keyframe_index;
+
 }MediaContainer;
 
 typedef struct {
@@ -126,7 +205,7 @@ typedef struct {
 
 typedef struct {
 	AVPacket* packet;
-	long pts;
+	int64_t pts;
 }MediaPacket;
 
 typedef AVRational MediaRational;
@@ -173,31 +252,662 @@ struct rtp_raw_frame {
 
 };
 
+enum media_buffer_overflow {
+	MEDIA_BUFFER_BLOCK = 0,  //Producers wait until the consumer has made room.
+	MEDIA_BUFFER_SIGNAL = 1, //Submit is refused and backed_up is set, the producer decides what to do.
+	MEDIA_BUFFER_SPILL = 2,  //Packet data goes to a memory mapped file, only the packet properties stay in memory.
+};
+
+typedef struct {
+	int64_t offset;
+	int size;
+	bool released; //Read back, its space is reclaimed by the next compaction.
+}MediaSpillRecord;
+
+//Packet data appended to a memory mapped file. Video and audio are read back in any order, when the end is reached the records still
+//waiting are compacted to the front. The file only grows when they fill more than half of it, so it tracks the backlog, not the job.
+typedef struct {
+	std::string path;
+#ifdef WINDOWS_SYSTEM
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+	uint8_t* base;
+	int64_t capacity;
+	int64_t write_offset;
+	int64_t live_bytes; //Spilled and not read back yet.
+	std::deque<MediaSpillRecord> records; //Write order (and offset order), from the oldest unreleased record on.
+	int64_t first_record;
+	int pending;
+}MediaSpillFile;
+
+typedef struct {
+	MediaPacket packet; //While spilled the AVPacket only holds properties and side data.
+	int64_t spill_record; //Record number in the spill file, -1 when the data is in memory.
+	int spill_size;
+}MediaBufferEntry;
+
 typedef struct {
 	AVRational time_base;
+	AVRational packet_time_base; //What submitted packets are stamped in, defaults to time_base.
 	int m_fps;
 
-	std::deque<MediaPacket> stack_buffer_video;
-	std::deque<MediaPacket> stack_buffer_audio;
+	std::deque<MediaBufferEntry> stack_buffer_video;
+	std::deque<MediaBufferEntry> stack_buffer_audio;
 
-	float last_frame_pts_video;
-	float last_frame_pts_audio;
+	//Timestamps are frame counts scaled by the per stream frame duration, so they never drift however long the stream runs.
+	AVRational video_frame_duration;
+	AVRational audio_frame_duration;
+	int64_t video_frames_submitted;
+	int64_t audio_frames_submitted;
+
+	media_buffer_overflow overflow;
+	size_t max_packets; //0 means unbounded.
+	size_t max_bytes;   //0 means unbounded.
+	size_t held_packets; //Only packets whose data is in memory count towards the budget.
+	size_t held_bytes;
+	MediaSpillFile spill;
+
+	std::mutex lock;
+	std::condition_variable signal;
 
 	bool backed_up;
 }MediaFileStreamingBuffer;
 
+//Plain worker pool for jobs that fan out over files and timestamps. Tasks may submit further tasks.
+typedef struct {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	int running;
+	bool stop;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable idle;
+}MediaThreadPool;
+
+enum media_image_format {
+	MEDIA_IMAGE_JPEG = 0,
+	MEDIA_IMAGE_PNG = 1,
+};
+
+//Open image encoder for one frame size, reused for every frame of that size.
+typedef struct {
+	AVCodecContext* ctx;
+	SwsContext* scaler; //Decoded pixel format to the encoder's, same size.
+	AVFrame* converted;
+}MediaImageEncoder;
+
+typedef struct {
+	std::string path;
+	AVPacket* packet;
+}MediaImageWrite;
+
+//Frames are encoded on a pool with warm encoders and the files written by a single writer thread. Export only blocks when too many
+//frames are in flight, which bounds memory when decoding outruns the disk.
+typedef struct {
+	media_image_format format;
+	std::string directory;
+	std::string pattern; //printf style name with one integer for the frame number, the extension is added.
+	int quality; //JPEG qscale, 2 best to 31 worst.
+
+	MediaThreadPool encode_pool;
+	std::mutex encoders_lock;
+	std::vector<MediaImageEncoder*> idle_encoders;
+
+	std::thread writer;
+	std::deque<MediaImageWrite> writes;
+	std::mutex write_lock;
+	std::condition_variable write_signal;
+	int in_flight; //Frames accepted but not yet on disk.
+	int max_in_flight;
+	bool stop;
+
+	std::atomic<int> written;
+	std::atomic<int> failures;
+}MediaImageExporter;
+
+typedef struct {
+	std::string source;
+	std::string prefix; //Sheets are written as <prefix>_<n>.jpg, the cue file as <prefix>.vtt.
+	int count;  //Thumbnails spread evenly over the whole file.
+	int width;  //Of one thumbnail, rounded down to even.
+	int height;
+	int columns; //Tiles per sprite sheet.
+	int rows;
+}MediaThumbnailRequest;
+
+//One source while its thumbnails are in flight, freed by the last task that touches it.
+typedef struct {
+	MediaThumbnailRequest request;
+	MediaKeyframeIndex index; //Built once by the planning task, copied into every decoding task's container.
+	std::vector<int> keyframes; //Keyframe closest to each thumbnail's target time.
+	std::vector<AVFrame*> sheets;
+
+	std::mutex lock;
+	std::vector<int> sheet_remaining; //Tiles still to be drawn, the task that draws the last one encodes the sheet.
+	int tasks_remaining;
+}MediaThumbnailFile;
+
+typedef struct {
+	MediaThreadPool pool;
+	MediaImageExporter exporter; //Sheets are encoded with its warm JPEG encoders instead of opening one per sheet.
+	std::atomic<int> thumbnails;
+	std::atomic<int> sheets;
+	std::atomic<int> failures;
+}MediaThumbnailEngine;
+
+//Numbered stills read as a video source. Images are loaded and converted to YUV420P on a pool, up to read_ahead frames ahead of the
+//consumer, and handed out strictly in order.
+typedef struct {
+	std::string pattern; //printf style path with one integer, e.g. "shots/frame_%05d.png".
+	int first; //Number of the first image, the sequence ends at the first missing one.
+	AVRational time_base; //One tick per image, 1/frame rate.
+	int width;
+	int height;
+
+	MediaThreadPool pool;
+	int read_ahead;
+	int next_submit;
+	int next_out;
+	std::map<int, AVFrame*> ready; //NULL marks an image that could not be loaded, which ends the sequence.
+	std::mutex lock;
+	std::condition_variable ready_signal;
+}MediaImageSequence;
+
+enum media_rgb_format {
+	MEDIA_RGB24 = 0,
+	MEDIA_RGBA = 1,
+	MEDIA_BGRA = 2,
+};
+
+enum media_yuv_matrix {
+	MEDIA_MATRIX_AUTO = 0, //From the frame's colorspace, unspecified counts as BT.709 from 720 lines up.
+	MEDIA_MATRIX_BT601 = 1,
+	MEDIA_MATRIX_BT709 = 2,
+};
+
+enum media_yuv_range {
+	MEDIA_RANGE_AUTO = 0, //From the frame's color_range and yuvj formats.
+	MEDIA_RANGE_LIMITED = 1,
+	MEDIA_RANGE_FULL = 2,
+};
+
+//How chroma is stored next to luma, the conversion kernels are built once per layout.
+enum media_chroma_layout {
+	MEDIA_CHROMA_420P = 0,
+	MEDIA_CHROMA_NV12 = 1,
+	MEDIA_CHROMA_444P = 2,
+};
+
+#define MEDIA_CPU_SSE41 0x01
+#define MEDIA_CPU_AVX2 0x02
+
+//YUV to RGB in 6 bit fixed point, the same numbers are used by the scalar and the vector kernels so their output is identical.
+typedef struct {
+	int16_t y_offset;
+	int16_t y_gain;
+	int16_t v_to_r;
+	int16_t u_to_g;
+	int16_t v_to_g;
+	int16_t u_to_b;
+}MediaYuvCoefficients;
+
+//Compile time description of a pixel format. Kernels take one as a template parameter, so plane count, subsampling and sample size
+//are constants in their inner loops and a 10 bit instantiation costs the 8 bit ones nothing.
+template <typename Sample, int Planes, int ShiftX, int ShiftY, int Depth, bool PackedChroma>
+struct MediaPixelLayout {
+	typedef Sample sample;
+	static const int planes = Planes; //Stored planes, interleaved chroma counts as one.
+	static const int chroma_shift_x = ShiftX;
+	static const int chroma_shift_y = ShiftY;
+	static const int depth = Depth;
+	static const bool packed_chroma = PackedChroma; //U and V interleaved in plane 1 like NV12.
+
+	//Samples per row and rows of a plane for a frame of width x height, and the sample offsets of pixel x,y inside it.
+	static int plane_width(int plane, int width) {
+		return plane == 0 ? width : ((width + (1 << ShiftX) - 1) >> ShiftX) * (PackedChroma ? 2 : 1);
+	}
+	static int plane_height(int plane, int height) {
+		return plane == 0 ? height : (height + (1 << ShiftY) - 1) >> ShiftY;
+	}
+	static int plane_x(int plane, int x) {
+		return plane == 0 ? x : (x >> ShiftX) * (PackedChroma ? 2 : 1);
+	}
+	static int plane_y(int plane, int y) {
+		return plane == 0 ? y : y >> ShiftY;
+	}
+};
+
+template <int PixelFormat> struct MediaPixelFormat; //Only the formats specialized here have kernels.
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV420P> : MediaPixelLayout<uint8_t, 3, 1, 1, 8, false> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV422P> : MediaPixelLayout<uint8_t, 3, 1, 0, 8, false> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV444P> : MediaPixelLayout<uint8_t, 3, 0, 0, 8, false> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_NV12> : MediaPixelLayout<uint8_t, 2, 1, 1, 8, true> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV420P10LE> : MediaPixelLayout<uint16_t, 3, 1, 1, 10, false> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV422P10LE> : MediaPixelLayout<uint16_t, 3, 1, 0, 10, false> {};
+template <> struct MediaPixelFormat<AV_PIX_FMT_YUV444P10LE> : MediaPixelLayout<uint16_t, 3, 0, 0, 10, false> {};
+
+//Non-owning view of a frame in Format, linesizes in bytes like AVFrame.
+template <typename Format>
+struct MediaFrameView {
+	typename Format::sample* data[3];
+	int linesize[3];
+	int width;
+	int height;
+
+	typename Format::sample* row(int plane, int y) const {
+		return reinterpret_cast<typename Format::sample*>(reinterpret_cast<uint8_t*>(data[plane]) + y * linesize[plane]);
+	}
+};
+
+//Window into a decoded frame moved by pointer arithmetic only, for crops, regions of interest and single fields. It neither owns nor
+//references the frame, media_frame_region_to_frame gives an AVFrame that shares the frame's buffers for as long as it is needed.
+typedef struct {
+	const AVFrame* source;
+	uint8_t* data[4];
+	int linesize[4];
+	int step[4]; //Bytes between horizontally adjacent pixels of each plane, 2 for NV12 chroma, YUYV and 16 bit formats.
+	int planes;
+	int format;
+	int chroma_shift_x;
+	int chroma_shift_y;
+	int width;
+	int height;
+}MediaFrameRegion;
+
+//One layer of the compositor. Position and opacity may change between rendered frames for moves and fades, the size only for video layers.
+typedef struct {
+	int x; //Top left on the canvas, rounded down to even to stay on the 4:2:0 chroma grid. May lie partly off the canvas.
+	int y;
+	int width; //Size on the canvas, the source is scaled once when it differs.
+	int height;
+	float opacity;
+	bool visible;
+
+	const AVFrame* frame; //Current picture of a video layer, set before every render. Not owned.
+	AVFrame* picture; //The converted still, or the video frame scaled to width x height when it does not fit as it is.
+	std::vector<uint8_t> alpha; //Straight alpha of stills at luma and at chroma resolution, empty for video layers.
+	std::vector<uint8_t> alpha_chroma;
+	SwsContext* scaler;
+}MediaCompositorLayer;
+
+//Blends layers bottom to top into a YUV420P canvas, in horizontal bands on several threads.
+typedef struct {
+	int width;
+	int height;
+	int threads; //0 uses one per core.
+	uint8_t background[3]; //Y, U, V, black by default.
+	std::vector<MediaCompositorLayer> layers; //The index returned when adding is the layer's handle.
+}MediaCompositor;
+
+//Decoded GOPs kept in memory for random access and scrubbing. Frames are refcounted, a hit hands out a new reference to the same
+//buffers, so they must be treated as read only. Eviction works on whole GOPs, least recently used first.
+typedef struct {
+	MediaContainer* media;
+	int keyframe; //Index into the container's keyframe_index.
+	std::vector<AVFrame*> frames; //Display order.
+	int64_t bytes;
+}MediaFrameCacheGop;
+
+typedef struct {
+	int64_t budget; //Bytes of decoded pictures.
+	int prefetch_gops; //GOPs after the requested one decoded in the background.
+	int64_t used;
+	std::list<MediaFrameCacheGop> gops; //Most recently used first.
+
+	std::mutex lock; //Guards the GOP list, prefetch queue and stats.
+	std::mutex decode_lock; //Serializes access to the cached containers' demuxers and decoders.
+	std::condition_variable wake;
+	std::deque<std::pair<MediaContainer*, int>> prefetch_queue;
+	std::thread worker;
+	bool stop;
+
+	int64_t hits;
+	int64_t misses;
+	int64_t evictions;
+	int64_t prefetched;
+	int64_t oversized; //GOPs decoded for a single frame and dropped because they alone exceed the budget.
+}MediaFrameCache;
+
+//Fast forward that only ever decodes keyframes. The demuxer drops everything else, and when the speed outruns the keyframe rate whole
+//GOPs are skipped by seeking through the keyframe index, so CPU use stays near one keyframe decode per shown frame.
+typedef struct {
+	double speed;            //Media seconds per second of playback.
+	double display_interval; //Seconds between shown frames, how far ahead the next keyframe is looked for.
+	AVRational time_base;
+	int64_t start_pts;       //Video time base, first keyframe shown.
+	int64_t last_pts;
+	int next_keyframe;       //Index entry the demuxer reads next without seeking.
+	double presentation_seconds; //When the last returned frame is due, relative to the first one.
+}MediaTrickPlay;
+
+//Walks a container backwards. A GOP is decoded forwards in one go and its frames handed out last to first, while the GOP before it is
+//decoded on a worker thread, so every frame is decoded once instead of once per step.
+typedef struct {
+	MediaContainer* media;
+	int keyframe; //GOP the frames are currently coming from.
+	std::vector<AVFrame*> frames; //Remaining frames of that GOP, display order, handed out from the back.
+
+	std::thread worker;
+	std::vector<AVFrame*> prefetched; //GOP keyframe - 1 once the worker has joined.
+	bool prefetch_failed;
+}MediaReverseIterator;
+
+//Rendition ladder, decodes a source once and fans the frames out to several encoders. Every rung owns an encode thread,
+//smaller rungs scale from the closest larger rung instead of the source so a 4K->1080->720 chain only downsizes each step once.
+typedef struct {
+	AVFrame* frame; //NULL marks end of stream.
+	AVMediaType type;
+}MediaRenditionItem;
+
+typedef struct {
+	MediaContainer* output;
+	int parent; //Rung whose scaled frames feed this one, -1 means the decoded source.
+	std::vector<int> children;
+	SwsContext* scale_context;
+
+	std::deque<MediaRenditionItem> queue;
+	std::mutex queue_lock;
+	std::condition_variable queue_signal;
+
+	std::thread worker;
+	int frames_encoded;
+	bool failure;
+}MediaRendition;
+
+typedef struct {
+	MediaContainer* input;
+	std::vector<MediaRendition*> rungs;
+	int queue_capacity; //Frames each rung may hold before the decoder blocks, keeps memory flat on long sources.
+}MediaRenditionLadder;
+
+//Converts decoded audio into whatever the encoder accepts (format, rate, layout) and cuts it into encoder sized frames.
+typedef struct {
+	SwrContext* resample_context;
+	AVAudioFifo* fifo;
+	AVCodecContext* encoder;
+
+	uint8_t** scratch; //Resampler output, grown on demand and reused between frames.
+	int scratch_samples;
+
+	int64_t next_pts; //Samples at the encoder rate, AV_NOPTS_VALUE until the first frame arrives.
+}MediaAudioConverter;
+
+//libavfilter graph between decoder and encoder, built from a filter string like "yadif,scale=1280:720,fps=30". Frames go in and out
+//by reference, the graph's own time base and frame rate describe what comes out.
+typedef struct {
+	AVFilterGraph* graph;
+	AVFilterContext* source;
+	AVFilterContext* sink;
+
+	AVRational time_base; //Of the frames received, set once the graph is configured.
+	AVRational frame_rate; //0/1 when the graph does not know it.
+	bool eof;
+}MediaFilterGraph;
+
+//One input of the audio mixer. Gain and fades may be changed while mixing, times are seconds from the track's start.
+typedef struct {
+	SwrContext* resample_context; //Cached, rebuilt only when the incoming format, rate or layout changes.
+	int in_format;
+	int in_rate;
+	uint64_t in_layout;
+	AVAudioFifo* fifo; //Float planar at the mix rate and layout.
+
+	double start; //Position on the mix timeline in seconds, silence before it.
+	float gain;
+	double fade_in; //Ramp up from silence over this many seconds, 0 for none.
+	double fade_out_start; //Negative for no fade out.
+	double fade_out;
+	bool ended;
+}MediaMixerTrack;
+
+//Sums any number of audio tracks into fixed size frames for an encoder. Every track is converted to float planar at the mix rate on the
+//way in, the mix is soft clipped and converted to the output sample format on the way out.
+typedef struct {
+	int sample_rate;
+	int channels;
+	uint64_t channel_layout;
+	int sample_format; //Of the frames received.
+	int frame_size;
+
+	std::vector<MediaMixerTrack> tracks;
+	SwrContext* output_context; //Float planar to sample_format when they differ.
+	std::vector<float> mix; //frame_size samples per channel, planar.
+	std::vector<float> scratch; //Reused for resampler output and fifo reads.
+	int64_t position; //Samples mixed so far, the next frame's pts in 1/sample_rate.
+}MediaAudioMixer;
+
+//Pulls PCM from one file in whatever chunk size the caller asks for, from any sample position. Decoded audio is resampled straight
+//into a ring buffer that reads copy out of, samples are counted at the output rate from the stream's time zero.
+typedef struct {
+	MediaContainer media;
+	MediaFrame frame;
+	SwrContext* resample_context; //Cached, rebuilt when the decoded format changes mid stream.
+	int in_format;
+	int in_rate;
+	uint64_t in_layout;
+
+	int sample_rate;
+	int channels;
+	uint64_t channel_layout;
+	int sample_format; //Planar formats keep one ring per channel.
+	int planes;
+	int sample_bytes; //Per plane, so all channels for interleaved formats.
+
+	std::vector<uint8_t> ring[AV_NUM_DATA_POINTERS];
+	std::vector<uint8_t> scratch; //Resampler output that would wrap around the end of the ring.
+	int capacity; //Samples.
+	int head;
+	int size;
+
+	int64_t origin; //Stream start time, sample 0 in the stream's time base.
+	int64_t position; //Sample the next read starts at.
+	int64_t skip_to; //After a seek, samples before this are decoded for the codec's sake and dropped.
+	bool synced; //The ring's timeline has been set from a decoded timestamp since the last seek.
+	bool eof;
+}MediaAudioReader;
+
+typedef struct {
+	double start; //Seconds, inclusive.
+	double end;   //Seconds, exclusive.
+}MediaTrimRange;
+
+typedef struct {
+	MediaTrimRange range;
+	int keyframe;      //Index entry the copy starts from, at or before range.start.
+	int64_t start_pts; //Video stream time base.
+	int64_t end_pts;
+}MediaTrimSegment;
+
+//Edit decision list, clips are played back to back in the order they were added.
+typedef struct {
+	MediaContainer* source; //Opened with populate_codecs_source, the decoder is needed for the cut points.
+	double in;  //Seconds, inclusive.
+	double out; //Seconds, exclusive.
+	MediaContainer* proxy; //Low resolution stand in with the same timestamps, NULL when there is none.
+}MediaTimelineClip;
+
+typedef struct {
+	std::vector<MediaTimelineClip> clips;
+
+	int64_t packets_copied;
+	int64_t frames_encoded;
+
+	bool use_proxies; //media_timeline_preview reads proxies instead of sources, rendering always uses the sources.
+}MediaTimeline;
+
+//Last point where the output file is known to be complete. Written to the journal at a video keyframe, so a restarted transcode can
+//seek the input there, cut the output back to output_offset and carry on with fresh encoders.
+typedef struct {
+	int64_t input_pts;        //Input video time base, the keyframe the encoders restart from.
+	int64_t output_offset;    //Bytes of the output that are consistent.
+	int64_t video_last_dts;   //Output video time base, last video packet in the file.
+	int64_t audio_end_pts;    //Output audio time base, end of the last audio packet in the file, AV_NOPTS_VALUE without audio.
+
+	//Encoder parameters the output was started with, a resume with anything else would produce a mixed stream.
+	int video_codec_id;
+	int audio_codec_id;
+	int width;
+	int height;
+	int pix_fmt;
+	int64_t bit_rate;
+	int sample_rate;
+	int channels;
+}MediaTranscodeCheckpoint;
+
+//Checkpoint bookkeeping while transcode_media runs.
+typedef struct {
+	MediaTranscodeCheckpoint checkpoint; //Encoder parameters filled in up front, positions as the output grows.
+	const char* path;
+	int64_t pending_input; //Input video time base, keyframe forced on the encoder for the next checkpoint.
+	int64_t pending_pts;   //Output video time base, the same frame once encoded. AV_NOPTS_VALUE when nothing is pending.
+	int64_t written[2];      //Last video dts and audio end pts handed to the muxer.
+	int64_t resume_after[2]; //Packets already in a resumed file, dropped until each stream has caught up.
+}MediaTranscodeJournal;
+
+typedef struct {
+	std::string key;
+	int64_t size;
+}MediaRenderCacheEntry;
+
+//Rendered timeline clips kept on disk as fragment files, named by a hash of everything that decides their content. Re-exports copy
+//the fragments of unchanged clips instead of rendering them again.
+typedef struct {
+	std::string directory;
+	int64_t budget; //Bytes, least recently used fragments are deleted past this.
+	int64_t used;
+	std::list<MediaRenderCacheEntry> entries; //Most recently used first.
+
+	int64_t hits;
+	int64_t misses;
+}MediaRenderCache;
+
+typedef struct {
+	int interleave_window; //Encoded packets held across both streams before the oldest is written even though the other stream lags.
+
+	const char* checkpoint_journal; //NULL disables checkpoints. Needs an output that can be cut at any packet, MPEG-TS.
+	double checkpoint_interval;     //Seconds of input between checkpoints, the most work a crash can lose.
+	const MediaTranscodeCheckpoint* resume; //Continue from this checkpoint, output opened with open_media_resume.
+
+	void (*progress)(void* user, double seconds); //Called with the time of every video frame sent to the encoder, NULL for none.
+	void* progress_user;
+
+	const char* video_filter; //libavfilter graph run on every decoded video frame, NULL for none. Not combined with checkpoints.
+	int filter_threads; //Slice threads inside the graph, 0 lets libavfilter decide.
+}MediaTranscodeOptions;
+
+enum media_proxy_state {
+	MEDIA_PROXY_QUEUED = 0,
+	MEDIA_PROXY_RUNNING = 1,
+	MEDIA_PROXY_DONE = 2,
+	MEDIA_PROXY_FAILED = 3,
+};
+
+typedef struct {
+	std::string source;
+	std::string proxy;
+	std::atomic<double> progress; //0 to 1.
+	std::atomic<int> state; //media_proxy_state.
+	std::string error; //Why the job failed, only read once state is MEDIA_PROXY_FAILED.
+}MediaProxyJob;
+
+//Turns transcode progress callbacks, in seconds, into the job's fraction.
+typedef struct {
+	MediaProxyJob* job;
+	double start;
+	double duration;
+}MediaProxyProgress;
+
+//Makes all intra, low resolution copies of sources on a pool of threads. Timestamps are carried over unchanged so a proxy can replace
+//its source anywhere on a timeline.
+typedef struct {
+	int height; //Proxy height, width follows the source aspect ratio.
+	AVCodecID codec; //AV_CODEC_ID_MJPEG or AV_CODEC_ID_H264, H.264 is made all intra.
+
+	std::vector<MediaProxyJob*> jobs;
+	std::deque<MediaProxyJob*> queue;
+	std::vector<std::thread> workers;
+	int running;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	bool stop;
+}MediaProxyGenerator;
+
 //Container functions
 int malloc_media_container(MediaContainer* media, int mode);
 void free_media_container(MediaContainer* media);
 int open_media(MediaContainer* media, const char* filename);
+int open_media_resume(MediaContainer* media, const char* filename, const MediaTranscodeCheckpoint* checkpoint); //Output only, cuts the file back to the checkpoint and appends.
 int open_media_write_header(MediaContainer* media);
 int open_media_write_packet(MediaContainer* media, MediaPacket* packet);
+int open_media_write_packets(MediaContainer* media, std::vector<MediaPacket>& packets); //Writes and frees the whole batch, leaves it empty.
 int open_media_write_trailer(MediaContainer* media);
 static void populate_internal_structures(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, int fps, int audio_sample_rate);
 int populate_codecs_source(MediaContainer* media);
 int populate_codecs_copy(MediaContainer* media_from, MediaContainer* media_to);
+int media_select_audio_stream(MediaContainer* media, int nth); //Decode the nth audio stream instead of the one populate_codecs_source picked.
+int media_set_decode_quality(MediaContainer* media, media_decode_quality quality); //Input only, best applied right after a seek, a resolution change reopens the decoder.
 int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, float timebase_den, int audio_sample_rate);
+int populate_codecs_user(MediaContainer* media, int vcodecid, int acodecid, int width, int height, int pix_format, int bitrate, int rc_buffer_size, int rcmaxrate, int rcminrate, float timebase_den, int audio_sample_rate, const MediaEncoderOptions* options);
+//Audio conversion functions
+int malloc_media_audio_converter(MediaAudioConverter* converter, AVCodecContext* encoder);
+void free_media_audio_converter(MediaAudioConverter* converter);
+int media_audio_converter_submit(MediaAudioConverter* converter, AVFrame* frame, AVRational time_base); //NULL frame flushes the resampler.
+int media_audio_converter_receive(MediaAudioConverter* converter, AVFrame* frame, bool flush); //flush allows a short final frame.
+//Filter graph functions, out_pix_fmt pins the output format for an encoder, AV_PIX_FMT_NONE leaves it to the graph.
+int malloc_media_filter_graph(MediaFilterGraph* filter, const char* description, int width, int height, int pix_fmt, AVRational sample_aspect,
+	AVRational time_base, AVRational frame_rate, int out_pix_fmt, int threads);
+int malloc_media_filter_graph(MediaFilterGraph* filter, const char* description, MediaContainer* input, int out_pix_fmt, int threads); //From the input's video decoder.
+void free_media_filter_graph(MediaFilterGraph* filter);
+int media_filter_submit(MediaFilterGraph* filter, AVFrame* frame); //Takes a new reference, frame stays with the caller. NULL ends the stream.
+int media_filter_receive(MediaFilterGraph* filter, MediaFrame* frame); //0 with a frame in video_frame, -1 when the graph needs input or is done.
+//Audio mixer functions, received frames carry pts in 1/sample_rate.
+int malloc_media_audio_mixer(MediaAudioMixer* mixer, int sample_rate, uint64_t channel_layout, int sample_format, int frame_size);
+int malloc_media_audio_mixer(MediaAudioMixer* mixer, AVCodecContext* encoder); //Output in the encoder's format and frame size.
+void free_media_audio_mixer(MediaAudioMixer* mixer);
+int media_audio_mixer_add_track(MediaAudioMixer* mixer, float gain, double start); //Returns the track index.
+int media_audio_mixer_submit(MediaAudioMixer* mixer, int track, AVFrame* frame); //NULL frame ends the track.
+int media_audio_mixer_receive(MediaAudioMixer* mixer, AVFrame* frame); //0 with a frame, -1 while a live track lacks samples or when all are drained.
+//Audio reader functions, 0 sample rate or layout and AV_SAMPLE_FMT_NONE keep the source's.
+int malloc_media_audio_reader(MediaAudioReader* reader, const char* path, int sample_rate, uint64_t channel_layout, int sample_format);
+void free_media_audio_reader(MediaAudioReader* reader);
+int media_audio_reader_seek(MediaAudioReader* reader, int64_t sample); //Exact to the sample at the output rate.
+int media_audio_reader_read(MediaAudioReader* reader, uint8_t** data, int samples); //One pointer per plane, returns samples copied, fewer only at the end.
+//Encoder option functions
+void media_encoder_options_init(MediaEncoderOptions* options, media_encoder_profile profile);
+static void media_encoder_options_apply_video(AVCodecContext* ctx, const MediaEncoderOptions* options, AVDictionary** dict);
+static void media_encoder_options_apply_audio(AVCodecContext* ctx, const MediaEncoderOptions* options);
+std::string media_encoder_options_to_string(MediaContainer* media); //Reads the values back from the opened encoders, for logging.
 int remux_media_data(MediaContainer* media_from, MediaContainer* media_to);
+int media_build_keyframe_index(MediaContainer* media); //Uses the demuxer index when it covers the stream, otherwise scans packets once without decoding.
+int media_keyframe_at_or_before(MediaContainer* media, int64_t pts); //Index into keyframe_index, -1 if the pts precedes the first keyframe.
+int media_plan_trim_segments(MediaContainer* media, const std::vector<MediaTrimRange>& ranges, std::vector<MediaTrimSegment>& segments);
+int remux_media_data_ranges(MediaContainer* media_from, MediaContainer* media_to, const std::vector<MediaTrimRange>& ranges); //Stream copy, output starts at zero.
+//concat functions, open_media_parallel allocates the containers, release them with free_media_containers.
+int open_media_parallel(const std::vector<std::string>& filenames, std::vector<MediaContainer*>& containers);
+void free_media_containers(std::vector<MediaContainer*>& containers);
+bool media_streams_compatible(MediaContainer* a, MediaContainer* b);
+int concat_media_data(std::vector<MediaContainer*>& inputs, MediaContainer* media_to); //Output populated with populate_codecs_copy from inputs[0].
+//timeline functions, render only decodes the partial GOPs at cut points, everything in between is stream copied.
+void malloc_media_timeline(MediaTimeline* timeline);
+void free_media_timeline(MediaTimeline* timeline);
+int media_timeline_add_clip(MediaTimeline* timeline, MediaContainer* source, double in, double out);
+int media_timeline_attach_proxy(MediaTimeline* timeline, MediaContainer* source, MediaContainer* proxy); //Every clip of source gets the proxy.
+MediaContainer* media_timeline_clip_media(MediaTimeline* timeline, const MediaTimelineClip& clip); //Proxy when enabled and available, otherwise the source.
+int media_timeline_preview(MediaTimeline* timeline, MediaFrameCache* cache, double position, MediaFrame* frame); //Frame at position seconds into the edit, read from proxies when use_proxies is set.
+int media_timeline_render(MediaTimeline* timeline, MediaContainer* output); //Output populated with populate_codecs_copy from a clip source, header and trailer up to the caller.
+//render cache functions, the index is loaded from and saved to the cache directory so the cache outlives the process.
+int malloc_media_render_cache(MediaRenderCache* cache, const char* directory, int64_t budget);
+void free_media_render_cache(MediaRenderCache* cache);
+int media_timeline_render_cached(MediaTimeline* timeline, MediaContainer* output, MediaRenderCache* cache); //Same contract as media_timeline_render.
+void media_transcode_options_init(MediaTranscodeOptions* options);
+int transcode_media(MediaContainer* media_from, MediaContainer* media_to, const MediaTranscodeOptions* options); //Single pass, both streams, header and trailer are up to the caller.
+int media_checkpoint_read(const char* journal, MediaTranscodeCheckpoint* checkpoint); //-1 when there is no usable journal, start from scratch.
+int media_checkpoint_write(const char* journal, const MediaTranscodeCheckpoint* checkpoint); //Replaces the journal atomically.
+int media_checkpoint_remove(const char* journal); //Once the trailer is written the journal is stale.
 void reset_input_container_state(MediaContainer* media);
 //Frame functions
 int malloc_media_frame(MediaFrame* frame);
@@ -206,12 +916,19 @@ int malloc_media_packet(MediaPacket* packet);
 void free_media_packet(MediaPacket* packet);
 static int decode_video_packet(MediaCodecDescriptor& codec, MediaFrame* frame);
 static int decode_audio_packet(MediaCodecDescriptor& codec, MediaFrame* frame);	
-int encode_next_frame_video(MediaContainer* media, MediaFrame* frame, MediaPacket* packet, MediaRational time_from, MediaRational time_to);
-int encode_next_frame_audio(MediaContainer* media, MediaFrame* frame, MediaPacket* packet, MediaRational time_from, MediaRational time_to);
+//Encoding appends every packet the encoder has ready and returns how many were added, -1 on failure. Call the flush functions once
+//at EOF, encoders with lookahead or B frames hold on to the tail of the stream until they are told no more frames are coming.
+static int encode_receive_packets(AVCodecContext* codec_context, int stream_index, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to);
+int encode_next_frame_video(MediaContainer* media, MediaFrame* frame, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to);
+int encode_next_frame_audio(MediaContainer* media, MediaFrame* frame, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to);
+int encode_flush_video(MediaContainer* media, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to);
+int encode_flush_audio(MediaContainer* media, std::vector<MediaPacket>& packets, MediaRational time_from, MediaRational time_to);
 int decode_next_frame_video(MediaContainer* media, MediaFrame* frame);
 int decode_next_frame_audio(MediaContainer* media, MediaFrame* frame);
+int decode_next_frame_any(MediaContainer* media, MediaFrame* frame, AVMediaType* type); //Single demux pass, returns whichever stream produced a frame first.
 int decode_next_frame_video(MediaStreamContainer* media, MediaFrame* frame);
 int decode_next_frame_audio(MediaStreamContainer* media, MediaFrame* frame);
+int decode_next_frame_video(MediaImageSequence* media, MediaFrame* frame);
 void retrieve_pts_seconds(MediaContainer* media, MediaFrame* frame);
 //rtp stream capture functions, useful for WebRTC, media streaming purposes, tested for video RTC connections, able to capture H264/H265 packets and decode them in real time.
 int malloc_media_stream_container(MediaStreamContainer* media, int width, int height);
@@ -220,14 +937,86 @@ static int media_stream_request_packet(MediaStreamContainer* media, std::vector<
 static void media_stream_convert_av(AVPacket* av_packet, std::vector<uint8_t>& packet);
 void media_stream_submit_packet(MediaStreamContainer* media, const std::vector<uint8_t>& packet); //Sends all packets received async to queue. Use this function when you recieve new RTP Packets.
 //media file straming functions
-void malloc_media_file_stream_container(MediaFileStreamingBuffer* media, float timebase_num, float timebase_den, int fps);
+int malloc_media_file_stream_container(MediaFileStreamingBuffer* media, AVRational time_base, AVRational frame_rate, int audio_sample_rate, int audio_frame_size);
+int media_file_stream_set_budget(MediaFileStreamingBuffer* media, size_t max_packets, size_t max_bytes, media_buffer_overflow overflow, const char* spill_path);
+void media_file_stream_set_packet_time_base(MediaFileStreamingBuffer* media, AVRational time_base);
 void free_media_file_stream_container(MediaFileStreamingBuffer* media);
-static float media_file_stream_gen_pts_video(MediaFileStreamingBuffer* media);
-static float media_file_stream_gen_pts_audio(MediaFileStreamingBuffer* media);
-void media_submit_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket packet);
-void media_submit_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket packet);
+static int64_t media_file_stream_gen_pts_video(MediaFileStreamingBuffer* media);
+static int64_t media_file_stream_gen_pts_audio(MediaFileStreamingBuffer* media);
+//Submit takes ownership of the packet. Returns 0 when held in memory, 1 when spilled to disk, -1 when refused (MEDIA_BUFFER_SIGNAL).
+int media_submit_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket packet);
+int media_submit_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket packet);
+//Request hands ownership to the caller, free the packet once written.
 int media_request_file_stream_packet_video(MediaFileStreamingBuffer* media, MediaPacket& packet);
 int media_request_file_stream_packet_audio(MediaFileStreamingBuffer* media, MediaPacket& packet);
+//proxy functions, jobs stay valid until the generator is freed, free drops queued jobs and waits for running ones.
+int malloc_media_proxy_generator(MediaProxyGenerator* generator, int threads, int height, AVCodecID codec);
+void free_media_proxy_generator(MediaProxyGenerator* generator);
+MediaProxyJob* media_proxy_submit(MediaProxyGenerator* generator, const char* source, const char* proxy);
+void media_proxy_wait(MediaProxyGenerator* generator); //Blocks until every submitted job has finished.
+//thread pool functions, free finishes the queued tasks before stopping.
+int malloc_media_thread_pool(MediaThreadPool* pool, int threads); //0 uses one thread per core.
+void free_media_thread_pool(MediaThreadPool* pool);
+void media_thread_pool_submit(MediaThreadPool* pool, std::function<void()> task);
+void media_thread_pool_wait(MediaThreadPool* pool);
+//thumbnail functions, keyframes closest to the targets are decoded on their own, nothing in between.
+int malloc_media_thumbnail_engine(MediaThumbnailEngine* engine, int threads);
+void free_media_thumbnail_engine(MediaThumbnailEngine* engine);
+int media_thumbnail_submit(MediaThumbnailEngine* engine, const MediaThumbnailRequest* request);
+void media_thumbnail_wait(MediaThumbnailEngine* engine);
+//image export functions, flush waits until every exported frame is on disk.
+int malloc_media_image_exporter(MediaImageExporter* exporter, media_image_format format, const char* directory, const char* pattern, int threads);
+void free_media_image_exporter(MediaImageExporter* exporter);
+int media_image_export(MediaImageExporter* exporter, AVFrame* frame, int number);
+int media_image_export_to(MediaImageExporter* exporter, AVFrame* frame, const char* path); //Explicit file name, extension included.
+void media_image_exporter_flush(MediaImageExporter* exporter);
+//image sequence functions, decode_next_frame_video has an overload below like the rtp stream source.
+int malloc_media_image_sequence(MediaImageSequence* media, const char* pattern, int first, AVRational frame_rate, int read_ahead, int threads);
+void free_media_image_sequence(MediaImageSequence* media);
+void media_rgba_to_yuv420p(const uint8_t* rgba, int stride, int width, int height, AVFrame* out); //BT.601 limited range.
+//pixel conversion functions,
+int media_cpu_features(); //MEDIA_CPU_* flags of this machine, detected once.
+void media_cpu_features_override(int features); //Limits the kernels used, -1 goes back to detection. For benchmarks and checking fallbacks.
+static void media_run_bands(int rows, int threads, int align, const std::function<void(int, int)>& band);
+int media_yuv_to_rgb(const AVFrame* frame, uint8_t* dst, int dst_stride, media_rgb_format format, media_yuv_matrix matrix, media_yuv_range range, int threads); //0 threads uses one per core for large frames.
+//pixel format kernel functions, one switch picks the template instance for the frame's format. Unsupported formats return -1.
+bool media_pixel_format_supported(int pix_fmt);
+int media_frame_copy(const AVFrame* src, AVFrame* dst); //Same format, the overlapping top left area.
+int media_frame_crop(const AVFrame* src, AVFrame* dst, int x, int y); //dst is allocated by the caller at the crop size, x and y are rounded down to the chroma grid.
+int media_frame_blend(AVFrame* dst, const AVFrame* src, int x, int y, float opacity); //src over dst at x,y, same format, clipped to dst.
+int media_frame_convert(const AVFrame* src, AVFrame* dst); //Any two supported formats of the same size, chroma is box filtered down and repeated up.
+//frame region functions, the region keeps pointing into the source frame so it must outlive the region.
+int media_frame_region(MediaFrameRegion* region, const AVFrame* frame);
+int media_frame_region_crop(MediaFrameRegion* region, int x, int y, int width, int height); //Relative to the current region, x and y snap down to the chroma grid.
+int media_frame_region_field(MediaFrameRegion* region, int bottom); //Every other line starting at line 0 or 1.
+bool media_frame_region_aligned(const MediaFrameRegion* region, int alignment);
+int media_frame_region_to_frame(const MediaFrameRegion* region, AVFrame* out, int alignment); //0 when out shares the buffers, 1 when they had to be copied.
+//compositor functions, video layers take YUV420P frames of their own size without conversion, anything else goes through swscale.
+int malloc_media_compositor(MediaCompositor* compositor, int width, int height, int threads);
+void free_media_compositor(MediaCompositor* compositor);
+int media_compositor_add_video(MediaCompositor* compositor, int x, int y, int width, int height, float opacity);
+int media_compositor_add_still(MediaCompositor* compositor, const char* path, int x, int y, int width, int height, float opacity); //0 width or height keeps the image size.
+int media_compositor_set_frame(MediaCompositor* compositor, int layer, const AVFrame* frame);
+int media_compositor_render(MediaCompositor* compositor, AVFrame* out); //Allocates out at the canvas size if it has no buffers.
+//frame cache functions, while a container is used through a cache it must not be decoded directly, call reset_input_container_state after.
+int malloc_media_frame_cache(MediaFrameCache* cache, int64_t budget, int prefetch_gops);
+void free_media_frame_cache(MediaFrameCache* cache);
+int media_frame_cache_get(MediaFrameCache* cache, MediaContainer* media, int64_t pts, MediaFrame* frame); //Frame shown at pts, video stream time base.
+int media_decode_gop(MediaContainer* media, int keyframe, std::vector<AVFrame*>& frames); //Frames of one GOP in display order, caller frees them.
+//trick play functions, stop restores normal demuxing and decoding and moves back to the keyframe of the last frame shown.
+int media_trickplay_start(MediaContainer* media, MediaTrickPlay* trick, double speed, double display_interval, int64_t start_pts);
+int media_trickplay_next_frame(MediaContainer* media, MediaTrickPlay* trick, MediaFrame* frame);
+void media_trickplay_stop(MediaContainer* media, MediaTrickPlay* trick);
+static int media_decode_keyframe(MediaContainer* media, int keyframe, bool seek, AVPacket* packet, AVFrame* out);
+//reverse iteration functions, same rule as the frame cache, the container is owned by the iterator until it is freed.
+int malloc_media_reverse_iterator(MediaReverseIterator* iterator, MediaContainer* media, int64_t start_pts); //First frame out is the one shown at start_pts.
+void free_media_reverse_iterator(MediaReverseIterator* iterator);
+int media_reverse_next_frame(MediaReverseIterator* iterator, MediaFrame* frame); //-1 once the first frame of the file has been returned.
+//rendition ladder functions, outputs must be opened with populate_codecs_user and have their header written before running.
+int malloc_media_rendition_ladder(MediaRenditionLadder* ladder, MediaContainer* input, int queue_capacity);
+void free_media_rendition_ladder(MediaRenditionLadder* ladder);
+int media_rendition_ladder_add(MediaRenditionLadder* ladder, MediaContainer* output);
+int media_rendition_ladder_run(MediaRenditionLadder* ladder);
 //Util functions 
 static void save_gray_frame(unsigned char* buf, int wrap, int xsize, int ysize, const char* filename)
 {
@@ -242,49 +1031,6 @@ static void save_gray_frame(unsigned char* buf, int wrap, int xsize, int ysize,
 		fwrite(buf + i * wrap, 1, xsize, f);
 	fclose(f);
 }
-static int save_frame_as_jpeg(AVFrame* pFrame, int FrameNo)
-{
-	AVCodec* jpegCodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
-	if (!jpegCodec) { return -1; }
-
-	AVCodecContext* jpegContext = avcodec_alloc_context3(jpegCodec);
-	if (!jpegContext) { return -1; }
-
-	jpegContext->pix_fmt = AV_PIX_FMT_YUVJ420P;
-	jpegContext->height = pFrame->height;
-	jpegContext->width = pFrame->width;
-
-	jpegContext->time_base = { 1,25 };
-
-	if (avcodec_open2(jpegContext, jpegCodec, NULL) < 0)
-	{
-		return -1;
-	}
-
-	FILE* JPEGFile;
-	std::string path = "..\\resource\\firstframe";
-
-	AVPacket packet;
-	packet.data = NULL;
-	packet.size = 0;
-	av_init_packet(&packet);
-	int gotFrame = 0;
-
-	if (avcodec_encode_video2(jpegContext, &packet, pFrame, &gotFrame) < 0)
-	{
-		return -1;
-	}
-
-	path = path + std::to_string(FrameNo) + ".jpg";
-	JPEGFile = fopen(path.c_str(), "wb");
-	fwrite(packet.data, 1, packet.size, JPEGFile);
-	fflush(JPEGFile);
-	fclose(JPEGFile);
-
-	av_free_packet(&packet);
-	avcodec_close(jpegContext);
-	return 0;
-}
 static std::string uint8_vector_to_hex_string(const std::vector<uint8_t>& v) {
 	std::string result;
 	if (v.size() < 100) {
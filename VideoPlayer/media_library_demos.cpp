@@ -2,6 +2,7 @@
 #include <iostream>
 #include <stdio.h>
 #include <string>
+#include <chrono>
 #include "media.h"
 #include "graphics.h"
 
@@ -43,6 +44,428 @@ int play_file(std::string filename) {
 	return 0;
 }
 
+//Decodes the whole file once per preset and reports the speed up over full quality decoding.
+int benchmark_decode_quality(std::string filename) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, filename.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	const char* names[] = { "full", "fast", "preview", "keyframes" };
+	media_decode_quality presets[] = { MEDIA_DECODE_QUALITY_FULL, MEDIA_DECODE_QUALITY_FAST, MEDIA_DECODE_QUALITY_PREVIEW, MEDIA_DECODE_QUALITY_KEYFRAMES };
+	double full_elapsed = 0;
+
+	for (int i = 0; i < 4; i++) {
+		reset_input_container_state(&video);
+		media_set_decode_quality(&video, presets[i]);
+
+		int frames = 0;
+		double media_seconds = 0;
+		auto start = std::chrono::steady_clock::now();
+		while (decode_next_frame_video(&video, &frame) == 0) {
+			frames++;
+			media_seconds = frame.frame_pts_seconds;
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (i == 0) {
+			full_elapsed = elapsed;
+		}
+
+		//Presets that drop frames output fewer of them, the media time covered per second is the fair comparison.
+		std::cout << names[i] << ": " << frames << " frames at " << frame.video_frame->width << "x" << frame.video_frame->height << ", "
+			<< frames / elapsed << " fps, " << media_seconds / elapsed << "x realtime, " << full_elapsed / elapsed << "x faster than full" << std::endl;
+	}
+
+	free_media_frame(&frame);
+	free_media_container(&video);
+	return 0;
+}
+
+//YUV420P to RGBA at 1080p and 4K, swscale against each of our kernels single threaded and the best one on every core.
+int benchmark_yuv_to_rgb() {
+	const int sizes[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	const int runs = 30;
+
+	for (int s = 0; s < 2; s++) {
+		int width = sizes[s][0];
+		int height = sizes[s][1];
+
+		AVFrame* frame = av_frame_alloc();
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = width;
+		frame->height = height;
+		av_frame_get_buffer(frame, 32);
+		for (int plane = 0; plane < 3; plane++) {
+			int rows = plane == 0 ? height : height / 2;
+			for (int y = 0; y < rows; y++) {
+				for (int x = 0; x < frame->linesize[plane]; x++) {
+					frame->data[plane][y * frame->linesize[plane] + x] = static_cast<uint8_t>(x * (plane + 1) + y);
+				}
+			}
+		}
+		std::vector<uint8_t> rgba(width * height * 4);
+
+		SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_YUV420P, width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+		uint8_t* dst[4] = { rgba.data(), NULL, NULL, NULL };
+		int dst_stride[4] = { width * 4, 0, 0, 0 };
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < runs; i++) {
+			sws_scale(sws, frame->data, frame->linesize, 0, height, dst, dst_stride);
+		}
+		double sws_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+		sws_freeContext(sws);
+		std::cout << width << "x" << height << " swscale: " << sws_ms << " ms" << std::endl;
+
+		const char* names[] = { "scalar", "sse4.1", "avx2", "avx2 all cores" };
+		int features[] = { 0, MEDIA_CPU_SSE41, MEDIA_CPU_SSE41 | MEDIA_CPU_AVX2, MEDIA_CPU_SSE41 | MEDIA_CPU_AVX2 };
+		int threads[] = { 1, 1, 1, 0 };
+		for (int k = 0; k < 4; k++) {
+			if ((media_cpu_features() & features[k]) != features[k]) {
+				continue;
+			}
+			media_cpu_features_override(features[k]);
+			start = std::chrono::steady_clock::now();
+			for (int i = 0; i < runs; i++) {
+				media_yuv_to_rgb(frame, rgba.data(), width * 4, MEDIA_RGBA, MEDIA_MATRIX_BT601, MEDIA_RANGE_LIMITED, threads[k]);
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+			std::cout << width << "x" << height << " " << names[k] << ": " << ms << " ms, " << sws_ms / ms << "x swscale" << std::endl;
+		}
+		media_cpu_features_override(-1);
+		av_frame_free(&frame);
+	}
+	return 0;
+}
+
+//Every decoded frame up to 4:4:4 10 bit and back, the round trip is lossless for 8 bit 4:2:0 sources.
+int benchmark_pixel_format_kernels(std::string filename) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, filename.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+	if (!media_pixel_format_supported(video.codec_description.m_pix_fmt)) {
+		free_media_container(&video);
+		return -1;
+	}
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	AVFrame* wide = av_frame_alloc();
+	wide->format = AV_PIX_FMT_YUV444P10LE;
+	wide->width = video.m_width;
+	wide->height = video.m_height;
+	av_frame_get_buffer(wide, 32);
+
+	int frames = 0;
+	double elapsed = 0;
+	while (decode_next_frame_video(&video, &frame) == 0) {
+		auto start = std::chrono::steady_clock::now();
+		media_frame_convert(frame.video_frame, wide);
+		//The decoder may still reference this picture, writing back goes to a private copy.
+		av_frame_make_writable(frame.video_frame);
+		media_frame_convert(wide, frame.video_frame);
+		elapsed += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		frames++;
+	}
+
+	std::cout << frames << " frames, " << elapsed / FFMAX(frames, 1) << " ms per round trip" << std::endl;
+
+	av_frame_free(&wide);
+	free_media_frame(&frame);
+	free_media_container(&video);
+	return 0;
+}
+
+//Cuts a width x height window at x,y out of every frame and encodes it to H.264, the window goes to the encoder without a copy.
+int crop_and_encode_file(std::string input, std::string output, int x, int y, int width, int height) {
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+	if (open_media(&output_container, output.c_str()) < 0) {
+		free_media_container(&input_container);
+		return -1;
+	}
+
+	//Video only, the audio track stays empty.
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, width & ~1, height & ~1,
+		input_container.codec_description.m_pix_fmt, 0, 0, 0, 0, input_container.time_base.den,
+		input_container.codec_description.m_audio_sample_rate);
+
+	open_media_write_header(&output_container);
+	AVRational video_to = output_container.format_context->streams[output_container.m_video_stream_index]->time_base;
+
+	MediaFrame frame;
+	MediaFrame cropped;
+	malloc_media_frame(&frame);
+	malloc_media_frame(&cropped);
+	std::vector<MediaPacket> packets;
+
+	int copies = 0;
+	while (decode_next_frame_video(&input_container, &frame) == 0) {
+		MediaFrameRegion region;
+		if (media_frame_region(&region, frame.video_frame) < 0 || media_frame_region_crop(&region, x, y, width & ~1, height & ~1) < 0) {
+			break;
+		}
+		//The encoder copies the picture into its own buffers, so no alignment is needed.
+		copies += media_frame_region_to_frame(&region, cropped.video_frame, 0);
+		if (encode_next_frame_video(&output_container, &cropped, packets, input_container.time_base, video_to) > 0) {
+			open_media_write_packets(&output_container, packets);
+		}
+	}
+	encode_flush_video(&output_container, packets, input_container.time_base, video_to);
+	open_media_write_packets(&output_container, packets);
+
+	std::cout << "Frames copied instead of shared: " << copies << std::endl;
+
+	open_media_write_trailer(&output_container);
+	free_media_frame(&cropped);
+	free_media_frame(&frame);
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+	return 0;
+}
+
+//Picture in picture with a logo and a lower third fading in over the first second, four layers composited per output frame.
+int composite_files(std::string main_input, std::string pip_input, std::string logo, std::string lower_third, std::string output) {
+	MediaContainer main_video;
+	MediaContainer pip_video;
+	malloc_media_container(&main_video, MEDIA_FILE_INPUT);
+	malloc_media_container(&pip_video, MEDIA_FILE_INPUT);
+	if (open_media(&main_video, main_input.c_str()) < 0 || open_media(&pip_video, pip_input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&main_video);
+	populate_codecs_source(&pip_video);
+
+	int width = main_video.m_width;
+	int height = main_video.m_height;
+
+	MediaCompositor compositor;
+	malloc_media_compositor(&compositor, width, height, 0);
+	int main_layer = media_compositor_add_video(&compositor, 0, 0, width, height, 1.0f);
+	int pip_layer = media_compositor_add_video(&compositor, width * 3 / 4 - 32, 32, width / 4, height / 4, 1.0f);
+	media_compositor_add_still(&compositor, logo.c_str(), 32, 32, 0, 0, 0.8f);
+	int title_layer = media_compositor_add_still(&compositor, lower_third.c_str(), 0, height * 3 / 4, width, height / 6, 0.0f);
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	//Video only, the audio track stays empty.
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, width, height, AV_PIX_FMT_YUV420P, 0, 0, 0, 0,
+		main_video.time_base.den, main_video.codec_description.m_audio_sample_rate);
+
+	open_media_write_header(&output_container);
+	AVRational video_to = output_container.format_context->streams[output_container.m_video_stream_index]->time_base;
+
+	MediaFrame main_frame;
+	MediaFrame pip_frame;
+	MediaFrame canvas;
+	malloc_media_frame(&main_frame);
+	malloc_media_frame(&pip_frame);
+	malloc_media_frame(&canvas);
+	std::vector<MediaPacket> packets;
+
+	int frames = 0;
+	double composite_ms = 0;
+	bool pip_running = true;
+	while (decode_next_frame_video(&main_video, &main_frame) == 0) {
+		//The inset holds its last picture once its file ends.
+		if (pip_running && decode_next_frame_video(&pip_video, &pip_frame) < 0) {
+			pip_running = false;
+		}
+		media_compositor_set_frame(&compositor, main_layer, main_frame.video_frame);
+		media_compositor_set_frame(&compositor, pip_layer, pip_frame.video_frame->buf[0] ? pip_frame.video_frame : NULL);
+		compositor.layers[title_layer].opacity = static_cast<float>(FFMIN(main_frame.frame_pts_seconds, 1.0));
+
+		//The encoder may still hold the last canvas, a new one is allocated in that case.
+		if (av_frame_is_writable(canvas.video_frame) == 0) {
+			av_frame_unref(canvas.video_frame);
+		}
+		auto start = std::chrono::steady_clock::now();
+		media_compositor_render(&compositor, canvas.video_frame);
+		composite_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		frames++;
+
+		canvas.video_frame->pts = main_frame.video_frame->pts;
+		if (encode_next_frame_video(&output_container, &canvas, packets, main_video.time_base, video_to) > 0) {
+			open_media_write_packets(&output_container, packets);
+		}
+	}
+	encode_flush_video(&output_container, packets, main_video.time_base, video_to);
+	open_media_write_packets(&output_container, packets);
+
+	std::cout << frames << " frames, " << composite_ms / FFMAX(frames, 1) << " ms compositing per frame" << std::endl;
+
+	open_media_write_trailer(&output_container);
+	free_media_frame(&canvas);
+	free_media_frame(&pip_frame);
+	free_media_frame(&main_frame);
+	free_media_compositor(&compositor);
+	free_media_container(&output_container);
+	free_media_container(&pip_video);
+	free_media_container(&main_video);
+	return 0;
+}
+
+//Fast forward at any speed, 8 or 32 for scanning long recordings.
+int play_file_trickplay(std::string filename, double speed) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, filename.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaTrickPlay trick;
+	if (media_trickplay_start(&video, &trick, speed, 1.0 / 30.0, 0) < 0) {
+		free_media_container(&video);
+		return -1;
+	}
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+	bool media_error = false;
+
+	Graphics gfx{ video.codec_description.video_codec_context->width, video.codec_description.video_codec_context->height };
+	gfx.init();
+	gfx.error_check();
+
+	while (!gfx.livestatus() && !media_error)
+	{
+		gfx.startFrame();
+
+		if (media_trickplay_next_frame(&video, &trick, &frame) < 0) {
+			media_error = true;
+		}
+		else {
+			gfx.bindScreenQuad();
+			gfx.bindTexture(frame.video_frame->data);
+			gfx.draw(trick.presentation_seconds);
+		}
+		gfx.endFrame();
+	}
+
+	media_trickplay_stop(&video, &trick);
+	free_media_frame(&frame);
+	free_media_container(&video);
+
+	return 0;
+}
+
+//Plays from the end of the file back to the start.
+int play_file_reverse(std::string filename) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, filename.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaReverseIterator iterator;
+	if (malloc_media_reverse_iterator(&iterator, &video, INT64_MAX) < 0) {
+		free_media_container(&video);
+		return -1;
+	}
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+	bool media_error = false;
+	double end_seconds = -1.0;
+
+	Graphics gfx{ video.codec_description.video_codec_context->width, video.codec_description.video_codec_context->height };
+	gfx.init();
+	gfx.error_check();
+
+	while (!gfx.livestatus() && !media_error)
+	{
+		gfx.startFrame();
+
+		if (media_reverse_next_frame(&iterator, &frame) < 0) {
+			media_error = true;
+		}
+		else {
+			//Timestamps run backwards, present relative to the last frame of the file.
+			if (end_seconds < 0) {
+				end_seconds = frame.frame_pts_seconds;
+			}
+			gfx.bindScreenQuad();
+			gfx.bindTexture(frame.video_frame->data);
+			gfx.draw(end_seconds - frame.frame_pts_seconds);
+		}
+		gfx.endFrame();
+	}
+
+	free_media_frame(&frame);
+	free_media_reverse_iterator(&iterator);
+	free_media_container(&video);
+
+	return 0;
+}
+
+//Jumps back and forth like a user dragging the timeline playhead, the second sweep should be served from the cache.
+int scrub_file(std::string filename) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, filename.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaFrameCache cache;
+	malloc_media_frame_cache(&cache, 512LL * 1024 * 1024, 1);
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	AVRational time_base = video.format_context->streams[video.m_video_stream_index]->time_base;
+	double positions[] = { 1.0, 1.5, 4.0, 1.2, 3.9, 4.4, 1.0, 2.0 };
+	for (int sweep = 0; sweep < 2; sweep++) {
+		for (double seconds : positions) {
+			int64_t pts = av_rescale_q(static_cast<int64_t>(seconds * AV_TIME_BASE), AV_TIME_BASE_Q, time_base);
+			if (media_frame_cache_get(&cache, &video, pts, &frame) == 0) {
+				std::cout << "Asked " << seconds << "s, got frame at " << frame.frame_pts_seconds << "s" << std::endl;
+			}
+		}
+	}
+
+	std::cout << "Hits: " << cache.hits << ", misses: " << cache.misses << ", evictions: " << cache.evictions << ", prefetched GOPs: " << cache.prefetched << ", over budget GOPs: " << cache.oversized
+		<< ", bytes: " << cache.used << std::endl;
+
+	free_media_frame(&frame);
+	free_media_frame_cache(&cache);
+	free_media_container(&video);
+	return 0;
+}
+
 int remux_file(std::string input, std::string output) {
 	MediaContainer input_container;
 	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
@@ -59,19 +482,410 @@ int remux_file(std::string input, std::string output) {
 		return -1;
 	}
 
-	populate_codecs_copy(&input_container, &output_container);
+	populate_codecs_copy(&input_container, &output_container);
+
+	open_media_write_header(&output_container);
+
+	remux_media_data(&input_container, &output_container);
+
+	open_media_write_trailer(&output_container);
+
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+}
+
+int trim_file(std::string input, std::string output, const std::vector<MediaTrimRange>& ranges) {
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_copy(&input_container, &output_container);
+
+	open_media_write_header(&output_container);
+
+	//Ranges are cut on keyframes, so each clip may start a little before the requested time.
+	remux_media_data_ranges(&input_container, &output_container, ranges);
+
+	open_media_write_trailer(&output_container);
+
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+	return 0;
+}
+
+int render_timeline(std::string input, std::string output) {
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	//Output streams are copies of the source, only the cut points get re-encoded.
+	populate_codecs_copy(&input_container, &output_container);
+
+	open_media_write_header(&output_container);
+
+	MediaTimeline timeline;
+	malloc_media_timeline(&timeline);
+	media_timeline_add_clip(&timeline, &input_container, 2.5, 10.0);
+	media_timeline_add_clip(&timeline, &input_container, 20.2, 31.7);
+	media_timeline_add_clip(&timeline, &input_container, 5.0, 8.0);
+
+	media_timeline_render(&timeline, &output_container);
+	std::cout << "Packets copied: " << timeline.packets_copied << ", frames re-encoded: " << timeline.frames_encoded << std::endl;
+
+	open_media_write_trailer(&output_container);
+
+	free_media_timeline(&timeline);
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+	return 0;
+}
+
+//Same edit as render_timeline, rendering it twice shows the second export coming entirely from the cache.
+int render_timeline_cached(std::string input, std::string output, std::string cache_directory) {
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	MediaRenderCache cache;
+	malloc_media_render_cache(&cache, cache_directory.c_str(), 512LL * 1024 * 1024);
+
+	MediaTimeline timeline;
+	malloc_media_timeline(&timeline);
+	media_timeline_add_clip(&timeline, &input_container, 2.5, 10.0);
+	media_timeline_add_clip(&timeline, &input_container, 20.2, 31.7);
+	media_timeline_add_clip(&timeline, &input_container, 5.0, 8.0);
+
+	for (int pass = 0; pass < 2; pass++) {
+		MediaContainer output_container;
+		malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+		if (open_media(&output_container, output.c_str()) < 0) {
+			return -1;
+		}
+
+		populate_codecs_copy(&input_container, &output_container);
+
+		open_media_write_header(&output_container);
+		media_timeline_render_cached(&timeline, &output_container, &cache);
+		open_media_write_trailer(&output_container);
+		free_media_container(&output_container);
+
+		std::cout << "Pass " << pass << ", cache hits: " << cache.hits << ", misses: " << cache.misses << ", bytes: " << cache.used << std::endl;
+	}
+
+	free_media_timeline(&timeline);
+	free_media_render_cache(&cache);
+	free_media_container(&input_container);
+	return 0;
+}
+
+//Every frame of the file as a numbered JPEG.
+int export_frames(std::string input, std::string directory) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaImageExporter exporter;
+	malloc_media_image_exporter(&exporter, MEDIA_IMAGE_JPEG, directory.c_str(), "frame_%06d", 0);
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	int number = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (decode_next_frame_video(&video, &frame) == 0) {
+		media_image_export(&exporter, frame.video_frame, number++);
+	}
+	media_image_exporter_flush(&exporter);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Written: " << exporter.written << ", failures: " << exporter.failures << ", " << number / elapsed << " frames/s" << std::endl;
+
+	free_media_frame(&frame);
+	free_media_image_exporter(&exporter);
+	free_media_container(&video);
+	return 0;
+}
+
+//Numbered PNG/JPEG stills to H.264 at 25 fps, images are loaded on a pool so the encoder sets the pace.
+int sequence_to_video(std::string pattern, std::string output) {
+	MediaImageSequence sequence;
+	if (malloc_media_image_sequence(&sequence, pattern.c_str(), 0, { 25, 1 }, 16, 0) < 0) {
+		return -1;
+	}
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+	if (open_media(&output_container, output.c_str()) < 0) {
+		free_media_image_sequence(&sequence);
+		return -1;
+	}
+
+	//No sound in a sequence, the audio track stays empty.
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, sequence.width, sequence.height,
+		AV_PIX_FMT_YUV420P, 0, 0, 0, 0, 25, 48000);
+
+	open_media_write_header(&output_container);
+	AVRational video_to = output_container.format_context->streams[output_container.m_video_stream_index]->time_base;
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+	std::vector<MediaPacket> packets;
+
+	int frames = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (decode_next_frame_video(&sequence, &frame) == 0) {
+		if (encode_next_frame_video(&output_container, &frame, packets, sequence.time_base, video_to) > 0) {
+			open_media_write_packets(&output_container, packets);
+		}
+		frames++;
+	}
+	encode_flush_video(&output_container, packets, sequence.time_base, video_to);
+	open_media_write_packets(&output_container, packets);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Encoded " << frames << " images, " << frames / elapsed << " frames/s" << std::endl;
+
+	open_media_write_trailer(&output_container);
+	free_media_frame(&frame);
+	free_media_image_sequence(&sequence);
+	free_media_container(&output_container);
+	return 0;
+}
+
+//The other direction, every frame as a numbered PNG that sequence_to_video can read back.
+int video_to_sequence(std::string input, std::string directory) {
+	MediaContainer video;
+
+	malloc_media_container(&video, MEDIA_FILE_INPUT);
+	if (open_media(&video, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&video);
+
+	MediaImageExporter exporter;
+	malloc_media_image_exporter(&exporter, MEDIA_IMAGE_PNG, directory.c_str(), "frame_%06d", 0);
+
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	int number = 0;
+	while (decode_next_frame_video(&video, &frame) == 0) {
+		media_image_export(&exporter, frame.video_frame, number++);
+	}
+	media_image_exporter_flush(&exporter);
+
+	free_media_frame(&frame);
+	free_media_image_exporter(&exporter);
+	free_media_container(&video);
+	return 0;
+}
+
+//100 thumbnails per asset, tiled 10x10 into one sprite sheet with a WebVTT cue file next to it.
+int storyboard_files(std::vector<std::string> inputs) {
+	MediaThumbnailEngine engine;
+	malloc_media_thumbnail_engine(&engine, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	for (const std::string& input : inputs) {
+		MediaThumbnailRequest request;
+		request.source = input;
+		request.prefix = input + ".storyboard";
+		request.count = 100;
+		request.width = 160;
+		request.height = 90;
+		request.columns = 10;
+		request.rows = 10;
+		media_thumbnail_submit(&engine, &request);
+	}
+	media_thumbnail_wait(&engine);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Thumbnails: " << engine.thumbnails << ", sheets: " << engine.sheets << ", failures: " << engine.failures << " in " << elapsed << "s" << std::endl;
+	free_media_thumbnail_engine(&engine);
+	return 0;
+}
+
+//Proxies for every source on a background pool, polled for progress the way an editor would update its media bin.
+int generate_proxies(std::vector<std::string> inputs) {
+	MediaProxyGenerator generator;
+	if (malloc_media_proxy_generator(&generator, 0, 540, AV_CODEC_ID_MJPEG) < 0) {
+		return -1;
+	}
+
+	std::vector<MediaProxyJob*> jobs;
+	for (const std::string& input : inputs) {
+		jobs.push_back(media_proxy_submit(&generator, input.c_str(), (input + ".proxy.mov").c_str()));
+	}
+
+	bool finished = false;
+	while (!finished) {
+		finished = true;
+		for (MediaProxyJob* job : jobs) {
+			std::cout << job->source << ": " << static_cast<int>(job->progress * 100) << "% ";
+			finished = finished && job->state >= MEDIA_PROXY_DONE;
+		}
+		std::cout << std::endl;
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	}
+
+	media_proxy_wait(&generator);
+	for (MediaProxyJob* job : jobs) {
+		if (job->state == MEDIA_PROXY_FAILED) {
+			std::cout << "Proxy failed: " << job->error << std::endl;
+		}
+	}
+	free_media_proxy_generator(&generator);
+	return 0;
+}
+
+//Scrubs the edit on the proxy made by generate_proxies, then renders the same edit from the full resolution source.
+int edit_on_proxy(std::string input, std::string output) {
+	MediaContainer input_container;
+	MediaContainer proxy_container;
+	MediaContainer output_container;
+
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	malloc_media_container(&proxy_container, MEDIA_FILE_INPUT);
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+	if (open_media(&input_container, input.c_str()) < 0 || open_media(&proxy_container, (input + ".proxy.mov").c_str()) < 0 ||
+		open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+	populate_codecs_source(&proxy_container);
+	populate_codecs_copy(&input_container, &output_container);
+
+	MediaTimeline timeline;
+	malloc_media_timeline(&timeline);
+	media_timeline_add_clip(&timeline, &input_container, 2.5, 10.0);
+	media_timeline_add_clip(&timeline, &input_container, 20.2, 31.7);
+	media_timeline_attach_proxy(&timeline, &input_container, &proxy_container);
+	timeline.use_proxies = true;
+
+	MediaFrameCache cache;
+	malloc_media_frame_cache(&cache, 256LL * 1024 * 1024, 1);
+	MediaFrame frame;
+	malloc_media_frame(&frame);
+
+	double positions[] = { 0.0, 3.0, 7.4, 12.0, 1.0 };
+	for (double seconds : positions) {
+		if (media_timeline_preview(&timeline, &cache, seconds, &frame) == 0) {
+			std::cout << "Edit at " << seconds << "s shows proxy frame at " << frame.frame_pts_seconds << "s, " << frame.video_frame->width << "x"
+				<< frame.video_frame->height << std::endl;
+		}
+	}
+
+	free_media_frame(&frame);
+	free_media_frame_cache(&cache);
+
+	open_media_write_header(&output_container);
+	media_timeline_render(&timeline, &output_container);
+	open_media_write_trailer(&output_container);
+	std::cout << "Packets copied: " << timeline.packets_copied << ", frames re-encoded: " << timeline.frames_encoded << std::endl;
+
+	free_media_timeline(&timeline);
+	free_media_container(&input_container);
+	free_media_container(&proxy_container);
+	free_media_container(&output_container);
+	return 0;
+}
+
+int concat_files(std::vector<std::string> inputs, std::string output) {
+	std::vector<MediaContainer*> input_containers;
+	if (open_media_parallel(inputs, input_containers) < 0) {
+		free_media_containers(input_containers);
+		return -1;
+	}
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	//First input decides the output streams, matching inputs are copied and the rest re-encoded to fit.
+	populate_codecs_copy(input_containers[0], &output_container);
+
+	open_media_write_header(&output_container);
+	concat_media_data(input_containers, &output_container);
+	open_media_write_trailer(&output_container);
+
+	free_media_containers(input_containers);
+	free_media_container(&output_container);
+	return 0;
+}
+
+int transcode_file_264_to_265(std::string input, std::string output) {
+
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_user(&output_container, AV_CODEC_ID_HEVC, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
+		input_container.codec_description.m_pix_fmt, 2.5 * 1000 * 1000, 4 * 1000 * 1000, 2 * 1000 * 1000, 4 * 1000 * 1000, input_container.time_base.den,
+		input_container.codec_description.m_audio_sample_rate);
+
+	//populate_codecs_user(&output_container, AV_CODEC_ID_HEVC, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
+	//	input_container.codec_description.m_pix_fmt, input_container.codec_description.m_bitrate, input_container.codec_description.m_rc_buffer_size, input_container.codec_description.m_rcmaxrate, input_container.codec_description.m_rcminrate,  input_container.m_fps,
+	//	input_container.codec_description.m_audio_sample_rate);
 
 	open_media_write_header(&output_container);
 
-	remux_media_data(&input_container, &output_container);
+	transcode_media(&input_container, &output_container, NULL);
 
 	open_media_write_trailer(&output_container);
-
 	free_media_container(&input_container);
 	free_media_container(&output_container);
 }
 
-int transcode_file_264_to_265(std::string input, std::string output) {
+int transcode_file_264_to_265_default_settings(std::string input, std::string output) {
 
 	MediaContainer input_container;
 	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
@@ -89,69 +903,70 @@ int transcode_file_264_to_265(std::string input, std::string output) {
 	}
 
 	populate_codecs_user(&output_container, AV_CODEC_ID_HEVC, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
-		input_container.codec_description.m_pix_fmt, 2.5 * 1000 * 1000, 4 * 1000 * 1000, 2 * 1000 * 1000, 4 * 1000 * 1000, input_container.time_base.den,
+		input_container.codec_description.m_pix_fmt, 0,0,0,0, input_container.time_base.den,
 		input_container.codec_description.m_audio_sample_rate);
 
-	//populate_codecs_user(&output_container, AV_CODEC_ID_HEVC, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
-	//	input_container.codec_description.m_pix_fmt, input_container.codec_description.m_bitrate, input_container.codec_description.m_rc_buffer_size, input_container.codec_description.m_rcmaxrate, input_container.codec_description.m_rcminrate,  input_container.m_fps,
-	//	input_container.codec_description.m_audio_sample_rate);
-
 	open_media_write_header(&output_container);
 
-	MediaFrame frame;
-	malloc_media_frame(&frame);
+	transcode_media(&input_container, &output_container, NULL);
 
-	MediaPacket pkt_video;
-	malloc_media_packet(&pkt_video);
+	open_media_write_trailer(&output_container);
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+}
 
-	MediaPacket pkt_audio;
-	malloc_media_packet(&pkt_audio);
+//Output must be .ts, run it again after an interruption and it picks up from the last checkpoint.
+int transcode_file_resumable(std::string input, std::string output) {
 
-	bool media_error = false;
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
 
-	while (!media_error)
-	{
-		if ((decode_next_frame_video(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container.format_context->streams[input_container.m_video_stream_index]->time_base, output_container.format_context->streams[output_container.m_video_stream_index]->time_base);
-			if (resp_v == 0) {
-				//Only if packet fully encoded, write.
-				open_media_write_packet(&output_container, &pkt_video);
-			}
-		}
+	populate_codecs_source(&input_container);
 
-	}
+	std::string journal = output + ".journal";
+	MediaTranscodeCheckpoint checkpoint;
+	bool resume = media_checkpoint_read(journal.c_str(), &checkpoint) == 0;
 
-	media_error = false;
-	reset_input_container_state(&input_container);
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
 
-	while (!media_error)
-	{
-		if ((decode_next_frame_audio(&input_container, &frame) < 0)) {
-			media_error = true;
+	if (resume) {
+		std::cout << "Resuming at byte " << checkpoint.output_offset << std::endl;
+		if (open_media_resume(&output_container, output.c_str(), &checkpoint) < 0) {
+			return -1;
 		}
-		else {
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container.format_context->streams[input_container.m_audio_stream_index]->time_base, output_container.format_context->streams[output_container.m_audio_stream_index]->time_base);
+	}
+	else if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
+	}
 
-			if (resp_a == 0) {
-				open_media_write_packet(&output_container, &pkt_audio);
-			}
-		}
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
+		input_container.codec_description.m_pix_fmt, 2.5 * 1000 * 1000, 4 * 1000 * 1000, 2 * 1000 * 1000, 4 * 1000 * 1000, input_container.time_base.den,
+		input_container.codec_description.m_audio_sample_rate);
+
+	open_media_write_header(&output_container);
+
+	MediaTranscodeOptions options;
+	media_transcode_options_init(&options);
+	options.checkpoint_journal = journal.c_str();
+	options.checkpoint_interval = 10.0;
+	options.resume = resume ? &checkpoint : NULL;
 
+	if (transcode_media(&input_container, &output_container, &options) == 0) {
+		open_media_write_trailer(&output_container);
+		media_checkpoint_remove(journal.c_str());
 	}
 
-	open_media_write_trailer(&output_container);
-	free_media_frame(&frame);
-	free_media_packet(&pkt_video);
-	free_media_packet(&pkt_audio);
 	free_media_container(&input_container);
 	free_media_container(&output_container);
+	return 0;
 }
 
-int transcode_file_264_to_265_default_settings(std::string input, std::string output) {
-
+//Deinterlace, downscale to 720p and convert to 30 fps inside one filter graph on four slice threads before H.264 encoding.
+int transcode_file_filtered(std::string input, std::string output) {
 	MediaContainer input_container;
 	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
 	if (open_media(&input_container, input.c_str()) < 0) {
@@ -162,67 +977,182 @@ int transcode_file_264_to_265_default_settings(std::string input, std::string ou
 
 	MediaContainer output_container;
 	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
-
 	if (open_media(&output_container, output.c_str()) < 0) {
 		return -1;
 	}
 
-	populate_codecs_user(&output_container, AV_CODEC_ID_HEVC, AV_CODEC_ID_AAC, input_container.m_width, input_container.m_height,
-		input_container.codec_description.m_pix_fmt, 0,0,0,0, input_container.time_base.den,
+	//The encoder size has to match what the graph puts out.
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, 1280, 720, AV_PIX_FMT_YUV420P, 0, 0, 0, 0, 30,
 		input_container.codec_description.m_audio_sample_rate);
 
 	open_media_write_header(&output_container);
 
-	MediaFrame frame;
-	malloc_media_frame(&frame);
+	MediaTranscodeOptions options;
+	media_transcode_options_init(&options);
+	options.video_filter = "yadif=deint=interlaced,scale=1280:720,fps=30";
+	options.filter_threads = 4;
 
-	MediaPacket pkt_video;
-	malloc_media_packet(&pkt_video);
-
-	MediaPacket pkt_audio;
-	malloc_media_packet(&pkt_audio);
+	if (transcode_media(&input_container, &output_container, &options) == 0) {
+		open_media_write_trailer(&output_container);
+	}
 
-	bool media_error = false;
+	free_media_container(&input_container);
+	free_media_container(&output_container);
+	return 0;
+}
 
-	while (!media_error)
-	{
-		if ((decode_next_frame_video(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container.format_context->streams[input_container.m_video_stream_index]->time_base, output_container.format_context->streams[output_container.m_video_stream_index]->time_base);
-			if (resp_v == 0) {
-				//Only if packet fully encoded, write.
-				open_media_write_packet(&output_container, &pkt_video);
-			}
+//Dialogue over a music bed that is ducked to 30%, fades in over two seconds and out over the last five of the dialogue.
+int mix_files(std::string dialogue, std::string music, std::string output) {
+	MediaContainer inputs[2];
+	std::string paths[2] = { dialogue, music };
+	for (int i = 0; i < 2; i++) {
+		malloc_media_container(&inputs[i], MEDIA_FILE_INPUT);
+		if (open_media(&inputs[i], paths[i].c_str()) < 0) {
+			return -1;
 		}
+		populate_codecs_source(&inputs[i]);
+	}
 
+	MediaContainer output_container;
+	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
+	if (open_media(&output_container, output.c_str()) < 0) {
+		return -1;
 	}
 
-	media_error = false;
-	reset_input_container_state(&input_container);
+	//Audio only, the video track stays empty.
+	populate_codecs_user(&output_container, AV_CODEC_ID_H264, AV_CODEC_ID_AAC, inputs[0].m_width, inputs[0].m_height,
+		AV_PIX_FMT_YUV420P, 0, 0, 0, 0, 25, 48000);
+	open_media_write_header(&output_container);
 
-	while (!media_error)
-	{
-		if ((decode_next_frame_audio(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container.format_context->streams[input_container.m_audio_stream_index]->time_base, output_container.format_context->streams[output_container.m_audio_stream_index]->time_base);
+	AVCodecContext* encoder = output_container.codec_description.audio_codec_context;
+	AVRational audio_to = output_container.format_context->streams[output_container.m_audio_stream_index]->time_base;
+
+	MediaAudioMixer mixer;
+	malloc_media_audio_mixer(&mixer, encoder);
+	media_audio_mixer_add_track(&mixer, 1.0f, 0.0);
+	int bed = media_audio_mixer_add_track(&mixer, 0.3f, 0.0);
+	mixer.tracks[bed].fade_in = 2.0;
+	if (inputs[0].format_context->duration > 0) {
+		double length = inputs[0].format_context->duration / static_cast<double>(AV_TIME_BASE);
+		mixer.tracks[bed].fade_out_start = FFMAX(length - 5.0, 0.0);
+		mixer.tracks[bed].fade_out = 5.0;
+	}
 
-			if (resp_a == 0) {
-				open_media_write_packet(&output_container, &pkt_audio);
+	MediaFrame frame;
+	MediaFrame mixed;
+	malloc_media_frame(&frame);
+	malloc_media_frame(&mixed);
+	std::vector<MediaPacket> packets;
+
+	//The bed ends with the dialogue even if the music runs longer.
+	bool running[2] = { true, true };
+	while (running[0] || running[1]) {
+		for (int i = 0; i < 2; i++) {
+			if (!running[i]) {
+				continue;
+			}
+			if (decode_next_frame_audio(&inputs[i], &frame) == 0 && (i == 0 || running[0])) {
+				media_audio_mixer_submit(&mixer, i, frame.audio_frame);
+			}
+			else {
+				media_audio_mixer_submit(&mixer, i, NULL);
+				running[i] = false;
+			}
+		}
+		while (media_audio_mixer_receive(&mixer, mixed.audio_frame) == 0) {
+			if (encode_next_frame_audio(&output_container, &mixed, packets, av_make_q(1, mixer.sample_rate), audio_to) > 0) {
+				open_media_write_packets(&output_container, packets);
 			}
 		}
-
 	}
+	encode_flush_audio(&output_container, packets, av_make_q(1, mixer.sample_rate), audio_to);
+	open_media_write_packets(&output_container, packets);
 
 	open_media_write_trailer(&output_container);
+	free_media_frame(&mixed);
 	free_media_frame(&frame);
-	free_media_packet(&pkt_video);
-	free_media_packet(&pkt_audio);
-	free_media_container(&input_container);
+	free_media_audio_mixer(&mixer);
 	free_media_container(&output_container);
+	free_media_container(&inputs[1]);
+	free_media_container(&inputs[0]);
+	return 0;
+}
+
+//16 stereo tracks at 44.1kHz mixed to 48kHz float planar, reported as the share of one core needed for realtime.
+int benchmark_audio_mixer() {
+	const int tracks = 16;
+	const int seconds = 20;
+
+	MediaAudioMixer mixer;
+	malloc_media_audio_mixer(&mixer, 48000, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLTP, 1024);
+	for (int i = 0; i < tracks; i++) {
+		media_audio_mixer_add_track(&mixer, 1.0f / tracks, 0.0);
+	}
+
+	AVFrame* input = av_frame_alloc();
+	input->nb_samples = 1024;
+	input->format = AV_SAMPLE_FMT_FLTP;
+	input->sample_rate = 44100;
+	input->channel_layout = AV_CH_LAYOUT_STEREO;
+	input->channels = 2;
+	av_frame_get_buffer(input, 0);
+	for (int c = 0; c < 2; c++) {
+		float* samples = reinterpret_cast<float*>(input->extended_data[c]);
+		for (int n = 0; n < input->nb_samples; n++) {
+			samples[n] = 0.5f * sinf(n * 0.05f * (c + 1));
+		}
+	}
+
+	AVFrame* output = av_frame_alloc();
+	int frames = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int64_t fed = 0; fed < static_cast<int64_t>(seconds) * 44100; fed += input->nb_samples) {
+		for (int i = 0; i < tracks; i++) {
+			media_audio_mixer_submit(&mixer, i, input);
+		}
+		while (media_audio_mixer_receive(&mixer, output) == 0) {
+			frames++;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << frames << " frames mixed, " << 100.0 * elapsed / seconds << "% of one core" << std::endl;
+
+	av_frame_free(&output);
+	av_frame_free(&input);
+	free_media_audio_mixer(&mixer);
+	return 0;
+}
+
+//One second of 16kHz mono float every ten seconds, the kind of windows a speech model is fed, written back to back as raw f32le.
+int extract_audio_windows(std::string input, std::string output) {
+	MediaAudioReader reader;
+	if (malloc_media_audio_reader(&reader, input.c_str(), 16000, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLT) < 0) {
+		return -1;
+	}
+
+	FILE* file = fopen(output.c_str(), "wb");
+	if (!file) {
+		free_media_audio_reader(&reader);
+		return -1;
+	}
+
+	std::vector<float> window(reader.sample_rate);
+	uint8_t* data[1] = { reinterpret_cast<uint8_t*>(window.data()) };
+	int windows = 0;
+	for (int64_t start = 0; media_audio_reader_seek(&reader, start) == 0; start += 10 * static_cast<int64_t>(reader.sample_rate)) {
+		int count = media_audio_reader_read(&reader, data, static_cast<int>(window.size()));
+		if (count <= 0) {
+			break;
+		}
+		fwrite(window.data(), sizeof(float), count, file);
+		windows++;
+	}
+	std::cout << windows << " windows extracted" << std::endl;
+
+	fclose(file);
+	free_media_audio_reader(&reader);
+	return 0;
 }
 
 int transcode_file_264_to_vp9_default_settings(std::string input, std::string output) {
@@ -252,54 +1182,9 @@ int transcode_file_264_to_vp9_default_settings(std::string input, std::string ou
 
 	open_media_write_header(&output_container);
 
-	MediaFrame frame;
-	malloc_media_frame(&frame);
-
-	MediaPacket pkt_video;
-	malloc_media_packet(&pkt_video);
-
-	MediaPacket pkt_audio;
-	malloc_media_packet(&pkt_audio);
-
-	bool media_error = false;
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_video(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container.format_context->streams[input_container.m_video_stream_index]->time_base, output_container.format_context->streams[output_container.m_video_stream_index]->time_base);
-			if (resp_v == 0) {
-				//Only if packet fully encoded, write.
-				open_media_write_packet(&output_container, &pkt_video);
-			}
-		}
-
-	}
-
-	media_error = false;
-	reset_input_container_state(&input_container);
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_audio(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container.format_context->streams[input_container.m_audio_stream_index]->time_base, output_container.format_context->streams[output_container.m_audio_stream_index]->time_base);
-
-			if (resp_a == 0) {
-				open_media_write_packet(&output_container, &pkt_audio);
-			}
-		}
-
-	}
+	transcode_media(&input_container, &output_container, NULL);
 
 	open_media_write_trailer(&output_container);
-	free_media_frame(&frame);
-	free_media_packet(&pkt_video);
-	free_media_packet(&pkt_audio);
 	free_media_container(&input_container);
 	free_media_container(&output_container);
 }
@@ -327,54 +1212,9 @@ int transcode_file_264_to_vp8_Opus_default_settings(std::string input, std::stri
 
 	open_media_write_header(&output_container);
 
-	MediaFrame frame;
-	malloc_media_frame(&frame);
-
-	MediaPacket pkt_video;
-	malloc_media_packet(&pkt_video);
-
-	MediaPacket pkt_audio;
-	malloc_media_packet(&pkt_audio);
-
-	bool media_error = false;
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_video(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container.format_context->streams[input_container.m_video_stream_index]->time_base, output_container.format_context->streams[output_container.m_video_stream_index]->time_base);
-			if (resp_v == 0) {
-				//Only if packet fully encoded, write.
-				open_media_write_packet(&output_container, &pkt_video);
-			}
-		}
-
-	}
-
-	media_error = false;
-	reset_input_container_state(&input_container);
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_audio(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container.format_context->streams[input_container.m_audio_stream_index]->time_base, output_container.format_context->streams[output_container.m_audio_stream_index]->time_base);
-
-			if (resp_a == 0) {
-				open_media_write_packet(&output_container, &pkt_audio);
-			}
-		}
-
-	}
+	transcode_media(&input_container, &output_container, NULL);
 
 	open_media_write_trailer(&output_container);
-	free_media_frame(&frame);
-	free_media_packet(&pkt_video);
-	free_media_packet(&pkt_audio);
 	free_media_container(&input_container);
 	free_media_container(&output_container);
 }
@@ -402,54 +1242,9 @@ int transcode_file_264_to_264_diff_size_default_settings(std::string input, std:
 
 	open_media_write_header(&output_container);
 
-	MediaFrame frame;
-	malloc_media_frame(&frame);
-
-	MediaPacket pkt_video;
-	malloc_media_packet(&pkt_video);
-
-	MediaPacket pkt_audio;
-	malloc_media_packet(&pkt_audio);
-
-	bool media_error = false;
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_video(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container.time_base, output_container.time_base);
-			if (resp_v == 0) {
-				//Only if packet fully encoded, write.
-				open_media_write_packet(&output_container, &pkt_video);
-			}
-		}
-
-	}
-
-	media_error = false;
-	reset_input_container_state(&input_container);
-
-	while (!media_error)
-	{
-		if ((decode_next_frame_audio(&input_container, &frame) < 0)) {
-			media_error = true;
-		}
-		else {
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container.time_base, output_container.time_base);
-
-			if (resp_a == 0) {
-				open_media_write_packet(&output_container, &pkt_audio);
-			}
-		}
-
-	}
+	transcode_media(&input_container, &output_container, NULL);
 
 	open_media_write_trailer(&output_container);
-	free_media_frame(&frame);
-	free_media_packet(&pkt_video);
-	free_media_packet(&pkt_audio);
 	free_media_container(&input_container);
 	free_media_container(&output_container);
 }
@@ -464,9 +1259,6 @@ int transcode_a_file_using_buffer(std::string input, std::string output) {
 
 	populate_codecs_source(&input_container1);
 
-	MediaFileStreamingBuffer buffer;
-	malloc_media_file_stream_container(&buffer, input_container1.time_base.num, input_container1.time_base.den, input_container1.m_fps); //We decide to convert all packets to input1 timespace.
-
 	MediaContainer output_container;
 	malloc_media_container(&output_container, MEDIA_FILE_OUTPUT);
 
@@ -479,11 +1271,21 @@ int transcode_a_file_using_buffer(std::string input, std::string output) {
 		input_container1.codec_description.m_pix_fmt, 0, 0, 0, 0, input_container1.time_base.den,
 		input_container1.codec_description.m_audio_sample_rate);
 
+	MediaFileStreamingBuffer buffer;
+	AVRational frame_rate = av_guess_frame_rate(input_container1.format_context, input_container1.format_context->streams[input_container1.m_video_stream_index], NULL);
+	malloc_media_file_stream_container(&buffer, input_container1.time_base, frame_rate, output_container.codec_description.audio_codec_context->sample_rate,
+		output_container.codec_description.audio_codec_context->frame_size); //We decide to convert all packets to input1 timespace.
+	media_file_stream_set_packet_time_base(&buffer, output_container.time_base); //Encoded packets come out in the output's time base.
+
+	//Keep at most 64MB of packets in memory, the rest goes to disk until the muxer catches up.
+	media_file_stream_set_budget(&buffer, 0, 64 * 1024 * 1024, MEDIA_BUFFER_SPILL, (output + ".spill").c_str());
+
 	open_media_write_header(&output_container);
 
 	MediaFrame frame;
 	malloc_media_frame(&frame);
 
+	std::vector<MediaPacket> packets;
 	bool media_error = false;
 
 	while (!media_error)
@@ -492,18 +1294,21 @@ int transcode_a_file_using_buffer(std::string input, std::string output) {
 			media_error = true;
 		}
 		else {
-			MediaPacket pkt_video;
-			malloc_media_packet(&pkt_video);
-
-			int resp_v = encode_next_frame_video(&output_container, &frame, &pkt_video, input_container1.time_base, output_container.time_base);
-			if (resp_v == 0) {
-
+			encode_next_frame_video(&output_container, &frame, packets, input_container1.time_base, output_container.time_base);
+			for (MediaPacket& pkt_video : packets) {
 				media_submit_file_stream_packet_video(&buffer, pkt_video);
 			}
+			packets.clear();
 		}
 
 	}
 
+	encode_flush_video(&output_container, packets, input_container1.time_base, output_container.time_base);
+	for (MediaPacket& pkt_video : packets) {
+		media_submit_file_stream_packet_video(&buffer, pkt_video);
+	}
+	packets.clear();
+
 	media_error = false;
 	reset_input_container_state(&input_container1);
 
@@ -513,27 +1318,33 @@ int transcode_a_file_using_buffer(std::string input, std::string output) {
 			media_error = true;
 		}
 		else {
-			MediaPacket pkt_audio;
-			malloc_media_packet(&pkt_audio);
-
-			int resp_a = encode_next_frame_audio(&output_container, &frame, &pkt_audio, input_container1.time_base, output_container.time_base);
-
-			if (resp_a == 0) {
+			encode_next_frame_audio(&output_container, &frame, packets, input_container1.time_base, output_container.time_base);
+			for (MediaPacket& pkt_audio : packets) {
 				media_submit_file_stream_packet_audio(&buffer, pkt_audio);
 			}
+			packets.clear();
 		}
 	}
 
+	encode_flush_audio(&output_container, packets, input_container1.time_base, output_container.time_base);
+	for (MediaPacket& pkt_audio : packets) {
+		media_submit_file_stream_packet_audio(&buffer, pkt_audio);
+	}
+	packets.clear();
+
 
 	MediaPacket pkt;
-	malloc_media_packet(&pkt);
 	
 	while (media_request_file_stream_packet_video(&buffer, pkt) ==  0 ) {
+		av_packet_rescale_ts(pkt.packet, buffer.time_base, output_container.format_context->streams[output_container.m_video_stream_index]->time_base);
 		open_media_write_packet(&output_container, &pkt);
+		free_media_packet(&pkt);
 	}
 
 	while (media_request_file_stream_packet_audio(&buffer, pkt) == 0) {
+		av_packet_rescale_ts(pkt.packet, buffer.time_base, output_container.format_context->streams[output_container.m_audio_stream_index]->time_base);
 		open_media_write_packet(&output_container, &pkt);
+		free_media_packet(&pkt);
 	}
 
 	open_media_write_trailer(&output_container);
@@ -543,6 +1354,59 @@ int transcode_a_file_using_buffer(std::string input, std::string output) {
 	free_media_container(&output_container);
 }
 
+int transcode_file_abr_ladder(std::string input, std::string output_prefix) {
+
+	MediaContainer input_container;
+	malloc_media_container(&input_container, MEDIA_FILE_INPUT);
+	if (open_media(&input_container, input.c_str()) < 0) {
+		return -1;
+	}
+
+	populate_codecs_source(&input_container);
+
+	//Source resolution, 720p and 360p, all decoded from one pass over the input.
+	const int rung_count = 3;
+	int widths[rung_count] = { input_container.m_width, 1280, 640 };
+	int heights[rung_count] = { input_container.m_height, 720, 360 };
+	int bitrates[rung_count] = { 5 * 1000 * 1000, 2500 * 1000, 800 * 1000 };
+
+	MediaRenditionLadder ladder;
+	if (malloc_media_rendition_ladder(&ladder, &input_container, 8) < 0) {
+		return -1;
+	}
+
+	MediaEncoderOptions options;
+	media_encoder_options_init(&options, MEDIA_ENCODER_PROFILE_THROUGHPUT);
+
+	MediaContainer output_containers[rung_count];
+	for (int i = 0; i < rung_count; i++) {
+		malloc_media_container(&output_containers[i], MEDIA_FILE_OUTPUT);
+		std::string output = output_prefix + "_" + std::to_string(heights[i]) + "p.mp4";
+		if (open_media(&output_containers[i], output.c_str()) < 0) {
+			return -1;
+		}
+
+		populate_codecs_user(&output_containers[i], AV_CODEC_ID_H264, AV_CODEC_ID_AAC, widths[i], heights[i],
+			AV_PIX_FMT_YUV420P, bitrates[i], 0, 0, 0, input_container.time_base.den,
+			input_container.codec_description.m_audio_sample_rate, &options);
+		std::cout << output << " -> " << media_encoder_options_to_string(&output_containers[i]) << std::endl;
+
+		open_media_write_header(&output_containers[i]);
+		media_rendition_ladder_add(&ladder, &output_containers[i]);
+	}
+
+	media_rendition_ladder_run(&ladder);
+
+	for (int i = 0; i < rung_count; i++) {
+		open_media_write_trailer(&output_containers[i]);
+		free_media_container(&output_containers[i]);
+	}
+
+	free_media_rendition_ladder(&ladder);
+	free_media_container(&input_container);
+	return 0;
+}
+
 int main()
 {
 	return 0;